@@ -5,234 +5,7140 @@
 #ifndef ENTITIES_HPP_
 #define ENTITIES_HPP_
 
-#include <algorithm> // std::find_if
-#include <forward_list>
+#include <algorithm> // std::sort
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <charconv>
+#include <cmath>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <exception>
 #include <functional>
-#include <map>
+#include <istream>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <numeric>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <tuple>
 #include <type_traits> // std::is_convertible
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
+// System names for profiles come from RTTI where it is enabled
+#if defined(ENTITIES_PROFILE) && (defined(__GXX_RTTI) || defined(_CPPRTTI))
+#include <typeinfo>
+#if __has_include(<cxxabi.h>)
+#include <cxxabi.h>
+#endif
+#endif
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+/**
+ * The size in bytes of one block of archetype storage. Each chunk holds as
+ * many entities of its archetype as fit, with every component type laid out
+ * as its own contiguous array.
+ */
+#ifndef ENTITIES_CHUNK_SIZE
+#define ENTITIES_CHUNK_SIZE (16 * 1024)
+#endif
+
+/**
+ * The number of distinct component types a program may use, which sets the
+ * width of entity signatures. Must be a multiple of 64.
+ */
+#ifndef ENTITIES_MAX_COMPONENTS
+#define ENTITIES_MAX_COMPONENTS 64
+#endif
+
+static_assert(ENTITIES_MAX_COMPONENTS > 0 && ENTITIES_MAX_COMPONENTS % 64 == 0,
+	"ENTITIES_MAX_COMPONENTS must be a multiple of 64");
+
+/**
+ * Define ENTITIES_PROFILE to have SystemManager time each system and count
+ * the entities it visits and the structural changes it makes; see
+ * SystemManager::profile(). Without it, the counting compiles away.
+ */
+
+class XmlElement;
 
 /**
  * @class Component
  * A base class for all components to inherit.
  */
 class Component {
+public:
+	/**
+	 * Reads the component from the given XML element, for XmlLoader.
+	 * Components define their own fromXML() to hide this one; it is found
+	 * through the component's type, so it need not be virtual.
+	 */
+	void fromXML(const XmlElement&) {}
+};
+
+/**
+ * An ID number for entities.
+ * The low bits index the entity's slot within its EntityManager; the high
+ * bits are a version that increases each time the slot is reused, so a
+ * handle to a killed entity never refers to its replacement. Define
+ * ENTITIES_64BIT_IDS for more entities and versions.
+ */
+#ifdef ENTITIES_64BIT_IDS
+using Id = std::uint64_t;
+constexpr unsigned IdIndexBits = 32;
+#else
+using Id = std::uint32_t;
+constexpr unsigned IdIndexBits = 22;
+#endif
+
+/** Masks the index bits of an ID; the all-ones index is never used. */
+constexpr Id IdIndexMask = (Id(1) << IdIndexBits) - 1;
+
+/** An ID that never refers to an entity. */
+constexpr Id NullId = static_cast<Id>(-1);
+
+/** Gets the slot index of an entity ID. */
+constexpr Id idIndex(Id id) {
+	return id & IdIndexMask;
+}
+
+/** Gets the version of an entity ID. */
+constexpr Id idVersion(Id id) {
+	return id >> IdIndexBits;
+}
+
+/** Combines a slot index and version into an entity ID. */
+constexpr Id makeId(Id index, Id version) {
+	return static_cast<Id>(version << IdIndexBits) | index;
+}
+
+/**
+ * A point in an EntityManager's history, used to tell which components have
+ * changed. Ticks wrap around, so compare them with tickAfter().
+ */
+using Tick = std::uint32_t;
+
+/** Tests if tick t comes after since. */
+constexpr bool tickAfter(Tick t, Tick since) {
+	return static_cast<std::int32_t>(t - since) > 0;
+}
+
+/**
+ * @class TypeIndex
+ * Hands out dense, zero-based indices to the types of a family (components,
+ * systems), so that per-type data can be kept in plain arrays.
+ * A type's index is fixed on first use and shared by every translation unit
+ * of the program, without needing RTTI.
+ */
+template<class Family>
+class TypeIndex {
+private:
+	static std::atomic<std::size_t>& counter(void) {
+		static std::atomic<std::size_t> next (0);
+		return next;
+	}
+
+public:
+	/** Gets the index of the given type. */
+	template<class T>
+	static std::size_t of(void) {
+		static const std::size_t index = counter()++;
+		return index;
+	}
+
+	/** Gets the number of types indexed so far. */
+	static std::size_t count(void) {
+		return counter();
+	}
+};
+
+/** A dense index identifying a component type. */
+using ComponentId = std::size_t;
+
+/**
+ * @struct ComponentField
+ * Where one field of a split component sits within the component.
+ */
+struct ComponentField {
+	std::size_t offset;
+	std::size_t size;
+};
+
+/** Gets the type of the data member a member pointer refers to. */
+template<auto Member>
+struct MemberType;
+
+template<class C, class M, M C::*Member>
+struct MemberType<Member> {
+	using type = M;
+};
+
+/**
+ * @struct ComponentFields
+ * Lists the data members of a component, in declaration order. A component
+ * that lists its fields, through ENTITIES_FIELDS, is split in archetype
+ * storage: each field gets an array of its own, so a loop over one field of
+ * many entities runs over plain contiguous memory.
+ */
+template<auto... Members>
+struct ComponentFields {
+	/** The number of fields listed. */
+	static constexpr std::size_t count = sizeof...(Members);
+
+	/** The member pointers, for picking out by position. */
+	static constexpr auto members = std::make_tuple(Members...);
+
+	/** The type of the field at position I. */
+	template<std::size_t I>
+	using Type = typename MemberType<std::get<I>(members)>::type;
+
+	/** Gets the position of a member in the list, count if absent. */
+	template<auto Member>
+	static constexpr std::size_t index(void) {
+		std::size_t i = 0, found = count;
+		((same<Member, Members>() && found == count ? found = i : 0, i++), ...);
+		return found;
+	}
+
+	/** Tests that no member is listed twice. */
+	static constexpr bool distinct(void) {
+		std::size_t i = 0;
+		return ((index<Members>() == i++) && ...);
+	}
+
+	/** Gets the sum of the sizes of the fields. */
+	static constexpr std::size_t bytes(void) {
+		return (0 + ... + sizeof(typename MemberType<Members>::type));
+	}
+
+	/** Describes where each field sits within a T. */
+	template<class T>
+	static std::vector<ComponentField> describe(void) {
+		if constexpr (count == 0) {
+			return {};
+		} else {
+			// The offsets are taken from storage that never holds a T, so no
+			// constructor runs
+			alignas(T) static unsigned char storage[sizeof(T)];
+			auto t = reinterpret_cast<T*>(storage);
+			return {{static_cast<std::size_t>(
+				reinterpret_cast<unsigned char*>(&(t->*Members)) - storage),
+				sizeof(typename MemberType<Members>::type)}...};
+		}
+	}
+
+private:
+	template<auto A, auto B>
+	static constexpr bool same(void) {
+		if constexpr (std::is_same<decltype(A), decltype(B)>::value)
+			return A == B;
+		else
+			return false;
+	}
+};
+
+/**
+ * Declares the fields of a component inside its definition, splitting it
+ * into one array per field in archetype storage, e.g.:
+ *     struct Position : public Component {
+ *         float x, y;
+ *         ENTITIES_FIELDS(&Position::x, &Position::y)
+ *     };
+ * The component must be trivially copyable and the fields must cover it
+ * with no padding. A split component has no address in storage, so it is
+ * reached through each(), which copies it in and out, or eachChunk().
+ */
+#define ENTITIES_FIELDS(...) using EntitiesFields = ::ComponentFields<__VA_ARGS__>;
+
+/** Gets the declared fields of a component type, none if it is not split. */
+template<class T, class = void>
+struct FieldsOf {
+	using type = ComponentFields<>;
+};
+
+template<class T>
+struct FieldsOf<T, std::void_t<typename T::EntitiesFields>> {
+	using type = typename T::EntitiesFields;
+};
+
+/** Tests if a component type is split into one array per field. */
+template<class T>
+constexpr bool isSplit = FieldsOf<std::remove_const_t<T>>::type::count > 0;
+
+/** The largest split component; they are copied through stack buffers. */
+constexpr std::size_t MaxSplitSize = 256;
+
+struct AllocationStats;
+class Pool;
+template<class T>
+class ComponentPool;
+
+/**
+ * @struct ComponentInfo
+ * The type-erased operations needed to store a component type in raw memory.
+ */
+struct ComponentInfo {
+	/** Identifies the component type. */
+	ComponentId id;
+	std::size_t size;
+	std::size_t align;
+
+	/** Move-constructs the component at dst from src, then destroys src. */
+	void (*relocate)(void *dst, void *src);
+	/** Destroys the component at p. */
+	void (*destroy)(void *p);
+	/** Makes an empty sparse set pool for the component type. */
+	Pool *(*makePool)(AllocationStats& stats);
+	/** The fields of a split component, each stored apart; else empty. */
+	std::vector<ComponentField> fields;
+
+	/**
+	 * Fetches the info for the given component type.
+	 */
+	template<class T>
+	static const ComponentInfo& of(void) {
+		using Fields = typename FieldsOf<T>::type;
+		static_assert(Fields::count == 0 || std::is_trivially_copyable<T>::value,
+			"split components must be trivially copyable");
+		static_assert(Fields::distinct() && (Fields::count == 0
+			|| Fields::bytes() == sizeof(T)),
+			"the fields of a split component must cover it with no padding");
+		static_assert(sizeof(T) <= MaxSplitSize || Fields::count == 0,
+			"split components may be at most MaxSplitSize bytes");
+		static const ComponentInfo& info = add(ComponentInfo {
+			TypeIndex<Component>::of<T>(), sizeof(T), alignof(T),
+			[](void *dst, void *src) {
+				new (dst) T(std::move(*static_cast<T*>(src)));
+				static_cast<T*>(src)->~T();
+			},
+			[](void *p) {
+				static_cast<T*>(p)->~T();
+			},
+			[](AllocationStats& stats) -> Pool* {
+				return new ComponentPool<T>(stats);
+			},
+			Fields::template describe<T>()
+		});
+		return info;
+	}
+
+	/**
+	 * Fetches the info for the component type with the given ID.
+	 * @return the info, nullptr if the type has not been used yet
+	 */
+	static const ComponentInfo *get(ComponentId id) {
+		std::lock_guard<std::mutex> lock (registryLock());
+		auto& r = registry();
+		return id < r.size() ? r[id].get() : nullptr;
+	}
+
+private:
+	static std::vector<std::unique_ptr<ComponentInfo>>& registry(void) {
+		static std::vector<std::unique_ptr<ComponentInfo>> infos;
+		return infos;
+	}
+
+	static std::mutex& registryLock(void) {
+		static std::mutex lock;
+		return lock;
+	}
+
+	static const ComponentInfo& add(const ComponentInfo& info) {
+		if (info.id >= ENTITIES_MAX_COMPONENTS)
+			throw std::length_error("too many component types, raise ENTITIES_MAX_COMPONENTS");
+
+		std::lock_guard<std::mutex> lock (registryLock());
+		auto& r = registry();
+		if (info.id >= r.size())
+			r.resize(info.id + 1);
+		r[info.id].reset(new ComponentInfo(info));
+		return *r[info.id];
+	}
+};
+
+/**
+ * Gets the ID of the given component type.
+ */
+template<class T>
+inline ComponentId componentId(void) {
+	return ComponentInfo::of<std::remove_cv_t<T>>().id;
+}
+
+/**
+ * @class Column
+ * The components of one type in a block of entities, as handed to
+ * eachChunk(). A split component is laid out as one array per field,
+ * reached through field(); any other as one array, reached through data().
+ * Loops over these arrays are plain enough for the compiler to vectorize:
+ *     auto x = pos.field<&Position::x>();
+ *     auto vx = vel.field<&Velocity::x>();
+ *     for (std::size_t i = 0; i < pos.size(); i++)
+ *         x[i] += vx[i] * dt;
+ * Declare T const to only read the components.
+ */
+template<class T>
+class Column {
+	using U = std::remove_const_t<T>;
+	using Fields = typename FieldsOf<U>::type;
+
+public:
+	/** The number of arrays the components are laid out in. */
+	static constexpr std::size_t Arrays = Fields::count > 0 ? Fields::count : 1;
+
+private:
+	std::array<void*, Arrays> arrays;
+	std::size_t count;
+
+	template<std::size_t... Is>
+	void loadFields(std::size_t i, U& out, std::index_sequence<Is...>) const {
+		(std::memcpy(&(out.*std::get<Is>(Fields::members)),
+			static_cast<const typename Fields::template Type<Is>*>(arrays[Is]) + i,
+			sizeof(typename Fields::template Type<Is>)), ...);
+	}
+
+	template<std::size_t... Is>
+	void storeFields(std::size_t i, const U& value, std::index_sequence<Is...>) const {
+		(std::memcpy(static_cast<typename Fields::template Type<Is>*>(arrays[Is]) + i,
+			&(value.*std::get<Is>(Fields::members)),
+			sizeof(typename Fields::template Type<Is>)), ...);
+	}
+
+public:
+	/** Wraps the arrays of n components. */
+	Column(const std::array<void*, Arrays>& _arrays, std::size_t n)
+		: arrays(_arrays), count(n) {}
+
+	/** Gets the number of components. */
+	std::size_t size(void) const {
+		return count;
+	}
+
+	/** Gets the array of one field of a split component. */
+	template<auto Member>
+	auto field(void) const {
+		constexpr auto i = Fields::template index<Member>();
+		static_assert(i < Fields::count, "not a declared field of the component");
+		using F = typename MemberType<Member>::type;
+		return static_cast<std::conditional_t<std::is_const<T>::value,
+			const F, F>*>(arrays[i]);
+	}
+
+	/** Gets the array of a component type that is not split. */
+	T *data(void) const {
+		static_assert(Fields::count == 0, "split components are reached through field()");
+		return static_cast<T*>(arrays[0]);
+	}
+
+	/** Gets a component of a type that is not split. */
+	T& operator[](std::size_t i) const {
+		return data()[i];
+	}
+
+	/** Copies the component at index i out to out. */
+	void load(std::size_t i, U& out) const {
+		if constexpr (Fields::count == 0)
+			out = data()[i];
+		else
+			loadFields(i, out, std::make_index_sequence<Fields::count>());
+	}
+
+	/** Copies value into the component at index i. */
+	void store(std::size_t i, const U& value) const {
+		static_assert(!std::is_const<T>::value, "the column is read only");
+		if constexpr (Fields::count == 0)
+			data()[i] = value;
+		else
+			storeFields(i, value, std::make_index_sequence<Fields::count>());
+	}
+};
+
+/**
+ * @class Signature
+ * A bitmask of component IDs, describing the components an entity has or
+ * the ones a query needs. Matching an entity against a query is a mask and
+ * compare over a few words.
+ */
+class Signature {
+public:
+	static constexpr std::size_t Words = ENTITIES_MAX_COMPONENTS / 64;
+
+	std::uint64_t words[Words] = {};
+
+	/** Builds the signature of the given component types. */
+	template<class... Ts>
+	static Signature of(void) {
+		Signature sig;
+		(sig.set(componentId<Ts>()), ...);
+		return sig;
+	}
+
+	void set(ComponentId id) {
+		words[id / 64] |= std::uint64_t(1) << (id % 64);
+	}
+
+	void reset(ComponentId id) {
+		words[id / 64] &= ~(std::uint64_t(1) << (id % 64));
+	}
+
+	void clear(void) {
+		for (auto& w : words)
+			w = 0;
+	}
+
+	bool test(ComponentId id) const {
+		return (words[id / 64] >> (id % 64)) & 1;
+	}
+
+	/** Tests if every bit of mask is also set in this signature. */
+	bool includes(const Signature& mask) const {
+		std::uint64_t missing = 0;
+		for (std::size_t i = 0; i < Words; i++)
+			missing |= (words[i] & mask.words[i]) ^ mask.words[i];
+		return missing == 0;
+	}
+
+	/** Tests if any bit is set in both signatures. */
+	bool intersects(const Signature& s) const {
+		std::uint64_t common = 0;
+		for (std::size_t i = 0; i < Words; i++)
+			common |= words[i] & s.words[i];
+		return common != 0;
+	}
+
+	Signature& operator|=(const Signature& s) {
+		for (std::size_t i = 0; i < Words; i++)
+			words[i] |= s.words[i];
+		return *this;
+	}
+
+	bool none(void) const {
+		std::uint64_t any = 0;
+		for (auto w : words)
+			any |= w;
+		return any == 0;
+	}
+
+	/** Calls f with the ID of every set bit, in increasing order. */
+	template<typename F>
+	void forEach(F&& f) const {
+		for (std::size_t i = 0; i < Words; i++) {
+			for (auto w = words[i]; w != 0; w &= w - 1)
+				f(i * 64 + __builtin_ctzll(w));
+		}
+	}
+
+	bool operator==(const Signature& s) const {
+		std::uint64_t diff = 0;
+		for (std::size_t i = 0; i < Words; i++)
+			diff |= words[i] ^ s.words[i];
+		return diff == 0;
+	}
+
+	bool operator!=(const Signature& s) const {
+		return !(*this == s);
+	}
+
+	struct Hash {
+		std::size_t operator()(const Signature& s) const {
+			std::uint64_t h = 0;
+			for (auto w : s.words)
+				h = (h ^ w) * 0x100000001b3ull;
+			return h ^ (h >> 32);
+		}
+	};
+};
+
+/**
+ * Calls f with the index of every signature in the array that includes mask.
+ * With SSE2 or AVX2 the signatures are tested several at a time, so the
+ * callback may see the state of the array from the start of its block.
+ */
+template<typename F>
+inline void scanSignatures(const Signature *sigs, std::size_t n,
+	const Signature& mask, F&& f)
+{
+	std::size_t i = 0;
+
+#if defined(__AVX2__)
+	if constexpr (Signature::Words == 1) {
+		auto m = _mm256_set1_epi64x(mask.words[0]);
+		for (; i + 4 <= n; i += 4) {
+			auto v = _mm256_loadu_si256(
+				reinterpret_cast<const __m256i*>(sigs + i));
+			auto eq = _mm256_cmpeq_epi64(_mm256_and_si256(v, m), m);
+			for (int b = _mm256_movemask_pd(_mm256_castsi256_pd(eq)); b != 0;
+				b &= b - 1)
+				f(i + __builtin_ctz(b));
+		}
+	} else if constexpr (Signature::Words % 4 == 0) {
+		for (; i < n; i++) {
+			int eq = -1;
+			for (std::size_t w = 0; w < Signature::Words; w += 4) {
+				auto m = _mm256_loadu_si256(
+					reinterpret_cast<const __m256i*>(mask.words + w));
+				auto v = _mm256_loadu_si256(
+					reinterpret_cast<const __m256i*>(sigs[i].words + w));
+				eq &= _mm256_movemask_epi8(
+					_mm256_cmpeq_epi8(_mm256_and_si256(v, m), m));
+			}
+			if (eq == -1)
+				f(i);
+		}
+	}
+#elif defined(__SSE2__)
+	if constexpr (Signature::Words == 1) {
+		// Without SSE4.1's 64-bit compare, compare bytes across both lanes
+		auto m = _mm_set1_epi64x(mask.words[0]);
+		for (; i + 2 <= n; i += 2) {
+			auto v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(sigs + i));
+			int eq = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(v, m), m));
+			if ((eq & 0x00FF) == 0x00FF)
+				f(i);
+			if ((eq & 0xFF00) == 0xFF00)
+				f(i + 1);
+		}
+	} else if constexpr (Signature::Words % 2 == 0) {
+		for (; i < n; i++) {
+			int eq = 0xFFFF;
+			for (std::size_t w = 0; w < Signature::Words; w += 2) {
+				auto m = _mm_loadu_si128(
+					reinterpret_cast<const __m128i*>(mask.words + w));
+				auto v = _mm_loadu_si128(
+					reinterpret_cast<const __m128i*>(sigs[i].words + w));
+				eq &= _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(v, m), m));
+			}
+			if (eq == 0xFFFF)
+				f(i);
+		}
+	}
+#endif
+
+	for (; i < n; i++) {
+		if (sigs[i].includes(mask))
+			f(i);
+	}
+}
+
+/**
+ * @struct AllocationStats
+ * Counts the heap allocations an EntityManager's storage makes, so that
+ * steady-state frames can be checked to allocate nothing.
+ */
+struct AllocationStats {
+	/** Heap allocations and frees made since the manager was created. */
+	std::size_t allocations = 0;
+	std::size_t deallocations = 0;
+	/** Bytes currently allocated from the heap. */
+	std::size_t bytes = 0;
+
+	/** Chunks holding entities, and freed chunks kept for reuse. */
+	std::size_t chunksInUse = 0;
+	std::size_t chunksFree = 0;
+};
+
+/**
+ * @class CountedAllocator
+ * A standard allocator that records its use in an AllocationStats.
+ */
+template<class T>
+class CountedAllocator {
+public:
+	using value_type = T;
+
+	AllocationStats *stats;
+
+	CountedAllocator(AllocationStats& s)
+		: stats(&s) {}
+
+	template<class U>
+	CountedAllocator(const CountedAllocator<U>& a)
+		: stats(a.stats) {}
+
+	T *allocate(std::size_t n) {
+		stats->allocations++;
+		stats->bytes += n * sizeof(T);
+		return std::allocator<T>().allocate(n);
+	}
+
+	void deallocate(T *p, std::size_t n) {
+		stats->deallocations++;
+		stats->bytes -= n * sizeof(T);
+		std::allocator<T>().deallocate(p, n);
+	}
+
+	template<class U>
+	bool operator==(const CountedAllocator<U>& a) const {
+		return stats == a.stats;
+	}
+
+	template<class U>
+	bool operator!=(const CountedAllocator<U>& a) const {
+		return stats != a.stats;
+	}
+};
+
+/** A vector whose allocations are counted. */
+template<class T>
+using CountedVector = std::vector<T, CountedAllocator<T>>;
+
+/**
+ * @class ChunkAllocator
+ * The arena archetype chunks come from. Freed chunks of the standard size
+ * are kept and handed out again to any archetype, so creating and killing
+ * entities at a steady rate does not touch the heap.
+ */
+class ChunkAllocator {
+public:
+	/** Chunks are aligned to a cache line. */
+	static constexpr std::size_t Align = 64;
+
+private:
+	AllocationStats& stats;
+	CountedVector<unsigned char*> freeChunks;
+
+	static unsigned char *heapAllocate(std::size_t bytes) {
+		return static_cast<unsigned char*>(::operator new(bytes,
+			std::align_val_t(Align)));
+	}
+
+	static void heapFree(unsigned char *p) {
+		::operator delete(p, std::align_val_t(Align));
+	}
+
+public:
+	ChunkAllocator(AllocationStats& s)
+		: stats(s), freeChunks(s) {}
+
+	~ChunkAllocator(void) {
+		trim();
+	}
+
+	ChunkAllocator(const ChunkAllocator&) = delete;
+	ChunkAllocator& operator=(const ChunkAllocator&) = delete;
+
+	/** Gets a chunk of the given size, reusing a freed one if possible. */
+	unsigned char *allocate(std::size_t bytes) {
+		stats.chunksInUse++;
+		if (bytes == ENTITIES_CHUNK_SIZE && !freeChunks.empty()) {
+			auto p = freeChunks.back();
+			freeChunks.pop_back();
+			stats.chunksFree--;
+			return p;
+		}
+
+		stats.allocations++;
+		stats.bytes += bytes;
+		return heapAllocate(bytes);
+	}
+
+	/** Returns a chunk, keeping it for reuse if it is the standard size. */
+	void deallocate(unsigned char *p, std::size_t bytes) {
+		stats.chunksInUse--;
+		if (bytes == ENTITIES_CHUNK_SIZE) {
+			freeChunks.push_back(p);
+			stats.chunksFree++;
+			return;
+		}
+
+		stats.deallocations++;
+		stats.bytes -= bytes;
+		heapFree(p);
+	}
+
+	/** Gives every kept chunk back to the heap. */
+	void trim(void) {
+		for (auto p : freeChunks) {
+			heapFree(p);
+			stats.deallocations++;
+			stats.bytes -= ENTITIES_CHUNK_SIZE;
+		}
+
+		stats.chunksFree = 0;
+		freeChunks.clear();
+		freeChunks.shrink_to_fit();
+	}
+};
+
+/**
+ * Rearranges a sequence in place through swap(i, j), so that position i
+ * ends up holding what position order[i] held. Makes at most one swap per
+ * position.
+ */
+template<typename Swap>
+void permuteBySwaps(const std::vector<std::size_t>& order, Swap&& swap) {
+	// where[k] is the position now holding what k held; at is its inverse
+	std::vector<std::size_t> where (order.size()), at (order.size());
+	std::iota(where.begin(), where.end(), 0);
+	std::iota(at.begin(), at.end(), 0);
+	for (std::size_t i = 0; i < order.size(); i++) {
+		auto j = where[order[i]];
+		if (j == i)
+			continue;
+
+		swap(i, j);
+		where[at[i]] = j;
+		at[j] = at[i];
+		where[order[i]] = i;
+		at[i] = order[i];
+	}
+}
+
+/**
+ * @class Archetype
+ * Stores every entity that has one exact set of components.
+ * Entities are packed into fixed-size chunks; within a chunk, the entity IDs
+ * and each component type are kept in their own contiguous arrays. Rows are
+ * always dense: removing one moves the last row into its place.
+ * Each chunk starts with the ticks at which each of its columns was last
+ * changed and last had a component added.
+ */
+class Archetype {
+public:
+	/** The sorted component IDs that make up an archetype. */
+	using Type = std::vector<ComponentId>;
+
+	/** The components of this archetype as a bitmask. */
+	const Signature& signature(void) const {
+		return sig;
+	}
+
+	/**
+	 * @struct Chunk
+	 * One block of storage holding up to capacity rows.
+	 */
+	struct Chunk {
+		unsigned char *data;
+		std::size_t count;
+	};
+
+private:
+	ChunkAllocator& allocator;
+	Type type;
+	Signature sig;
+	std::vector<const ComponentInfo*> infos;
+	/** The column of each component ID, -1 for absent components. */
+	std::vector<int> columns;
+	/** Byte offset of each component array within a chunk. */
+	std::vector<std::size_t> offsets;
+	/** Byte offset of each field array of split columns, else empty. */
+	std::vector<std::vector<std::size_t>> fieldOffsets;
+	/** Bytes of ticks before the ID array of a chunk. */
+	std::size_t header;
+	std::size_t capacity;
+	std::size_t chunkBytes;
+	CountedVector<Chunk> chunks;
+	std::size_t count;
+	/** Room for any one component, made on first use by temp(). */
+	CountedVector<unsigned char> scratch;
+	void *scratchAt = nullptr;
+
+	/** Cached archetypes reached by adding or removing one component. */
+	std::vector<Archetype*> addEdges;
+	std::vector<Archetype*> removeEdges;
+
+	friend class EntityManager;
+
+	static Archetype*& edge(std::vector<Archetype*>& edges, ComponentId id) {
+		if (id >= edges.size())
+			edges.resize(id + 1, nullptr);
+		return edges[id];
+	}
+
+	void addChunk(Tick now) {
+		chunks.push_back({allocator.allocate(chunkBytes), 0});
+		auto ticks = changedTicks(chunks.back());
+		std::fill(ticks, ticks + 2 * infos.size(), now);
+	}
+
+	static std::size_t alignUp(std::size_t n, std::size_t align) {
+		return (n + align - 1) / align * align;
+	}
+
+	/**
+	 * Computes the chunk layout for n rows, returning its total size.
+	 * The field arrays of split columns start on cache lines, for aligned
+	 * vector loads.
+	 */
+	std::size_t layout(std::size_t n) {
+		std::size_t end = header + n * sizeof(Id);
+		for (std::size_t i = 0; i < infos.size(); i++) {
+			auto& fields = infos[i]->fields;
+			if (fields.empty()) {
+				offsets[i] = alignUp(end, infos[i]->align);
+				end = offsets[i] + n * infos[i]->size;
+				continue;
+			}
+
+			for (std::size_t f = 0; f < fields.size(); f++) {
+				fieldOffsets[i][f] = alignUp(end, ChunkAllocator::Align);
+				end = fieldOffsets[i][f] + n * fields[f].size;
+			}
+			offsets[i] = fieldOffsets[i][0];
+		}
+		return end;
+	}
+
+public:
+	Archetype(ChunkAllocator& a, AllocationStats& stats,
+		std::vector<const ComponentInfo*> _infos)
+		: allocator(a), infos(std::move(_infos)), offsets(infos.size()),
+		  fieldOffsets(infos.size()), chunks(stats), count(0), scratch(stats) {
+		std::sort(infos.begin(), infos.end(),
+			[](auto a, auto b) { return a->id < b->id; });
+		for (std::size_t i = 0; i < infos.size(); i++) {
+			type.push_back(infos[i]->id);
+			sig.set(infos[i]->id);
+			fieldOffsets[i].resize(infos[i]->fields.size());
+		}
+
+		columns.assign(type.empty() ? 0 : type.back() + 1, -1);
+		for (std::size_t i = 0; i < type.size(); i++)
+			columns[type[i]] = i;
+
+		header = alignUp(2 * infos.size() * sizeof(Tick), alignof(Id));
+		std::size_t rowBytes = sizeof(Id);
+		for (auto info : infos)
+			rowBytes += info->size;
+		capacity = std::max<std::size_t>(
+			(std::max<std::size_t>(ENTITIES_CHUNK_SIZE, header) - header) / rowBytes, 1);
+		while (capacity > 1 && layout(capacity) > ENTITIES_CHUNK_SIZE)
+			capacity--;
+		chunkBytes = std::max<std::size_t>(layout(capacity),
+			ENTITIES_CHUNK_SIZE);
+	}
+
+	~Archetype(void) {
+		clear();
+	}
+
+	Archetype(const Archetype&) = delete;
+	Archetype& operator=(const Archetype&) = delete;
+
+	/** Gets the sorted component IDs of this archetype. */
+	const Type& components(void) const {
+		return type;
+	}
+
+	/** Gets the number of entities in this archetype. */
+	std::size_t size(void) const {
+		return count;
+	}
+
+	/** Makes room in the chunk list for n more rows. */
+	void reserve(std::size_t n) {
+		chunks.reserve((count + n + capacity - 1) / capacity);
+	}
+
+	/**
+	 * Finds the array index of the given component type.
+	 * @return the column, or -1 if this archetype lacks the component
+	 */
+	int column(ComponentId id) const {
+		return id < columns.size() ? columns[id] : -1;
+	}
+
+	/** Gets the chunks of this archetype; only the last may be partly full. */
+	const CountedVector<Chunk>& chunkList(void) const {
+		return chunks;
+	}
+
+	/** Gets the entity ID array of a chunk. */
+	Id *ids(const Chunk& c) const {
+		return reinterpret_cast<Id*>(c.data + header);
+	}
+
+	/** Gets the tick each column of a chunk was last changed at. */
+	Tick *changedTicks(const Chunk& c) const {
+		return reinterpret_cast<Tick*>(c.data);
+	}
+
+	/** Gets the tick each column of a chunk last had a component added at. */
+	Tick *addedTicks(const Chunk& c) const {
+		return reinterpret_cast<Tick*>(c.data) + infos.size();
+	}
+
+	/** Marks the given column changed in the chunk holding row. */
+	void markChanged(std::size_t row, int col, Tick now) {
+		changedTicks(chunks[row / capacity])[col] = now;
+	}
+
+	/** Marks a component added, and so changed, in the chunk holding row. */
+	void markAdded(std::size_t row, int col, Tick now) {
+		auto& c = chunks[row / capacity];
+		changedTicks(c)[col] = now;
+		addedTicks(c)[col] = now;
+	}
+
+	/** Gets the array of the given column within a chunk. */
+	void *array(const Chunk& c, int col) const {
+		return c.data + offsets[col];
+	}
+
+	/** Gets the component in the given column and row; not for split columns. */
+	void *at(int col, std::size_t row) const {
+		auto& c = chunks[row / capacity];
+		return c.data + offsets[col] + (row % capacity) * infos[col]->size;
+	}
+
+	/** Gets a chunk's column of components of type T. */
+	template<class T>
+	Column<T> span(const Chunk& c, int col) const {
+		std::array<void*, Column<T>::Arrays> arrays;
+		if constexpr (isSplit<T>) {
+			for (std::size_t f = 0; f < arrays.size(); f++)
+				arrays[f] = fieldArray(c, col, f);
+		} else {
+			arrays[0] = array(c, col);
+		}
+		return Column<T>(arrays, c.count);
+	}
+
+	/** Tests if a column keeps each field of its component in its own array. */
+	bool split(int col) const {
+		return !fieldOffsets[col].empty();
+	}
+
+	/** Gets the array of one field of a split column within a chunk. */
+	void *fieldArray(const Chunk& c, int col, std::size_t field) const {
+		return c.data + fieldOffsets[col][field];
+	}
+
+	/**
+	 * Copies the component at index i of a chunk's column out to dst,
+	 * gathering the fields of a split one. Only for trivially copyable types.
+	 */
+	void load(const Chunk& c, int col, std::size_t i, void *dst) const {
+		auto& fields = infos[col]->fields;
+		if (fields.empty()) {
+			std::memcpy(dst, c.data + offsets[col] + i * infos[col]->size,
+				infos[col]->size);
+			return;
+		}
+
+		for (std::size_t f = 0; f < fields.size(); f++) {
+			std::memcpy(static_cast<unsigned char*>(dst) + fields[f].offset,
+				c.data + fieldOffsets[col][f] + i * fields[f].size, fields[f].size);
+		}
+	}
+
+	/**
+	 * Copies the component at src into index i of a chunk's column,
+	 * scattering the fields of a split one. Only for trivially copyable types.
+	 */
+	void store(const Chunk& c, int col, std::size_t i, const void *src) {
+		auto& fields = infos[col]->fields;
+		if (fields.empty()) {
+			std::memcpy(c.data + offsets[col] + i * infos[col]->size, src,
+				infos[col]->size);
+			return;
+		}
+
+		for (std::size_t f = 0; f < fields.size(); f++) {
+			std::memcpy(c.data + fieldOffsets[col][f] + i * fields[f].size,
+				static_cast<const unsigned char*>(src) + fields[f].offset, fields[f].size);
+		}
+	}
+
+	/** Copies the component in the given column and row out to dst. */
+	void load(int col, std::size_t row, void *dst) const {
+		load(chunks[row / capacity], col, row % capacity, dst);
+	}
+
+	/** Copies the component at src into the given column and row. */
+	void store(int col, std::size_t row, const void *src) {
+		store(chunks[row / capacity], col, row % capacity, src);
+	}
+
+	/**
+	 * Builds the component in the given column and row by calling
+	 * build(p). Split columns are built in a temporary and scattered.
+	 */
+	template<typename F>
+	void construct(int col, std::size_t row, F&& build) {
+		if (!split(col)) {
+			build(at(col, row));
+			return;
+		}
+
+		alignas(ChunkAllocator::Align) unsigned char temp[MaxSplitSize];
+		build(static_cast<void*>(temp));
+		store(col, row, temp);
+	}
+
+	/** Destroys the component in the given column and row. */
+	void destroy(int col, std::size_t row) {
+		// Split components are trivially destructible
+		if (!split(col))
+			infos[col]->destroy(at(col, row));
+	}
+
+	/**
+	 * Moves a component from a row of another archetype, or of this one,
+	 * into the given column and row, which must hold none.
+	 */
+	void relocate(int col, std::size_t row, const Archetype& from, int fromCol,
+		std::size_t fromRow)
+	{
+		if (!split(col)) {
+			infos[col]->relocate(at(col, row), from.at(fromCol, fromRow));
+			return;
+		}
+
+		auto& c = chunks[row / capacity];
+		auto& fc = from.chunks[fromRow / from.capacity];
+		auto& fields = infos[col]->fields;
+		for (std::size_t f = 0; f < fields.size(); f++) {
+			std::memcpy(
+				c.data + fieldOffsets[col][f] + (row % capacity) * fields[f].size,
+				fc.data + from.fieldOffsets[fromCol][f]
+					+ (fromRow % from.capacity) * fields[f].size,
+				fields[f].size);
+		}
+	}
+
+	/**
+	 * Copies n components packed at src into a column from the given row
+	 * on, all within one chunk. Only for trivially copyable types.
+	 */
+	void storeRun(int col, std::size_t row, const unsigned char *src, std::size_t n) {
+		if (!split(col)) {
+			std::memcpy(at(col, row), src, n * infos[col]->size);
+			return;
+		}
+
+		auto& c = chunks[row / capacity];
+		for (std::size_t i = 0; i < n; i++, src += infos[col]->size)
+			store(c, col, row % capacity + i, src);
+	}
+
+	/** Gets the entity in the given row. */
+	Id id(std::size_t row) const {
+		return ids(chunks[row / capacity])[row % capacity];
+	}
+
+	/**
+	 * Swaps two rows, passing each component through temp, which must have
+	 * room for any one of them.
+	 */
+	void swapRows(std::size_t a, std::size_t b, void *temp) {
+		std::swap(ids(chunks[a / capacity])[a % capacity],
+			ids(chunks[b / capacity])[b % capacity]);
+		for (std::size_t i = 0; i < infos.size(); i++) {
+			if (split(i)) {
+				load(i, a, temp);
+				relocate(i, a, *this, i, b);
+				store(i, b, temp);
+			} else {
+				infos[i]->relocate(temp, at(i, a));
+				infos[i]->relocate(at(i, a), at(i, b));
+				infos[i]->relocate(at(i, b), temp);
+			}
+		}
+	}
+
+	/** Gets a buffer with room for any one component of this archetype. */
+	void *temp(void) {
+		if (scratchAt)
+			return scratchAt;
+
+		std::size_t size = MaxSplitSize, align = alignof(std::max_align_t);
+		for (auto info : infos) {
+			size = std::max(size, info->size);
+			align = std::max(align, info->align);
+		}
+		scratch.resize(size + align);
+		scratchAt = scratch.data();
+		std::size_t space = size + align;
+		return std::align(align, size, scratchAt, space);
+	}
+
+	/** Swaps two rows as above, marking the chunks holding them changed. */
+	void swapRows(std::size_t a, std::size_t b, Tick now) {
+		swapRows(a, b, temp());
+		for (auto row : {a, b}) {
+			auto ticks = changedTicks(chunks[row / capacity]);
+			std::fill(ticks, ticks + infos.size(), now);
+		}
+	}
+
+	/**
+	 * Reorders the rows so that row i holds what row order[i] held. Every
+	 * chunk is marked changed.
+	 */
+	void permute(const std::vector<std::size_t>& order, Tick now) {
+		void *buffer = temp();
+		permuteBySwaps(order, [&](std::size_t a, std::size_t b) {
+			swapRows(a, b, buffer);
+		});
+		for (auto& c : chunks)
+			std::fill(changedTicks(c), changedTicks(c) + infos.size(), now);
+	}
+
+	/**
+	 * Gets a chunk's column as packed components. A split column is
+	 * gathered into buffer, which the result then points into.
+	 */
+	const void *packed(const Chunk& c, int col, std::string& buffer) const {
+		if (!split(col))
+			return array(c, col);
+
+		auto size = infos[col]->size;
+		buffer.resize(c.count * size);
+		for (std::size_t i = 0; i < c.count; i++)
+			load(c, col, i, &buffer[i * size]);
+		return buffer.data();
+	}
+
+	/**
+	 * Appends a row for the given entity. Its components are left
+	 * unconstructed for the caller to fill in.
+	 * @return the new row
+	 */
+	std::size_t push(Id id, Tick now) {
+		if (chunks.empty() || chunks.back().count == capacity)
+			addChunk(now);
+
+		auto& c = chunks.back();
+		ids(c)[c.count++] = id;
+		return count++;
+	}
+
+	/**
+	 * Appends rows for n entities, copying their IDs from src, which need
+	 * not be aligned. Their components are left unconstructed.
+	 * @return the first new row
+	 */
+	std::size_t pushMany(const unsigned char *src, std::size_t n, Tick now) {
+		auto first = count;
+		while (n > 0) {
+			if (chunks.empty() || chunks.back().count == capacity)
+				addChunk(now);
+
+			auto& c = chunks.back();
+			auto k = std::min(capacity - c.count, n);
+			std::memcpy(ids(c) + c.count, src, k * sizeof(Id));
+			c.count += k;
+			count += k;
+			src += k * sizeof(Id);
+			n -= k;
+		}
+		return first;
+	}
+
+	/**
+	 * Fills a vacated row with the last row. The components at row must have
+	 * already been destroyed or relocated.
+	 * @return the ID of the entity moved into row, if one was
+	 */
+	Id fill(std::size_t row, Tick now) {
+		std::size_t last = --count;
+		auto& lc = chunks.back();
+		Id moved = ids(lc)[lc.count - 1];
+
+		if (row != last) {
+			auto& c = chunks[row / capacity];
+			ids(c)[row % capacity] = moved;
+			for (std::size_t i = 0; i < infos.size(); i++)
+				relocate(i, row, *this, i, last);
+			std::fill(changedTicks(c), changedTicks(c) + infos.size(), now);
+		}
+
+		if (--lc.count == 0) {
+			allocator.deallocate(lc.data, chunkBytes);
+			chunks.pop_back();
+		}
+
+		return moved;
+	}
+
+	/** Destroys every row. */
+	void clear(void) {
+		for (auto& c : chunks) {
+			for (std::size_t i = 0; i < infos.size(); i++) {
+				if (split(i))
+					continue;
+				auto arr = static_cast<unsigned char*>(array(c, i));
+				for (std::size_t j = 0; j < c.count; j++)
+					infos[i]->destroy(arr + j * infos[i]->size);
+			}
+			allocator.deallocate(c.data, chunkBytes);
+		}
+
+		chunks.clear();
+		count = 0;
+	}
+};
+
+/**
+ * @class Pool
+ * A sparse set holding every component of one type.
+ * The sparse array maps entity indices to indices into the packed dense arrays,
+ * so lookups, insertion and removal are all constant time and iterating
+ * the type walks contiguous memory.
+ */
+class Pool {
+public:
+	/** Marks an entity that has no component in the pool. */
+	static constexpr Id None = static_cast<Id>(-1);
+
+protected:
+	CountedVector<Id> sparse;
+	CountedVector<Id> dense;
+	/** When each component was last changed and added, parallel to dense. */
+	CountedVector<Tick> changed;
+	CountedVector<Tick> added;
+
+public:
+	Pool(AllocationStats& stats)
+		: sparse(stats), dense(stats), changed(stats), added(stats) {}
+
+	virtual ~Pool(void) {}
+
+	/** Tests if the given entity has a component in this pool. */
+	bool contains(Id id) const {
+		auto i = idIndex(id);
+		return i < sparse.size() && sparse[i] != None;
+	}
+
+	/** Gets the number of components in the pool. */
+	std::size_t size(void) const {
+		return dense.size();
+	}
+
+	/** Gets the packed entity IDs, parallel to the packed components. */
+	const Id *ids(void) const {
+		return dense.data();
+	}
+
+	/** Gets the bytes of the sparse index, IDs and ticks in use. */
+	std::size_t bookkeepingBytes(void) const {
+		return (sparse.size() + dense.size()) * sizeof(Id)
+			+ (changed.size() + added.size()) * sizeof(Tick);
+	}
+
+	/** Gets the packed change ticks, parallel to the packed components. */
+	Tick *changedTicks(void) {
+		return changed.data();
+	}
+
+	/** Gets the packed ticks components were added at. */
+	const Tick *addedTicks(void) const {
+		return added.data();
+	}
+
+	/** Gets the packed index of an entity known to be in the pool. */
+	std::size_t index(Id id) const {
+		return sparse[idIndex(id)];
+	}
+
+	/** Gets when the given entity's component was last changed. */
+	Tick changedTick(Id id) const {
+		return changed[sparse[idIndex(id)]];
+	}
+
+	/** Gets when the given entity's component was added. */
+	Tick addedTick(Id id) const {
+		return added[sparse[idIndex(id)]];
+	}
+
+	/** Makes room for n more entities, the highest index being max. */
+	void reserve(std::size_t n, std::size_t max) {
+		dense.reserve(dense.size() + n);
+		if (max >= sparse.size())
+			sparse.resize(max + 1, None);
+	}
+
+	/**
+	 * Adds a component for the given entity, built by construct(ctx, p)
+	 * constructing it at p. The entity must not have one already.
+	 */
+	virtual void emplaceWith(Id id, Tick now, void (*construct)(void *ctx, void *p),
+		void *ctx) = 0;
+
+	/**
+	 * Adds components for n entities by copying their bytes from src, which
+	 * packs one after another. Only for trivially copyable types, and none
+	 * of the entities may have one already.
+	 */
+	virtual void appendRaw(const Id *ids, std::size_t n, Tick now,
+		const unsigned char *src) = 0;
+
+	/** Gets the packed components, parallel to ids(). */
+	virtual const void *componentData(void) const = 0;
+
+	/** Gets the number of components there is room for. */
+	virtual std::size_t capacity(void) const = 0;
+
+	/** Removes the given entity's component, if it has one. */
+	virtual void remove(Id id) = 0;
+
+	/** Swaps the entries at two packed indices. */
+	virtual void swap(std::size_t i, std::size_t j) = 0;
+
+	/** Destroys every component in the pool. */
+	virtual void clear(void) = 0;
+};
+
+/**
+ * @class ComponentPool
+ * The sparse set storing components of type T.
+ */
+template<class T>
+class ComponentPool : public Pool {
+private:
+	CountedVector<T> items;
+
+public:
+	ComponentPool(AllocationStats& stats)
+		: Pool(stats), items(stats) {}
+
+	/**
+	 * Constructs the given entity's component, replacing any it had.
+	 */
+	template<typename... Args>
+	T* emplace(Id id, Tick now, Args&&... args) {
+		if (contains(id)) {
+			// Built first, as args may refer to the component replaced
+			T value (std::forward<Args>(args)...);
+			auto i = sparse[idIndex(id)];
+			changed[i] = now;
+			items[i] = std::move(value);
+			return &items[i];
+		}
+
+		if (idIndex(id) >= sparse.size())
+			sparse.resize(idIndex(id) + 1, None);
+		sparse[idIndex(id)] = dense.size();
+		dense.push_back(id);
+		changed.push_back(now);
+		added.push_back(now);
+		items.emplace_back(std::forward<Args>(args)...);
+		return &items.back();
+	}
+
+	/** Makes room for n more components, the highest index being max. */
+	void reserve(std::size_t n, std::size_t max) {
+		Pool::reserve(n, max);
+		items.reserve(items.size() + n);
+		changed.reserve(changed.size() + n);
+		added.reserve(added.size() + n);
+	}
+
+	/** Fetches the given entity's component, nullptr if it has none. */
+	T* get(Id id) {
+		return contains(id) ? &items[sparse[idIndex(id)]] : nullptr;
+	}
+
+	/** Fetches the component of an entity known to be in the pool. */
+	T& at(Id id) {
+		return items[sparse[idIndex(id)]];
+	}
+
+	/** Fetches the component of an entity as above, marking it changed. */
+	T& write(Id id, Tick now) {
+		auto i = sparse[idIndex(id)];
+		changed[i] = now;
+		return items[i];
+	}
+
+	/** Gets the packed component array. */
+	T* data(void) {
+		return items.data();
+	}
+
+	void emplaceWith(Id id, Tick now, void (*construct)(void *ctx, void *p),
+		void *ctx) final
+	{
+		alignas(T) unsigned char tmp[sizeof(T)];
+		construct(ctx, tmp);
+		auto c = reinterpret_cast<T*>(tmp);
+		emplace(id, now, std::move(*c));
+		c->~T();
+	}
+
+	void appendRaw(const Id *ids, std::size_t n, Tick now,
+		const unsigned char *src) final
+	{
+		if constexpr (std::is_trivially_copyable<T>::value) {
+			Id max = 0;
+			for (std::size_t i = 0; i < n; i++)
+				max = std::max(max, idIndex(ids[i]));
+			reserve(n, max);
+
+			for (std::size_t i = 0; i < n; i++) {
+				sparse[idIndex(ids[i])] = dense.size();
+				dense.push_back(ids[i]);
+				alignas(T) unsigned char tmp[sizeof(T)];
+				std::memcpy(tmp, src + i * sizeof(T), sizeof(T));
+				items.push_back(*reinterpret_cast<T*>(tmp));
+			}
+			changed.resize(dense.size(), now);
+			added.resize(dense.size(), now);
+		} else {
+			throw std::logic_error("component type is not trivially copyable");
+		}
+	}
+
+	const void *componentData(void) const final {
+		return items.data();
+	}
+
+	std::size_t capacity(void) const final {
+		return items.capacity();
+	}
+
+	void remove(Id id) final {
+		if (!contains(id))
+			return;
+
+		auto i = sparse[idIndex(id)];
+		auto last = dense.back();
+		if (last != id) {
+			items[i] = std::move(items.back());
+			dense[i] = last;
+			changed[i] = changed.back();
+			added[i] = added.back();
+			sparse[idIndex(last)] = i;
+		}
+
+		items.pop_back();
+		dense.pop_back();
+		changed.pop_back();
+		added.pop_back();
+		sparse[idIndex(id)] = None;
+	}
+
+	void swap(std::size_t i, std::size_t j) final {
+		using std::swap;
+		swap(items[i], items[j]);
+		swap(dense[i], dense[j]);
+		swap(changed[i], changed[j]);
+		swap(added[i], added[j]);
+		sparse[idIndex(dense[i])] = i;
+		sparse[idIndex(dense[j])] = j;
+	}
+
+	void clear(void) final {
+		items.clear();
+		dense.clear();
+		changed.clear();
+		added.clear();
+		sparse.clear();
+	}
+};
+
+/**
+ * @class EntitySet
+ * A sparse set of entity IDs without components.
+ */
+class EntitySet : public Pool {
+public:
+	EntitySet(AllocationStats& stats)
+		: Pool(stats) {}
+
+	/** Adds an entity to the set, if it is not already in it. */
+	void insert(Id id) {
+		if (contains(id))
+			return;
+
+		if (idIndex(id) >= sparse.size())
+			sparse.resize(idIndex(id) + 1, None);
+		sparse[idIndex(id)] = dense.size();
+		dense.push_back(id);
+	}
+
+	void emplaceWith(Id, Tick, void (*)(void*, void*), void*) final {
+		throw std::logic_error("an EntitySet holds no components");
+	}
+
+	void appendRaw(const Id*, std::size_t, Tick, const unsigned char*) final {
+		throw std::logic_error("an EntitySet holds no components");
+	}
+
+	const void *componentData(void) const final {
+		return nullptr;
+	}
+
+	std::size_t capacity(void) const final {
+		return 0;
+	}
+
+	void remove(Id id) final {
+		if (!contains(id))
+			return;
+
+		auto i = sparse[idIndex(id)];
+		auto last = dense.back();
+		dense[i] = last;
+		sparse[idIndex(last)] = i;
+		dense.pop_back();
+		sparse[idIndex(id)] = None;
+	}
+
+	void swap(std::size_t i, std::size_t j) final {
+		std::swap(dense[i], dense[j]);
+		sparse[idIndex(dense[i])] = i;
+		sparse[idIndex(dense[j])] = j;
+	}
+
+	void clear(void) final {
+		dense.clear();
+		sparse.clear();
+	}
+};
+
+/**
+ * Selects how an EntityManager stores components.
+ * Archetype storage groups entities with the same components into chunks,
+ * which is fastest to iterate over several component types at once.
+ * SparseSet storage keeps one packed pool per component type, which makes
+ * adding and removing components cheap.
+ */
+enum class Storage {
+	Archetype,
+	SparseSet
+};
+
+/**
+ * @struct Filter
+ * Narrows a query to entities whose given components were changed, or were
+ * added, after a tick. Components count as changed when assigned, and when
+ * handed out for writing: as non-const in each() or parallelEach(), or
+ * through Entity::component().
+ * Archetype storage tracks ticks per chunk, so a filtered query also visits
+ * the unchanged entities sharing a chunk with a changed one; sparse set
+ * storage tracks every component.
+ */
+struct Filter {
+	Signature changedMask;
+	Signature addedMask;
+	Tick since = 0;
+
+	/** Matches entities whose given components changed after since. */
+	template<class... Ts>
+	static Filter changed(Tick since) {
+		Filter f;
+		f.changedMask = Signature::of<Ts...>();
+		f.since = since;
+		return f;
+	}
+
+	/** Matches entities whose given components were added after since. */
+	template<class... Ts>
+	static Filter added(Tick since) {
+		Filter f;
+		f.addedMask = Signature::of<Ts...>();
+		f.since = since;
+		return f;
+	}
+
+	bool empty(void) const {
+		return changedMask.none() && addedMask.none();
+	}
+
+	/** Tests if any entity in an archetype chunk may match. */
+	bool accepts(const Archetype& arch, const Archetype::Chunk& c) const {
+		bool ok = true;
+		auto changed = arch.changedTicks(c);
+		auto added = arch.addedTicks(c);
+		changedMask.forEach([&](ComponentId id) {
+			ok = ok && tickAfter(changed[arch.column(id)], since);
+		});
+		addedMask.forEach([&](ComponentId id) {
+			ok = ok && tickAfter(added[arch.column(id)], since);
+		});
+		return ok;
+	}
+
+	/**
+	 * Tests if an entity in sparse set storage matches.
+	 * @param pools the component pools, indexed by component ID
+	 */
+	bool accepts(const std::vector<std::unique_ptr<Pool>>& pools, Id id) const {
+		bool ok = true;
+		auto test = [&](ComponentId c, bool add) {
+			if (!ok)
+				return;
+			auto p = c < pools.size() ? pools[c].get() : nullptr;
+			ok = p != nullptr && p->contains(id) && tickAfter(add
+				? p->addedTick(id) : p->changedTick(id), since);
+		};
+		changedMask.forEach([&](ComponentId c) { test(c, false); });
+		addedMask.forEach([&](ComponentId c) { test(c, true); });
+		return ok;
+	}
+};
+
+/**
+ * @struct EntityData
+ * Locates an entity's components within the EntityManager's storage.
+ */
+struct EntityData {
+	/**
+	 * The ID of the entity in this slot, or if the slot is free, the ID its
+	 * next entity will get.
+	 */
+	Id id;
+	/**
+	 * When the slot's entity was last created or killed, or gained or lost
+	 * a component type; used to find what delta snapshots must hold.
+	 */
+	Tick changed;
+	/** The archetype holding the entity, nullptr with sparse set storage. */
+	Archetype *archetype;
+	/** The entity's row within its archetype. */
+	std::size_t row;
+	bool alive;
+
+	EntityData(Id _id)
+		: id(_id), changed(0), archetype(nullptr), row(0), alive(false) {}
+};
+
+/**
+ * @struct ProfileCounters
+ * Counts the work a system does during one update, when ENTITIES_PROFILE is
+ * defined. EntityManager adds to the counters of the system running on the
+ * calling thread, if any.
+ */
+struct ProfileCounters {
+#ifdef ENTITIES_PROFILE
+	static constexpr bool Enabled = true;
+#else
+	static constexpr bool Enabled = false;
+#endif
+
+	/** Entities looked at by each() and the like. */
+	std::uint64_t visited = 0;
+	/** Entities handed to each() callbacks. */
+	std::uint64_t matched = 0;
+	/**
+	 * Entities created or killed and components added or removed, whether
+	 * made at once or recorded in a CommandBuffer.
+	 */
+	std::uint64_t structural = 0;
+
+	/** Gets the counters of the system running on this thread. */
+	static ProfileCounters*& current(void) {
+		static thread_local ProfileCounters *counters = nullptr;
+		return counters;
+	}
+
+	/** Counts entities looked at and matched by a query. */
+	static void visit([[maybe_unused]] std::uint64_t visited,
+		[[maybe_unused]] std::uint64_t matched)
+	{
+		if constexpr (Enabled) {
+			if (auto c = current()) {
+				c->visited += visited;
+				c->matched += matched;
+			}
+		}
+	}
+
+	/** Counts a structural change. */
+	static void change(void) {
+		if constexpr (Enabled) {
+			if (auto c = current())
+				c->structural++;
+		}
+	}
+};
+
+/**
+ * @struct ComponentMemory
+ * The memory taken by one component type, from EntityManager::memoryUsage().
+ * Only the components themselves are counted, not heap memory they own.
+ */
+struct ComponentMemory {
+	ComponentId id = 0;
+	/** The number of components of the type. */
+	std::size_t count = 0;
+	/** The bytes holding those components. */
+	std::size_t bytes = 0;
+	/** The bytes set aside for the type, including room not yet used. */
+	std::size_t reserved = 0;
+};
+
+/**
+ * @struct MemoryUsage
+ * A breakdown of the heap memory an EntityManager's storage holds, from
+ * EntityManager::memoryUsage(). totalBytes is split into component bytes,
+ * the bookkeeping that locates entities and components, and slack: room
+ * not yet used, padding, and freed chunks kept for reuse.
+ */
+struct MemoryUsage {
+	/** Living entities, and entity slots including free ones. */
+	std::size_t entities = 0;
+	std::size_t slots = 0;
+	/** Archetypes, including empty ones, and chunks in use. */
+	std::size_t archetypes = 0;
+	std::size_t chunks = 0;
+
+	std::size_t totalBytes = 0;
+	std::size_t componentBytes = 0;
+	std::size_t overheadBytes = 0;
+	std::size_t slackBytes = 0;
+	/** The part of slackBytes in freed chunks; see EntityManager::trim(). */
+	std::size_t freeChunkBytes = 0;
+
+	/** Every component type with storage, by ascending ID. */
+	std::vector<ComponentMemory> components;
+
+	double bytesPerEntity(void) const {
+		return entities ? double(totalBytes) / entities : 0;
+	}
+
+	double overheadPerEntity(void) const {
+		return entities ? double(overheadBytes) / entities : 0;
+	}
+
+	/** Gets the share of totalBytes that is slack. */
+	double fragmentation(void) const {
+		return totalBytes ? double(slackBytes) / totalBytes : 0;
+	}
+};
+
+/**
+ * @class ThreadPool
+ * A pool of worker threads that share work by stealing.
+ * Each worker has its own task queue, running its newest task first and
+ * taking the oldest task of another queue when its own is empty. A thread
+ * waiting on a batch of tasks runs queued tasks itself rather than block,
+ * so batches may be nested inside tasks.
+ */
+class ThreadPool {
+private:
+	/** Tracks a batch of tasks until all have run. */
+	struct Batch {
+		std::atomic<std::size_t> pending;
+		std::exception_ptr error;
+		std::mutex errorLock;
+
+		Batch(std::size_t n)
+			: pending(n) {}
+	};
+
+	struct Task {
+		void (*run)(void *ctx, std::size_t begin, std::size_t end);
+		void *ctx;
+		std::size_t begin;
+		std::size_t end;
+		Batch *batch;
+	};
+
+	struct Queue {
+		std::mutex lock;
+		std::deque<Task> tasks;
+	};
+
+	std::vector<std::unique_ptr<Queue>> queues;
+	std::vector<std::thread> threads;
+
+	std::mutex sleepLock;
+	std::condition_variable wake;
+	std::atomic<std::size_t> queued;
+	bool stopping;
+
+	/** The queue of the worker running on this thread, if any. */
+	static inline thread_local ThreadPool *currentPool = nullptr;
+	static inline thread_local std::size_t currentQueue = 0;
+
+	bool pop(std::size_t q, Task& task, bool steal) {
+		auto& queue = *queues[q];
+		std::lock_guard<std::mutex> lock (queue.lock);
+		if (queue.tasks.empty())
+			return false;
+
+		if (steal) {
+			task = queue.tasks.front();
+			queue.tasks.pop_front();
+		} else {
+			task = queue.tasks.back();
+			queue.tasks.pop_back();
+		}
+		queued--;
+		return true;
+	}
+
+	/**
+	 * Runs one queued task, preferring the given queue.
+	 * @return false if every queue was empty
+	 */
+	bool runOne(std::size_t home) {
+		Task task;
+		bool found = pop(home, task, false);
+		for (std::size_t i = 1; !found && i < queues.size(); i++)
+			found = pop((home + i) % queues.size(), task, true);
+		if (!found)
+			return false;
+
+		try {
+			task.run(task.ctx, task.begin, task.end);
+		} catch (...) {
+			std::lock_guard<std::mutex> lock (task.batch->errorLock);
+			if (!task.batch->error)
+				task.batch->error = std::current_exception();
+		}
+		task.batch->pending.fetch_sub(1, std::memory_order_release);
+		return true;
+	}
+
+	void work(std::size_t index) {
+		currentPool = this;
+		currentQueue = index;
+
+		while (true) {
+			if (runOne(index))
+				continue;
+
+			std::unique_lock<std::mutex> lock (sleepLock);
+			wake.wait(lock, [this] { return stopping || queued > 0; });
+			if (stopping)
+				return;
+		}
+	}
+
+	/** The state shared by the tasks of runGraph(). */
+	template<typename Fn>
+	struct Graph {
+		ThreadPool *pool;
+		const std::vector<std::vector<std::size_t>> *successors;
+		std::unique_ptr<std::atomic<std::size_t>[]> waiting;
+		Fn *f;
+		Batch *batch;
+	};
+
+	/** Runs one node of a graph, then queues the nodes it released. */
+	template<typename Fn>
+	static void runNode(void *ctx, std::size_t node, std::size_t) {
+		auto& g = *static_cast<Graph<Fn>*>(ctx);
+		try {
+			(*g.f)(node);
+		} catch (...) {
+			std::lock_guard<std::mutex> lock (g.batch->errorLock);
+			if (!g.batch->error)
+				g.batch->error = std::current_exception();
+		}
+
+		std::vector<Task> ready;
+		for (auto j : (*g.successors)[node]) {
+			if (--g.waiting[j] == 0)
+				ready.push_back({&runNode<Fn>, ctx, j, 0, g.batch});
+		}
+		if (!ready.empty())
+			g.pool->submit(ready);
+	}
+
+	/** Gets the queue the calling thread should use. */
+	std::size_t home(void) const {
+		return currentPool == this ? currentQueue : 0;
+	}
+
+	/** Queues tasks spread across the workers, then wakes them. */
+	void submit(const std::vector<Task>& tasks) {
+		auto start = home();
+		for (std::size_t i = 0; i < tasks.size(); i++) {
+			auto& queue = *queues[(start + i) % queues.size()];
+			std::lock_guard<std::mutex> lock (queue.lock);
+			queue.tasks.push_back(tasks[i]);
+		}
+
+		queued += tasks.size();
+		// Taking the lock orders this with a worker checking queued
+		{ std::lock_guard<std::mutex> lock (sleepLock); }
+		wake.notify_all();
+	}
+
+	/** Helps run tasks until the batch has finished. */
+	void wait(Batch& batch) {
+		auto q = home();
+		while (batch.pending.load(std::memory_order_acquire) != 0) {
+			if (!runOne(q))
+				std::this_thread::yield();
+		}
+
+		if (batch.error)
+			std::rethrow_exception(batch.error);
+	}
+
+public:
+	/**
+	 * Starts a pool with the given number of worker threads. The threads
+	 * that wait on the pool also run its tasks, so the default leaves one
+	 * hardware thread for the caller.
+	 */
+	ThreadPool(std::size_t workers = std::max(std::thread::hardware_concurrency(), 1u) - 1)
+		: queued(0), stopping(false) {
+		for (std::size_t i = 0; i < std::max<std::size_t>(workers, 1); i++)
+			queues.emplace_back(new Queue());
+		for (std::size_t i = 0; i < workers; i++)
+			threads.emplace_back(&ThreadPool::work, this, i);
+	}
+
+	~ThreadPool(void) {
+		{
+			std::lock_guard<std::mutex> lock (sleepLock);
+			stopping = true;
+		}
+		wake.notify_all();
+		for (auto& t : threads)
+			t.join();
+	}
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	/** Gets the number of worker threads. */
+	std::size_t size(void) const {
+		return threads.size();
+	}
+
+	/**
+	 * Numbers the threads that run this pool's tasks: 1 + the worker's
+	 * index on a worker, and 0 on any other thread.
+	 */
+	std::size_t threadIndex(void) const {
+		return currentPool == this ? currentQueue + 1 : 0;
+	}
+
+	/**
+	 * Runs f(begin, end) over [0, count) split into ranges of at least
+	 * grain, in parallel, returning once all have run. The first exception
+	 * thrown by f is rethrown here.
+	 */
+	template<typename F>
+	void parallelFor(std::size_t count, std::size_t grain, F&& f) {
+		grain = std::max<std::size_t>(grain, 1);
+		if (count == 0)
+			return;
+		if (threads.empty() || count <= grain) {
+			f(std::size_t(0), count);
+			return;
+		}
+
+		using Fn = std::remove_reference_t<F>;
+		auto run = [](void *ctx, std::size_t begin, std::size_t end) {
+			(*static_cast<Fn*>(ctx))(begin, end);
+		};
+
+		Batch batch ((count + grain - 1) / grain);
+		std::vector<Task> tasks;
+		for (std::size_t begin = 0; begin < count; begin += grain) {
+			tasks.push_back({run, const_cast<void*>(static_cast<const void*>(&f)),
+				begin, std::min(begin + grain, count), &batch});
+		}
+
+		submit(tasks);
+		wait(batch);
+	}
+
+	/**
+	 * Runs f(i) for every node i of a dependency graph, each only once all
+	 * nodes with an edge to it have run, returning when all have run.
+	 * Nodes without a path between them may run in parallel. The first
+	 * exception thrown by f is rethrown here; the nodes after it still run.
+	 * @param successors the nodes each node has an edge to, which must not
+	 *        form a cycle
+	 */
+	template<typename F>
+	void runGraph(const std::vector<std::vector<std::size_t>>& successors,
+		F&& f)
+	{
+		using Fn = std::remove_reference_t<F>;
+
+		auto n = successors.size();
+		if (n == 0)
+			return;
+
+		Batch batch (n);
+		Graph<Fn> graph {this, &successors,
+			std::unique_ptr<std::atomic<std::size_t>[]>(
+				new std::atomic<std::size_t>[n]),
+			&f, &batch};
+		for (std::size_t i = 0; i < n; i++)
+			graph.waiting[i] = 0;
+		for (auto& next : successors) {
+			for (auto j : next)
+				graph.waiting[j]++;
+		}
+
+		std::vector<Task> ready;
+		for (std::size_t i = 0; i < n; i++) {
+			if (graph.waiting[i] == 0)
+				ready.push_back({&runNode<Fn>, &graph, i, 0, &batch});
+		}
+
+		submit(ready);
+		wait(batch);
+	}
+};
+
+class EntityManager;
+
+/**
+ * @struct ViewCache
+ * What a view remembers about the entities matching its query. With
+ * archetype storage this is the list of matching archetypes, which grows as
+ * archetypes are created; with sparse set storage it is the set of matching
+ * entities, updated as components are assigned and removed.
+ */
+struct ViewCache {
+	Signature mask;
+	std::vector<Archetype*> archetypes;
+	EntitySet entities;
+
+	ViewCache(const Signature& m, AllocationStats& stats)
+		: mask(m), entities(stats) {}
+};
+
+template<class... Ts>
+class View;
+
+/**
+ * @struct Entity
+ * Allows access to an entity and it's components.
+ * Note that this is not the actual entity's data, that is stored in the
+ * EntityManager's archetypes.
+ */
+struct Entity {
+	EntityManager *manager;
+	Id id;
+
+	/** Constructs an entity object to handle the given entity. */
+	Entity(EntityManager& em, Id _id)
+		: manager(&em), id(_id) {}
+
+	/**
+	 * Assigns a component to the entity, replacing any of the same type.
+	 * @param args arguments to pass to the component's constructor.
+	 * @return a pointer to the new component, valid until the next
+	 *         structural change (creating or killing any entity, assigning
+	 *         or removing any component) in the manager, as rows move to
+	 *         fill gaps; nothing for split components
+	 */
+	template<class T, typename... Args>
+	std::conditional_t<isSplit<T>, void, T*> assign(Args&&... args);
+
+	/**
+	 * Removes a component of the given type from the entity.
+	 */
+	template<class T>
+	void remove(void);
+
+	/**
+	 * Tests if the entity has a component of the given type.
+	 * @return true if the entity has the component
+	 */
+	template<class T>
+	bool hasComponent(void) const;
+
+	/**
+	 * Fetches a component from the entity.
+	 * @return the component, nullptr if the entity does not have it
+	 */
+	template<class T>
+	T* component(void);
+
+	/**
+	 * Copies a component out of the entity, which works for split
+	 * components too.
+	 * @return true if the entity has the component
+	 */
+	template<class T>
+	bool get(T& out) const;
+
+	/**
+	 * Tests if the entity is still alive.
+	 * Handles to killed entities stay safe to use: they have no components,
+	 * and assigning or removing components does nothing.
+	 */
+	bool valid(void) const;
+
+	/** Compares two entities through their IDs. */
+	bool operator==(const Entity& e) const {
+		return manager == e.manager && id == e.id;
+	}
+};
+
+/**
+ * The component changes that observers can be told of.
+ */
+enum class ComponentEvent {
+	/** A component was added to an entity. */
+	Construct,
+	/** A component was replaced through assign(). */
+	Update,
+	/** A component was removed, or its entity killed. */
+	Destroy
+};
+
+/**
+ * @struct ObserverList
+ * The observers of one component type, and the entities waiting to be
+ * handed to them.
+ */
+struct ObserverList {
+	using Callback = std::function<void(const std::vector<Entity>&)>;
+
+	static constexpr std::size_t Events = 3;
+
+	/** The callbacks of each event, with the keys that name them. */
+	std::vector<std::pair<std::size_t, Callback>> callbacks[Events];
+	std::vector<Id> pending[Events];
+	std::size_t nextKey = 0;
+};
+
+/**
+ * @struct ObserverHandle
+ * Names an observer added by EntityManager::observe(), for unobserve().
+ */
+struct ObserverHandle {
+	ComponentId component;
+	ComponentEvent event;
+	std::size_t key;
+};
+
+/**
+ * @class CommandBuffer
+ * Records structural changes (creating and killing entities, assigning and
+ * removing components) to make later, for when they cannot be made at once,
+ * such as from inside each(). Playback runs in one pass: entities are
+ * created first, then each entity's changes are made together in the
+ * order recorded, and kills come last.
+ * A buffer may only be recorded into by one thread at a time; see
+ * EntityManager::commands() for one per thread.
+ */
+class CommandBuffer {
+public:
+	/** Refers to an entity the buffer will create during playback. */
+	struct Pending {
+		std::size_t index;
+	};
+
+private:
+	using Apply = void (*)(EntityManager& em, Id id, void *payload);
+
+	struct Command {
+		/** The entity changed, or the index of a pending one. */
+		Id id;
+		bool pending;
+		bool kill;
+		Apply apply;
+		/** The component to assign, if any. */
+		void *payload;
+		void (*discard)(void *payload);
+	};
+
+	static constexpr std::size_t BlockSize = 4096;
+	static constexpr std::size_t BlockAlign = 64;
+
+	std::vector<Command> commands;
+	std::size_t creates;
+	std::vector<Entity> created;
+
+	/** Blocks holding the components to assign, kept across playbacks. */
+	std::vector<unsigned char*> blocks;
+	std::size_t block;
+	std::size_t used;
+	/** Payloads too big for a block. */
+	std::vector<unsigned char*> large;
+
+	void *allocate(std::size_t size, std::size_t align) {
+		if (size > BlockSize || align > BlockAlign) {
+			large.push_back(static_cast<unsigned char*>(::operator new(size,
+				std::align_val_t(std::max(align, BlockAlign)))));
+			return large.back();
+		}
+
+		while (true) {
+			if (block == blocks.size()) {
+				blocks.push_back(static_cast<unsigned char*>(::operator new(
+					BlockSize, std::align_val_t(BlockAlign))));
+			}
+
+			auto offset = (used + align - 1) / align * align;
+			if (offset + size <= BlockSize) {
+				used = offset + size;
+				return blocks[block] + offset;
+			}
+			block++;
+			used = 0;
+		}
+	}
+
+	/** Empties the buffer once every payload has been destroyed. */
+	void reset(void) {
+		for (auto p : large)
+			::operator delete(p, std::align_val_t(BlockAlign));
+		large.clear();
+		commands.clear();
+		creates = 0;
+		block = 0;
+		used = 0;
+	}
+
+	template<class T, typename... Args>
+	void record(Id id, bool pending, Args&&... args);
+
+public:
+	CommandBuffer(void)
+		: creates(0), block(0), used(0) {}
+
+	~CommandBuffer(void) {
+		clear();
+		for (auto p : blocks)
+			::operator delete(p, std::align_val_t(BlockAlign));
+	}
+
+	CommandBuffer(const CommandBuffer&) = delete;
+	CommandBuffer& operator=(const CommandBuffer&) = delete;
+
+	/** Tests if nothing has been recorded since the last playback. */
+	bool empty(void) const {
+		return commands.empty() && creates == 0;
+	}
+
+	/** Records creating an entity. */
+	Pending create(void) {
+		ProfileCounters::change();
+		return Pending {creates++};
+	}
+
+	/** Records killing an entity. */
+	void kill(const Entity& e);
+
+	/**
+	 * Records assigning a component to an entity. The component is
+	 * constructed now and moved into the entity during playback.
+	 */
+	template<class T, typename... Args>
+	void assign(const Entity& e, Args&&... args);
+
+	/** Records assigning a component to an entity the buffer creates. */
+	template<class T, typename... Args>
+	void assign(Pending e, Args&&... args);
+
+	/** Records removing a component from an entity. */
+	template<class T>
+	void remove(const Entity& e);
+
+	/**
+	 * Makes every recorded change, then empties the buffer. Changes to
+	 * entities killed by then are ignored.
+	 */
+	void playback(EntityManager& em);
+
+	/** Drops every recorded change. */
+	void clear(void) {
+		for (auto& c : commands) {
+			if (c.discard != nullptr)
+				c.discard(c.payload);
+		}
+		reset();
+	}
+};
+
+/**
+ * @class SnapshotTypes
+ * Names the component types that snapshots may hold. Component IDs depend
+ * on the order types are first used, so snapshots refer to types by name
+ * and are matched up again when loaded, possibly by another program.
+ * Trivially copyable types are stored as raw blocks of bytes; other types
+ * need functions to write and read them.
+ */
+class SnapshotTypes {
+public:
+	struct Type {
+		std::string name;
+		const ComponentInfo *info;
+		/** Appends a component's bytes to out, empty for raw types. */
+		std::function<void(const void *p, std::string& out)> write;
+		/** Constructs a component at p from the front of in, consuming it. */
+		std::function<void(void *p, std::string_view& in)> read;
+
+		bool raw(void) const {
+			return !write;
+		}
+	};
+
+private:
+	std::vector<Type> types;
+	/** The index into types of each component ID, -1 if not added. */
+	std::vector<int> byId;
+
+	void insert(Type type) {
+		auto id = type.info->id;
+		if (find(type.name) != nullptr || find(id) != nullptr)
+			throw std::logic_error("component type or name added twice");
+		if (id >= byId.size())
+			byId.resize(id + 1, -1);
+		byId[id] = types.size();
+		types.push_back(std::move(type));
+	}
+
+public:
+	/**
+	 * Adds a trivially copyable component type, stored by its bytes.
+	 */
+	template<class T>
+	void add(const std::string& name) {
+		static_assert(std::is_convertible<T*, Component*>::value,
+			"components must inherit Component base class");
+		static_assert(std::is_trivially_copyable<T>::value,
+			"give functions to write and read components that are not trivially copyable");
+		insert(Type {name, &ComponentInfo::of<T>(), nullptr, nullptr});
+	}
+
+	/**
+	 * Adds a component type written and read by the given functions, e.g.
+	 * with pack() and unpack():
+	 *     write(const T& c, std::string& out) appends c to out
+	 *     read(T& c, std::string_view& in) fills a default constructed c
+	 *         from the front of in, removing what it used
+	 */
+	template<class T, typename W, typename R>
+	void add(const std::string& name, W write, R read) {
+		static_assert(std::is_convertible<T*, Component*>::value,
+			"components must inherit Component base class");
+		insert(Type {name, &ComponentInfo::of<T>(),
+			[write](const void *p, std::string& out) {
+				write(*static_cast<const T*>(p), out);
+			},
+			[read](void *p, std::string_view& in) {
+				auto c = new (p) T();
+				try {
+					read(*c, in);
+				} catch (...) {
+					c->~T();
+					throw;
+				}
+			}});
+	}
+
+	/** Finds a type by component ID, nullptr if it was not added. */
+	const Type *find(ComponentId id) const {
+		return id < byId.size() && byId[id] >= 0 ? &types[byId[id]] : nullptr;
+	}
+
+	/** Finds a type by name, nullptr if none was added with it. */
+	const Type *find(std::string_view name) const {
+		for (auto& t : types) {
+			if (t.name == name)
+				return &t;
+		}
+		return nullptr;
+	}
+
+	/** Appends the bytes of a trivially copyable value. */
+	template<typename T>
+	static void pack(std::string& out, const T& value) {
+		static_assert(std::is_trivially_copyable<T>::value,
+			"only trivially copyable values are packed by their bytes");
+		out.append(reinterpret_cast<const char*>(&value), sizeof(T));
+	}
+
+	/** Appends a string, prefixed with its length. */
+	static void pack(std::string& out, const std::string& value) {
+		pack(out, static_cast<std::uint64_t>(value.size()));
+		out.append(value);
+	}
+
+	/** Takes a value appended by pack() from the front of in. */
+	template<typename T>
+	static void unpack(std::string_view& in, T& value) {
+		if constexpr (std::is_same<T, std::string>::value) {
+			std::uint64_t n = 0;
+			unpack(in, n);
+			if (n > in.size())
+				throw std::runtime_error("snapshot ends too soon");
+			value.assign(in.data(), n);
+			in.remove_prefix(n);
+		} else {
+			static_assert(std::is_trivially_copyable<T>::value,
+				"only trivially copyable values are packed by their bytes");
+			if (in.size() < sizeof(T))
+				throw std::runtime_error("snapshot ends too soon");
+			std::memcpy(&value, in.data(), sizeof(T));
+			in.remove_prefix(sizeof(T));
+		}
+	}
+};
+
+/**
+ * @class SnapshotWriter
+ * Writes the parts of a snapshot to a stream, keeping count of the offset
+ * so that blocks can be aligned.
+ */
+class SnapshotWriter {
+private:
+	std::ostream& out;
+	std::uint64_t offset;
+
+public:
+	SnapshotWriter(std::ostream& o)
+		: out(o), offset(0) {}
+
+	void bytes(const void *p, std::size_t n) {
+		out.write(static_cast<const char*>(p), n);
+		offset += n;
+	}
+
+	template<typename T>
+	void value(const T& v) {
+		bytes(&v, sizeof(T));
+	}
+
+	/** Pads with zeros up to a multiple of align, at most 64. */
+	void pad(std::size_t align) {
+		static const char zeros[64] = {};
+		bytes(zeros, (align - offset % align) % align);
+	}
+
+	/** Throws if writing failed. */
+	void finish(void) {
+		out.flush();
+		if (!out)
+			throw std::runtime_error("failed to write snapshot");
+	}
+};
+
+/**
+ * @class SnapshotReader
+ * Reads the parts of a snapshot in memory, checking that they lie within it.
+ */
+class SnapshotReader {
+private:
+	const unsigned char *data;
+	std::size_t size;
+	std::size_t pos;
+
+public:
+	SnapshotReader(const void *d, std::size_t n)
+		: data(static_cast<const unsigned char*>(d)), size(n), pos(0) {}
+
+	[[noreturn]] static void fail(const char *what) {
+		throw std::runtime_error(std::string("bad snapshot: ") + what);
+	}
+
+	/** Takes count items of the given size, returning where they start. */
+	const unsigned char *bytes(std::size_t count, std::size_t itemSize = 1) {
+		if (itemSize != 0 && count > (size - pos) / itemSize)
+			fail("ends too soon");
+		auto p = data + pos;
+		pos += count * itemSize;
+		return p;
+	}
+
+	template<typename T>
+	T value(void) {
+		T v;
+		std::memcpy(&v, bytes(sizeof(T)), sizeof(T));
+		return v;
+	}
+
+	/** Skips padding up to a multiple of align. */
+	void pad(std::size_t align) {
+		bytes((align - pos % align) % align);
+	}
+
+	bool done(void) const {
+		return pos == size;
+	}
+};
+
+/**
+ * @class Hierarchy
+ * Parent/child relations between entities. Every entity that has a parent
+ * or children is kept in one array in depth-first order, each subtree being
+ * a contiguous range that starts with its root. A pass from front to back
+ * so reaches every parent before its children, and the children of an
+ * entity follow it in the order they were attached. Attaching or detaching
+ * a subtree rotates it into place, only moving the entries between its old
+ * and new positions, so a detach, which moves the subtree to the end, costs
+ * O(n) in the entries from it to the end of the forest. Removing an entity
+ * moves its whole subtree at once, so killing a parent of k children costs
+ * one such rotation rather than k.
+ */
+class Hierarchy {
+public:
+	/** Marks an entity that is in no relation. */
+	static constexpr std::uint32_t None = static_cast<std::uint32_t>(-1);
+
+private:
+	/** The entities in depth-first order. */
+	CountedVector<Id> order;
+	/** The parent of each entity in order, NullId for roots. */
+	CountedVector<Id> parents;
+	/** The size of the subtree starting at each entity, itself included. */
+	CountedVector<std::uint32_t> sizes;
+	/** The index into order of each entity, by ID index. */
+	CountedVector<std::uint32_t> positions;
+
+	/** Appends an entity as a root of its own, if it is not in order yet. */
+	void add(Id id) {
+		auto i = idIndex(id);
+		if (i >= positions.size())
+			positions.resize(i + 1, None);
+		if (positions[i] != None)
+			return;
+
+		positions[i] = static_cast<std::uint32_t>(order.size());
+		order.push_back(id);
+		parents.push_back(NullId);
+		sizes.push_back(1);
+	}
+
+	/**
+	 * Moves the n entries from first on so that they start where the entry
+	 * at to was, to being outside the range.
+	 */
+	void move(std::size_t first, std::size_t n, std::size_t to) {
+		std::size_t lo, mid, hi;
+		if (to > first) {
+			lo = first;
+			mid = first + n;
+			hi = to;
+		} else {
+			lo = to;
+			mid = first;
+			hi = first + n;
+		}
+
+		std::rotate(order.begin() + lo, order.begin() + mid, order.begin() + hi);
+		std::rotate(parents.begin() + lo, parents.begin() + mid, parents.begin() + hi);
+		std::rotate(sizes.begin() + lo, sizes.begin() + mid, sizes.begin() + hi);
+		for (auto i = lo; i < hi; i++)
+			positions[idIndex(order[i])] = static_cast<std::uint32_t>(i);
+	}
+
+	/** Grows the subtrees of an entity and all its ancestors by n. */
+	void grow(Id id, std::int64_t n) {
+		for (; id != NullId; id = parents[position(id)]) {
+			auto& size = sizes[position(id)];
+			size = static_cast<std::uint32_t>(size + n);
+		}
+	}
+
+	/** Drops an entity that is in no relation any more. */
+	void dropIfAlone(Id id) {
+		auto p = position(id);
+		if (p == None || sizes[p] != 1 || parents[p] != NullId)
+			return;
+
+		move(p, 1, order.size());
+		order.pop_back();
+		parents.pop_back();
+		sizes.pop_back();
+		positions[idIndex(id)] = None;
+	}
+
+public:
+	Hierarchy(AllocationStats& stats)
+		: order(stats), parents(stats), sizes(stats), positions(stats) {}
+
+	/** Gets the number of entities in a relation. */
+	std::size_t size(void) const {
+		return order.size();
+	}
+
+	/** Gets the entities in depth-first order. */
+	const Id *ids(void) const {
+		return order.data();
+	}
+
+	/** Gets the parent of each entity in order, NullId for roots. */
+	const Id *parentIds(void) const {
+		return parents.data();
+	}
+
+	/** Gets the size of the subtree starting at each entity in order. */
+	const std::uint32_t *subtreeSizes(void) const {
+		return sizes.data();
+	}
+
+	/** Gets the index of an entity in order, None if it is in no relation. */
+	std::uint32_t position(Id id) const {
+		auto i = idIndex(id);
+		return i < positions.size() ? positions[i] : None;
+	}
+
+	/** Gets the parent of an entity, NullId if it has none. */
+	Id parent(Id id) const {
+		auto p = position(id);
+		return p == None ? NullId : parents[p];
+	}
+
+	/** Gets the bytes of the arrays in use. */
+	std::size_t bookkeepingBytes(void) const {
+		return (order.size() + parents.size()) * sizeof(Id)
+			+ (sizes.size() + positions.size()) * sizeof(std::uint32_t);
+	}
+
+	/**
+	 * Makes child the last child of parent, bringing its subtree along.
+	 * @throws std::invalid_argument if parent is child or a descendant of it
+	 */
+	void attach(Id child, Id parent) {
+		auto c = position(child);
+		auto p = position(parent);
+		if (child == parent || (c != None && p != None && p >= c && p < c + sizes[c]))
+			throw std::invalid_argument("an entity cannot be its own ancestor");
+		if (c != None && parents[c] == parent)
+			return;
+
+		add(child);
+		add(parent);
+		c = position(child);
+		p = position(parent);
+		auto n = sizes[c];
+		auto old = parents[c];
+		std::size_t to = p + sizes[p];
+		if (old != NullId)
+			grow(old, -std::int64_t(n));
+		move(c, n, to);
+		parents[position(child)] = parent;
+		grow(parent, n);
+		if (old != NullId)
+			dropIfAlone(old);
+	}
+
+	/** Makes an entity the root of its own subtree. */
+	void detach(Id child) {
+		auto c = position(child);
+		if (c == None || parents[c] == NullId)
+			return;
+
+		auto n = sizes[c];
+		auto old = parents[c];
+		grow(old, -std::int64_t(n));
+		move(c, n, order.size());
+		parents[position(child)] = NullId;
+		dropIfAlone(old);
+		dropIfAlone(child);
+	}
+
+	/** Takes an entity out of every relation, its children becoming roots. */
+	void remove(Id id) {
+		auto p = position(id);
+		if (p == None)
+			return;
+
+		// Its subtree goes to the end in one rotation, the children as roots
+		auto n = sizes[p];
+		auto old = parents[p];
+		if (old != NullId)
+			grow(old, -std::int64_t(n));
+		move(p, n, order.size());
+		p = position(id);
+		for (auto c = p + 1; c < order.size(); c += sizes[c])
+			parents[c] = NullId;
+
+		// Then the entity and the children left with no relation are dropped
+		std::size_t w = p;
+		for (std::size_t r = p + 1; r < order.size(); r++) {
+			if (sizes[r] == 1 && parents[r] == NullId) {
+				positions[idIndex(order[r])] = None;
+				continue;
+			}
+			order[w] = order[r];
+			parents[w] = parents[r];
+			sizes[w] = sizes[r];
+			positions[idIndex(order[w])] = static_cast<std::uint32_t>(w);
+			w++;
+		}
+		order.erase(order.begin() + w, order.end());
+		parents.erase(parents.begin() + w, parents.end());
+		sizes.erase(sizes.begin() + w, sizes.end());
+		positions[idIndex(id)] = None;
+		if (old != NullId)
+			dropIfAlone(old);
+	}
+
+	/** Drops every relation. */
+	void clear(void) {
+		order.clear();
+		parents.clear();
+		sizes.clear();
+		positions.clear();
+	}
+
+	/**
+	 * Replaces every relation with n entities in depth-first order and the
+	 * parent of each, as given by ids() and parentIds().
+	 * @return false, with no relations left, if that is not a depth-first
+	 *         order of distinct entities that each have a parent or child
+	 */
+	bool load(const Id *ids, const Id *parentIds, std::size_t n) {
+		clear();
+		// The open subtrees, from the current root down
+		std::vector<std::uint32_t> path;
+		auto close = [&](std::size_t end) {
+			auto p = path.back();
+			path.pop_back();
+			sizes[p] = static_cast<std::uint32_t>(end - p);
+			return sizes[p] > 1 || parents[p] != NullId;
+		};
+
+		bool ok = true;
+		for (std::size_t i = 0; ok && i < n; i++) {
+			while (ok && !path.empty() && order[path.back()] != parentIds[i])
+				ok = close(i);
+			auto k = idIndex(ids[i]);
+			if (!ok || (path.empty() && parentIds[i] != NullId)
+				|| (k < positions.size() && positions[k] != None)) {
+				ok = false;
+				break;
+			}
+
+			if (k >= positions.size())
+				positions.resize(k + 1, None);
+			positions[k] = static_cast<std::uint32_t>(i);
+			order.push_back(ids[i]);
+			parents.push_back(parentIds[i]);
+			sizes.push_back(1);
+			path.push_back(static_cast<std::uint32_t>(i));
+		}
+		while (ok && !path.empty())
+			ok = close(n);
+
+		if (!ok)
+			clear();
+		return ok;
+	}
+};
+
+/**
+ * @struct Compaction
+ * Where EntityManager::compact() is in its pass over the entities.
+ */
+struct Compaction {
+	enum class Phase { Idle, Count, Place };
+
+	Phase phase = Phase::Idle;
+	bool group = false;
+	/** The next entity slot to visit. */
+	std::size_t next = 0;
+	/** The row each archetype's next entity goes to. */
+	std::unordered_map<const Archetype*, std::size_t> rows;
+	/** The group of each component set, numbered by first entity. */
+	std::unordered_map<Signature, std::size_t, Signature::Hash> groups;
+	/**
+	 * For each pool by component ID, how many entities of each group it
+	 * holds, then where the next one of each group goes.
+	 */
+	std::vector<std::vector<std::size_t>> targets;
+};
+
+/**
+ * @class EntityManager
+ * Manages a group of entities.
+ */
+class EntityManager {
+private:
+	Storage storage;
+
+	/** Counts the heap use of everything below. */
+	AllocationStats stats;
+	ChunkAllocator chunkAllocator;
+
+	/** The location of every entity, indexed by ID index. */
+	CountedVector<EntityData> entities;
+	/** The components each entity has, parallel to entities. */
+	CountedVector<Signature> signatures;
+	/** Indices of free entity slots, reused last-freed first. */
+	CountedVector<Id> freeList;
+	/**
+	 * The latest EntityData::changed of each block of SlotBlock slots, so
+	 * that saveDelta() only looks through blocks that changed.
+	 */
+	CountedVector<Tick> slotTicks;
+	static constexpr std::size_t SlotBlock = 1024;
+
+	/** The component pools used by sparse set storage, by component ID. */
+	std::vector<std::unique_ptr<Pool>> pools;
+
+	/** Every archetype, the first being the one with no components. */
+	std::vector<std::unique_ptr<Archetype>> archetypes;
+	std::unordered_map<Signature, Archetype*, Signature::Hash> archetypeIndex;
+
+	/** The caches of every view made, kept up to date as entities change. */
+	std::vector<std::unique_ptr<ViewCache>> views;
+
+	/** Parent/child relations, in depth-first order. */
+	Hierarchy hierarchy;
+	Compaction compaction;
+
+	/** Runs parallelEach(), started when first needed. */
+	std::unique_ptr<ThreadPool> workers;
+	/** A command buffer for each thread of the thread pool. */
+	std::vector<std::unique_ptr<CommandBuffer>> buffers;
+
+	/** The tick that changes are marked with. */
+	std::atomic<Tick> tick;
+
+	/** Observers by component ID, and which types each event is observed for. */
+	std::vector<std::unique_ptr<ObserverList>> observers;
+	Signature observed[ObserverList::Events];
+	std::vector<Entity> batch;
+
+	/** The ID of the last snapshot or delta saved, loaded or applied. */
+	Tick snapshot;
+	/** When parent/child relations last changed, for saveDelta(). */
+	Tick relationsChanged;
+
+	friend struct Entity;
+	template<class... Ts>
+	friend class View;
+	friend class SystemManager;
+	template<class Derived, class... Ts>
+	friend class EachSystem;
+
+	Archetype *emptyArchetype(void) {
+		return archetypes.front().get();
+	}
+
+	/** Takes a free entity slot, or adds one, and marks it alive. */
+	EntityData& newSlot(void) {
+		Id index;
+		if (!freeList.empty()) {
+			index = freeList.back();
+			freeList.pop_back();
+		} else {
+			index = entities.size();
+			if (index >= IdIndexMask)
+				throw std::length_error("too many entities for Id");
+			entities.emplace_back(makeId(index, 0));
+			signatures.emplace_back();
+		}
+
+		auto& d = entities[index];
+		d.alive = true;
+		touch(d, changeTick());
+		ProfileCounters::change();
+		return d;
+	}
+
+	/** Marks an entity slot changed, for saveDelta(). */
+	void touch(EntityData& d, Tick now) {
+		d.changed = now;
+		auto block = idIndex(d.id) / SlotBlock;
+		if (block >= slotTicks.size())
+			slotTicks.resize(block + 1, 0);
+		slotTicks[block] = now;
+	}
+
+	/** Queues an entity for the observers of a component event, if any. */
+	void notify(ComponentEvent e, ComponentId c, Id id) {
+		auto i = static_cast<std::size_t>(e);
+		if (observed[i].test(c))
+			observers[c]->pending[i].push_back(id);
+	}
+
+	/** Queues an entity for the destroy observers of each of its components. */
+	void notifyDestroy(Id id, const Signature& sig) {
+		auto& mask = observed[static_cast<std::size_t>(ComponentEvent::Destroy)];
+		if (mask.intersects(sig))
+			sig.forEach([&](ComponentId c) { notify(ComponentEvent::Destroy, c, id); });
+	}
+
+	/**
+	 * Hands each observer its batch of entities. A batch only holds
+	 * entities still in the state the event left them in, so an entity
+	 * whose component was added then removed is only passed to destroy
+	 * observers.
+	 */
+	void dispatchObservers(void) {
+		const ComponentEvent order[] = {ComponentEvent::Destroy,
+			ComponentEvent::Construct, ComponentEvent::Update};
+
+		for (ComponentId c = 0; c < observers.size(); c++) {
+			if (!observers[c])
+				continue;
+
+			for (auto e : order) {
+				auto& ids = observers[c]->pending[static_cast<std::size_t>(e)];
+				if (ids.empty())
+					continue;
+
+				std::sort(ids.begin(), ids.end());
+				ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+				batch.clear();
+				for (auto id : ids) {
+					bool has = valid(id) && signatures[idIndex(id)].test(c);
+					if (has != (e == ComponentEvent::Destroy))
+						batch.emplace_back(*this, id);
+				}
+				ids.clear();
+
+				if (batch.empty())
+					continue;
+				for (auto& f : observers[c]->callbacks[static_cast<std::size_t>(e)])
+					f.second(batch);
+			}
+		}
+	}
+
+	/** Drops every entity and entity slot without telling observers. */
+	void clearStorage(void) {
+		for (auto& a : archetypes)
+			a->clear();
+		for (auto& p : pools) {
+			if (p)
+				p->clear();
+		}
+		for (auto& v : views)
+			v->entities.clear();
+		for (auto& o : observers) {
+			if (o) {
+				for (auto& ids : o->pending)
+					ids.clear();
+			}
+		}
+
+		entities.clear();
+		signatures.clear();
+		freeList.clear();
+		slotTicks.clear();
+		hierarchy.clear();
+		compaction = Compaction();
+	}
+
+	/** Finds or creates the pool for the given component type. */
+	Pool *poolFor(const ComponentInfo& info) {
+		if (info.id >= pools.size())
+			pools.resize(info.id + 1);
+		if (!pools[info.id])
+			pools[info.id].reset(info.makePool(stats));
+		return pools[info.id].get();
+	}
+
+	/** The fixed part at the start of every snapshot. */
+	struct SnapshotHeader {
+		/** 0 for a full snapshot, 1 for a delta. */
+		std::uint32_t kind;
+		/** The snapshot's ID, the tick it was taken at. */
+		Tick tick;
+		std::uint32_t types;
+		std::uint32_t tables;
+		std::uint64_t slots;
+		std::uint64_t frees;
+	};
+
+	/** Numbers the component types written to a snapshot as they are used. */
+	struct SnapshotTypeList {
+		const SnapshotTypes& types;
+		std::vector<const SnapshotTypes::Type*> used;
+		std::vector<std::uint32_t> index;
+
+		SnapshotTypeList(const SnapshotTypes& t)
+			: types(t), index(ENTITIES_MAX_COMPONENTS, ~0u) {}
+
+		std::uint32_t use(ComponentId c) {
+			if (index[c] == ~0u) {
+				auto t = types.find(c);
+				if (t == nullptr)
+					throw std::logic_error("component type missing from SnapshotTypes");
+				index[c] = used.size();
+				used.push_back(t);
+			}
+			return index[c];
+		}
+	};
+
+	/** A table read from a snapshot, its columns pointing into the snapshot. */
+	struct SnapshotTable {
+		std::vector<const SnapshotTypes::Type*> columns;
+		Signature sig;
+		const unsigned char *ids;
+		std::size_t rows;
+		/** Each column's data; custom ones are consumed as they are read. */
+		std::vector<std::string_view> blocks;
+	};
+
+	void writeSnapshotHeader(SnapshotWriter& w, const SnapshotHeader& h,
+		const SnapshotTypeList& list) const
+	{
+		w.bytes(SnapshotMagic, sizeof(SnapshotMagic));
+		w.value(SnapshotVersion);
+		w.value(std::uint32_t(0x01020304));
+		w.value(std::uint16_t(sizeof(Id)));
+		w.value(std::uint8_t(IdIndexBits));
+		w.value(std::uint8_t(storage));
+		w.value(h.kind);
+		w.value(h.tick);
+		w.value(std::uint32_t(list.used.size()));
+		w.value(h.tables);
+		w.value(h.slots);
+		w.value(h.frees);
+	}
+
+	/** Writes the types of a snapshot, which must follow its header. */
+	static void writeSnapshotTypes(SnapshotWriter& w, const SnapshotTypeList& list) {
+		for (auto t : list.used) {
+			w.value(std::uint32_t(t->info->size));
+			w.value(std::uint32_t(t->raw()));
+			w.value(std::uint32_t(t->name.size()));
+			w.bytes(t->name.data(), t->name.size());
+		}
+		w.pad(8);
+	}
+
+	/** Reads and checks a snapshot's header. */
+	SnapshotHeader readSnapshotHeader(SnapshotReader& r, std::uint32_t kind) const {
+		if (std::memcmp(r.bytes(sizeof(SnapshotMagic)), SnapshotMagic,
+			sizeof(SnapshotMagic)) != 0)
+			SnapshotReader::fail("not a snapshot");
+		if (r.value<std::uint32_t>() != SnapshotVersion)
+			SnapshotReader::fail("unsupported version");
+		if (r.value<std::uint32_t>() != 0x01020304)
+			SnapshotReader::fail("written with another byte order");
+		if (r.value<std::uint16_t>() != sizeof(Id)
+			|| r.value<std::uint8_t>() != IdIndexBits)
+			SnapshotReader::fail("written with another Id layout");
+		if (r.value<std::uint8_t>() != static_cast<std::uint8_t>(storage))
+			SnapshotReader::fail("written by another storage type");
+
+		SnapshotHeader h;
+		h.kind = r.value<std::uint32_t>();
+		if (h.kind != kind)
+			SnapshotReader::fail(kind == 0 ? "not a full snapshot" : "not a delta");
+		h.tick = r.value<Tick>();
+		h.types = r.value<std::uint32_t>();
+		h.tables = r.value<std::uint32_t>();
+		h.slots = r.value<std::uint64_t>();
+		h.frees = r.value<std::uint64_t>();
+		if (h.slots > IdIndexMask || h.frees > h.slots)
+			SnapshotReader::fail("too many entities");
+		return h;
+	}
+
+	/** Reads the types of a snapshot, matching them to the given ones. */
+	static std::vector<const SnapshotTypes::Type*> readSnapshotTypes(
+		SnapshotReader& r, std::uint32_t count, const SnapshotTypes& types)
+	{
+		std::vector<const SnapshotTypes::Type*> used;
+		for (std::uint32_t i = 0; i < count; i++) {
+			auto size = r.value<std::uint32_t>();
+			auto raw = r.value<std::uint32_t>() != 0;
+			auto length = r.value<std::uint32_t>();
+			auto name = reinterpret_cast<const char*>(r.bytes(length));
+			auto t = types.find(std::string_view(name, length));
+			if (t == nullptr)
+				throw std::runtime_error("snapshot holds unknown component type "
+					+ std::string(name, length));
+			if (t->info->size != size || t->raw() != raw)
+				throw std::runtime_error("snapshot component type "
+					+ std::string(name, length) + " has changed");
+			used.push_back(t);
+		}
+		r.pad(8);
+		return used;
+	}
+
+	/** Writes the free slot indices in reuse order, last first. */
+	void writeSnapshotFreeList(SnapshotWriter& w) const {
+		for (auto i = freeList.size(); i-- > 0;)
+			w.value(freeList[i]);
+	}
+
+	/** Replaces the free list with one written by writeSnapshotFreeList(). */
+	void readSnapshotFreeList(const unsigned char *freed, std::size_t frees) {
+		freeList.resize(frees);
+		for (std::size_t i = 0; i < frees; i++) {
+			Id index;
+			std::memcpy(&index, freed + i * sizeof(Id), sizeof(Id));
+			if (index >= entities.size() || entities[index].alive)
+				SnapshotReader::fail("bad free slot");
+			freeList[frees - 1 - i] = index;
+		}
+	}
+
+	/**
+	 * Writes a table: the IDs of some entities, then a column of components
+	 * for each of the given types. The data comes in runs, through
+	 * forEachRun(column, run) calling run(const void *data, std::size_t n)
+	 * for each run of n items; column -1 is the IDs.
+	 */
+	template<typename F>
+	static void writeSnapshotTable(SnapshotWriter& w, const SnapshotTypeList& list,
+		const std::vector<ComponentId>& columns, std::size_t rows,
+		F&& forEachRun, std::string& scratch)
+	{
+		w.value(std::uint32_t(columns.size()));
+		w.value(std::uint32_t(0));
+		w.value(std::uint64_t(rows));
+		for (auto c : columns)
+			w.value(list.index[c]);
+		w.pad(64);
+		forEachRun(-1, [&](const void *p, std::size_t n) {
+			w.bytes(p, n * sizeof(Id));
+		});
+		w.pad(64);
+
+		for (std::size_t j = 0; j < columns.size(); j++) {
+			auto t = list.used[list.index[columns[j]]];
+			auto size = t->info->size;
+			if (t->raw()) {
+				forEachRun(j, [&](const void *p, std::size_t n) {
+					w.bytes(p, n * size);
+				});
+			} else {
+				scratch.clear();
+				forEachRun(j, [&](const void *p, std::size_t n) {
+					for (std::size_t i = 0; i < n; i++)
+						t->write(static_cast<const unsigned char*>(p) + i * size, scratch);
+				});
+				w.value(std::uint64_t(scratch.size()));
+				w.bytes(scratch.data(), scratch.size());
+			}
+			w.pad(64);
+		}
+	}
+
+	SnapshotTable readSnapshotTable(SnapshotReader& r,
+		const std::vector<const SnapshotTypes::Type*>& types)
+	{
+		SnapshotTable t;
+		auto cols = r.value<std::uint32_t>();
+		r.value<std::uint32_t>();
+		t.rows = r.value<std::uint64_t>();
+
+		auto indices = r.bytes(cols, sizeof(std::uint32_t));
+		for (std::uint32_t j = 0; j < cols; j++) {
+			std::uint32_t i;
+			std::memcpy(&i, indices + j * sizeof(i), sizeof(i));
+			if (i >= types.size() || t.sig.test(types[i]->info->id))
+				SnapshotReader::fail("bad table type");
+			t.columns.push_back(types[i]);
+			t.sig.set(types[i]->info->id);
+		}
+		r.pad(64);
+
+		t.ids = r.bytes(t.rows, sizeof(Id));
+		r.pad(64);
+
+		for (auto c : t.columns) {
+			std::size_t n = c->raw() ? t.rows * c->info->size
+				: r.value<std::uint64_t>();
+			if (c->raw() && t.rows != 0 && n / t.rows != c->info->size)
+				SnapshotReader::fail("table too large");
+			t.blocks.emplace_back(reinterpret_cast<const char*>(r.bytes(n)), n);
+			r.pad(64);
+		}
+		return t;
+	}
+
+	/** Checks that every custom column of a table was read to its end. */
+	static void checkSnapshotTable(const SnapshotTable& t) {
+		for (std::size_t j = 0; j < t.columns.size(); j++) {
+			if (!t.columns[j]->raw() && !t.blocks[j].empty())
+				SnapshotReader::fail("component longer than written");
+		}
+	}
+
+	/**
+	 * Writes the parent/child relations that end a snapshot, or u32 0 and
+	 * u32 0 in their place if they are left out.
+	 */
+	void writeSnapshotRelations(SnapshotWriter& w, bool write) const {
+		w.value(std::uint32_t(write));
+		w.value(std::uint32_t(0));
+		if (!write)
+			return;
+
+		w.value(std::uint64_t(hierarchy.size()));
+		w.bytes(hierarchy.ids(), hierarchy.size() * sizeof(Id));
+		w.pad(8);
+		w.bytes(hierarchy.parentIds(), hierarchy.size() * sizeof(Id));
+		w.pad(8);
+	}
+
+	/** Reads the relations written as above, if there, replacing the old. */
+	void readSnapshotRelations(SnapshotReader& r, Tick now) {
+		auto present = r.value<std::uint32_t>();
+		r.value<std::uint32_t>();
+		if (present == 0)
+			return;
+
+		auto n = r.value<std::uint64_t>();
+		if (n > entities.size())
+			SnapshotReader::fail("too many relations");
+		auto idBytes = r.bytes(n, sizeof(Id));
+		r.pad(8);
+		auto parentBytes = r.bytes(n, sizeof(Id));
+		r.pad(8);
+
+		std::vector<Id> ids (n), parentIds (n);
+		for (std::size_t i = 0; i < n; i++) {
+			std::memcpy(&ids[i], idBytes + i * sizeof(Id), sizeof(Id));
+			std::memcpy(&parentIds[i], parentBytes + i * sizeof(Id), sizeof(Id));
+			if (!valid(ids[i]))
+				SnapshotReader::fail("relation of a dead entity");
+		}
+		if (!hierarchy.load(ids.data(), parentIds.data(), n))
+			SnapshotReader::fail("bad relations");
+		relationsChanged = now;
+	}
+
+	/** Gets the entity of a table row, checking that it is alive. */
+	Id snapshotId(const unsigned char *ids, std::size_t row) const {
+		Id id;
+		std::memcpy(&id, ids + row * sizeof(Id), sizeof(Id));
+		if (!valid(id))
+			SnapshotReader::fail("table holds a dead entity");
+		return id;
+	}
+
+	/** Adds the entities of a full snapshot's table to archetype storage. */
+	void loadArchetypeTable(SnapshotTable& t, Tick now) {
+		std::vector<const ComponentInfo*> infos;
+		for (auto c : t.columns)
+			infos.push_back(c->info);
+		auto a = archetypeFor(std::move(infos));
+		a->reserve(t.rows);
+
+		std::vector<int> cols;
+		bool raw = true;
+		for (auto c : t.columns) {
+			cols.push_back(a->column(c->info->id));
+			raw = raw && c->raw();
+		}
+
+		auto place = [&](Id id, std::size_t row) {
+			auto& d = data(id);
+			if (d.archetype != nullptr)
+				SnapshotReader::fail("entity in more than one table");
+			d.archetype = a;
+			d.row = row;
+			signatures[idIndex(id)] = t.sig;
+		};
+
+		if (raw) {
+			// Raw components have trivial destructors, so rows may be left
+			// unfilled if a bad ID is found
+			auto first = a->pushMany(t.ids, t.rows, now);
+			for (std::size_t i = 0; i < t.rows; i++)
+				place(snapshotId(t.ids, i), first + i);
+
+			// Copy whole runs of rows at a time, up to the end of each chunk
+			for (std::size_t j = 0; j < t.columns.size(); j++) {
+				auto size = t.columns[j]->info->size;
+				for (std::size_t done = 0; done < t.rows;) {
+					auto row = first + done;
+					auto n = std::min(a->capacity - row % a->capacity, t.rows - done);
+					a->storeRun(cols[j], row, reinterpret_cast<const unsigned char*>(
+						t.blocks[j].data()) + done * size, n);
+					done += n;
+				}
+			}
+			return;
+		}
+
+		for (std::size_t i = 0; i < t.rows; i++) {
+			auto id = snapshotId(t.ids, i);
+			auto row = a->push(id, now);
+			std::size_t j = 0;
+			try {
+				place(id, row);
+				for (; j < t.columns.size(); j++) {
+					auto size = t.columns[j]->info->size;
+					if (t.columns[j]->raw())
+						a->store(cols[j], row, t.blocks[j].data() + i * size);
+					else
+						a->construct(cols[j], row, [&](void *p) {
+							t.columns[j]->read(p, t.blocks[j]);
+						});
+				}
+			} catch (...) {
+				while (j-- > 0)
+					a->destroy(cols[j], row);
+				a->fill(row, now);
+				data(id).archetype = nullptr;
+				throw;
+			}
+		}
+	}
+
+	/** Adds the components of a full snapshot's table to sparse set storage. */
+	void loadPoolTable(SnapshotTable& t, Tick now) {
+		std::vector<Id> ids (t.rows);
+		for (std::size_t i = 0; i < t.rows; i++)
+			ids[i] = snapshotId(t.ids, i);
+
+		for (std::size_t j = 0; j < t.columns.size(); j++) {
+			auto info = t.columns[j]->info;
+			auto p = poolFor(*info);
+			for (auto id : ids) {
+				if (p->contains(id))
+					SnapshotReader::fail("entity in more than one table");
+			}
+
+			if (t.columns[j]->raw()) {
+				p->appendRaw(ids.data(), ids.size(), now,
+					reinterpret_cast<const unsigned char*>(t.blocks[j].data()));
+			} else {
+				struct Context {
+					const SnapshotTypes::Type *type;
+					std::string_view *in;
+				} ctx {t.columns[j], &t.blocks[j]};
+
+				for (auto id : ids) {
+					p->emplaceWith(id, now, [](void *c, void *ptr) {
+						auto& ctx = *static_cast<Context*>(c);
+						ctx.type->read(ptr, *ctx.in);
+					}, &ctx);
+				}
+			}
+
+			for (auto id : ids)
+				signatures[idIndex(id)].set(info->id);
+		}
+	}
+
+	/**
+	 * Gives a living entity a component built by construct(ctx, p), which
+	 * must not throw, replacing any it has.
+	 */
+	void putComponent(Id id, const ComponentInfo& info,
+		void (*construct)(void *ctx, void *p), void *ctx)
+	{
+		auto& sig = signatures[idIndex(id)];
+		bool has = sig.test(info.id);
+		notify(has ? ComponentEvent::Update : ComponentEvent::Construct,
+			info.id, id);
+
+		auto& d = data(id);
+		if (storage == Storage::SparseSet) {
+			poolFor(info)->emplaceWith(id, changeTick(), construct, ctx);
+			if (!has) {
+				auto before = sig;
+				sig.set(info.id);
+				updateViews(id, before, sig);
+				touch(d, changeTick());
+			}
+		} else if (has) {
+			int col = d.archetype->column(info.id);
+			d.archetype->destroy(col, d.row);
+			d.archetype->construct(col, d.row, [&](void *p) { construct(ctx, p); });
+			d.archetype->markChanged(d.row, col, changeTick());
+		} else {
+			move(id, withComponent(d.archetype, info));
+			int col = d.archetype->column(info.id);
+			d.archetype->construct(col, d.row, [&](void *p) { construct(ctx, p); });
+			d.archetype->markAdded(d.row, col, changeTick());
+		}
+	}
+
+	/** Writes a delta's table into the entities it holds. */
+	void applySnapshotTable(SnapshotTable& t, const SnapshotHeader& h) {
+		for (std::size_t j = 0; j < t.columns.size(); j++) {
+			auto type = t.columns[j];
+			auto& info = *type->info;
+
+			if (type->raw()) {
+				struct Context {
+					const char *src;
+					std::size_t size;
+				} ctx {t.blocks[j].data(), info.size};
+
+				for (std::size_t i = 0; i < t.rows; i++, ctx.src += info.size) {
+					auto id = snapshotId(t.ids, i);
+					auto& d = data(id);
+					int col = d.archetype ? d.archetype->column(info.id) : -1;
+					if (col >= 0) {
+						// Raw components need no destroying, so just copy over
+						notify(ComponentEvent::Update, info.id, id);
+						d.archetype->store(col, d.row, ctx.src);
+						d.archetype->markChanged(d.row, col, h.tick);
+						continue;
+					}
+
+					putComponent(id, info, [](void *c, void *p) {
+						auto& ctx = *static_cast<Context*>(c);
+						std::memcpy(p, ctx.src, ctx.size);
+					}, &ctx);
+				}
+				continue;
+			}
+
+			// Custom components are read aside first, so that a bad one
+			// leaves its entity as it was
+			std::unique_ptr<unsigned char[]> buffer (
+				new unsigned char[info.size + info.align]);
+			void *temp = buffer.get();
+			std::size_t space = info.size + info.align;
+			std::align(info.align, info.size, temp, space);
+
+			for (std::size_t i = 0; i < t.rows; i++) {
+				auto id = snapshotId(t.ids, i);
+				type->read(temp, t.blocks[j]);
+				struct Context {
+					const ComponentInfo *info;
+					void *temp;
+					bool used;
+				} ctx {&info, temp, false};
+				try {
+					putComponent(id, info, [](void *c, void *p) {
+						auto& ctx = *static_cast<Context*>(c);
+						ctx.info->relocate(p, ctx.temp);
+						ctx.used = true;
+					}, &ctx);
+				} catch (...) {
+					if (!ctx.used)
+						info.destroy(temp);
+					throw;
+				}
+			}
+		}
+		checkSnapshotTable(t);
+	}
+
+	EntityData& data(Id id) {
+		return entities[idIndex(id)];
+	}
+
+	const EntityData& data(Id id) const {
+		return entities[idIndex(id)];
+	}
+
+	/** Finds or creates the pool for component type T. */
+	template<class T>
+	ComponentPool<T>& pool(void) {
+		auto id = componentId<T>();
+		if (id >= pools.size())
+			pools.resize(id + 1);
+		if (!pools[id])
+			pools[id].reset(new ComponentPool<T>(stats));
+		return static_cast<ComponentPool<T>&>(*pools[id]);
+	}
+
+	/** Finds the pool for the given component ID, nullptr if none. */
+	Pool *findPool(ComponentId id) const {
+		return id < pools.size() ? pools[id].get() : nullptr;
+	}
+
+	/**
+	 * Finds or creates the archetype with the given component types.
+	 */
+	Archetype *archetypeFor(std::vector<const ComponentInfo*> infos) {
+		Signature sig;
+		for (auto info : infos)
+			sig.set(info->id);
+
+		auto it = archetypeIndex.find(sig);
+		if (it != archetypeIndex.end())
+			return it->second;
+
+		archetypes.emplace_back(new Archetype(chunkAllocator, stats,
+			std::move(infos)));
+		auto a = archetypes.back().get();
+		archetypeIndex.emplace(sig, a);
+		for (auto& v : views) {
+			if (sig.includes(v->mask))
+				v->archetypes.push_back(a);
+		}
+		return a;
+	}
+
+	/**
+	 * Updates the views of sparse set storage after an entity's signature
+	 * has changed.
+	 */
+	void updateViews(Id id, const Signature& before, const Signature& after) {
+		for (auto& v : views) {
+			bool was = before.includes(v->mask);
+			bool is = after.includes(v->mask);
+			if (is && !was)
+				v->entities.insert(id);
+			else if (was && !is)
+				v->entities.remove(id);
+		}
+	}
+
+	/**
+	 * Moves an entity's row into another archetype. Components shared by both
+	 * archetypes are relocated and ones missing from the target destroyed;
+	 * any new components are left for the caller to construct.
+	 */
+	void move(Id id, Archetype *to) {
+		auto& d = data(id);
+		auto from = d.archetype;
+		auto now = changeTick();
+		auto row = to->push(id, now);
+
+		for (std::size_t i = 0; i < from->infos.size(); i++) {
+			int col = to->column(from->type[i]);
+			if (col >= 0) {
+				to->relocate(col, row, *from, i, d.row);
+				to->markChanged(row, col, now);
+			} else {
+				from->destroy(i, d.row);
+			}
+		}
+
+		Id moved = from->fill(d.row, now);
+		if (moved != id)
+			data(moved).row = d.row;
+		d.archetype = to;
+		d.row = row;
+		touch(d, now);
+		signatures[idIndex(id)] = to->signature();
+		ProfileCounters::change();
+	}
+
+	/** Finds the archetype with from's components and info's. */
+	Archetype *withComponent(Archetype *from, const ComponentInfo& info) {
+		auto& to = Archetype::edge(from->addEdges, info.id);
+		if (to == nullptr) {
+			auto infos = from->infos;
+			infos.push_back(&info);
+			to = archetypeFor(std::move(infos));
+			Archetype::edge(to->removeEdges, info.id) = from;
+		}
+		return to;
+	}
+
+	/** Finds the archetype with from's components except info's. */
+	Archetype *withoutComponent(Archetype *from, const ComponentInfo& info) {
+		auto& to = Archetype::edge(from->removeEdges, info.id);
+		if (to == nullptr) {
+			auto infos = from->infos;
+			infos.erase(std::find(infos.begin(), infos.end(), &info));
+			to = archetypeFor(std::move(infos));
+			Archetype::edge(to->addEdges, info.id) = from;
+		}
+		return to;
+	}
+
+	/** Removes a component from a living entity, if it has one. */
+	void removeComponent(Id id, const ComponentInfo& info) {
+		auto& sig = signatures[idIndex(id)];
+		if (!sig.test(info.id))
+			return;
+
+		notify(ComponentEvent::Destroy, info.id, id);
+		if (storage == Storage::SparseSet) {
+			auto before = sig;
+			sig.reset(info.id);
+			updateViews(id, before, sig);
+			findPool(info.id)->remove(id);
+			touch(data(id), changeTick());
+			ProfileCounters::change();
+		} else {
+			move(id, withoutComponent(data(id).archetype, info));
+		}
+	}
+
+	/**
+	 * Creates n entities with copies of the given components, passing each
+	 * new ID to created. Storage is reserved up front and every entity is
+	 * put straight into its final archetype or pools.
+	 */
+	template<class... Ts, typename F>
+	void spawn(std::size_t n, F&& created, const Ts&... init) {
+		if (n == 0)
+			return;
+
+		std::size_t fresh = n > freeList.size() ? n - freeList.size() : 0;
+		if (entities.size() + fresh > IdIndexMask)
+			throw std::length_error("too many entities for Id");
+		entities.reserve(entities.size() + fresh);
+		signatures.reserve(signatures.size() + fresh);
+
+		auto sig = Signature::of<Ts...>();
+		auto now = changeTick();
+		Archetype *a = nullptr;
+		[[maybe_unused]] int cols[sizeof...(Ts) + 1] = {};
+		if (storage == Storage::Archetype) {
+			a = archetypeFor({ &ComponentInfo::of<Ts>()... });
+			a->reserve(n);
+			int col = 1;
+			((cols[col++] = a->column(componentId<Ts>())), ...);
+		} else {
+			[[maybe_unused]] std::size_t max = entities.size() + fresh - 1;
+			(pool<Ts>().reserve(n, max), ...);
+		}
+
+		for (std::size_t i = 0; i < n; i++) {
+			auto& d = newSlot();
+			signatures[idIndex(d.id)] = sig;
+			(notify(ComponentEvent::Construct, componentId<Ts>(), d.id), ...);
+			if (storage == Storage::Archetype) {
+				d.archetype = a;
+				d.row = a->push(d.id, now);
+				int col = 1;
+				((a->construct(cols[col], d.row, [&](void *p) { new (p) Ts(init); }),
+					a->markAdded(d.row, cols[col], now), col++), ...);
+			} else {
+				(pool<Ts>().emplace(d.id, now, init), ...);
+				for (auto& v : views) {
+					if (sig.includes(v->mask))
+						v->entities.insert(d.id);
+				}
+			}
+			created(d.id);
+		}
+	}
+
+	template<class T, typename... Args>
+	T* assign(Id id, Args&&... args) {
+		if (!valid(id))
+			return nullptr;
+		if (storage == Storage::SparseSet) {
+			auto& sig = signatures[idIndex(id)];
+			notify(sig.test(componentId<T>()) ? ComponentEvent::Update
+				: ComponentEvent::Construct, componentId<T>(), id);
+			auto p = pool<T>().emplace(id, changeTick(),
+				std::forward<Args>(args)...);
+			if (!sig.test(componentId<T>())) {
+				auto before = sig;
+				sig.set(componentId<T>());
+				updateViews(id, before, sig);
+				touch(data(id), changeTick());
+				ProfileCounters::change();
+			}
+			return p;
+		}
+
+		// Built first, as args may refer to components about to be
+		// replaced or moved
+		T value (std::forward<Args>(args)...);
+		auto& info = ComponentInfo::of<T>();
+		auto from = data(id).archetype;
+		auto build = [&](void *p) {
+			return new (p) T(std::move(value));
+		};
+
+		// Split components have no address to return
+		int col = from->column(info.id);
+		if (col >= 0) {
+			from->markChanged(data(id).row, col, changeTick());
+			notify(ComponentEvent::Update, info.id, id);
+			if constexpr (isSplit<T>) {
+				from->construct(col, data(id).row, build);
+				return nullptr;
+			} else {
+				auto p = static_cast<T*>(from->at(col, data(id).row));
+				*p = std::move(value);
+				return p;
+			}
+		}
+
+		auto to = withComponent(from, info);
+		notify(ComponentEvent::Construct, info.id, id);
+		move(id, to);
+		col = to->column(info.id);
+		to->markAdded(data(id).row, col, changeTick());
+		if constexpr (isSplit<T>) {
+			to->construct(col, data(id).row, build);
+			return nullptr;
+		} else {
+			return build(to->at(col, data(id).row));
+		}
+	}
+
+	template<class T>
+	void remove(Id id) {
+		if (valid(id))
+			removeComponent(id, ComponentInfo::of<T>());
+	}
+
+	template<class T>
+	T* component(Id id) const {
+		static_assert(!isSplit<T>,
+			"split components have no address; use get(), each() or eachChunk()");
+		if (!valid(id))
+			return nullptr;
+		if (storage == Storage::SparseSet) {
+			auto p = static_cast<ComponentPool<T>*>(findPool(componentId<T>()));
+			return p && p->contains(id) ? &p->write(id, changeTick()) : nullptr;
+		}
+
+		auto& d = data(id);
+		int col = d.archetype->column(componentId<T>());
+		if (col < 0)
+			return nullptr;
+		d.archetype->markChanged(d.row, col, changeTick());
+		return static_cast<T*>(d.archetype->at(col, d.row));
+	}
+
+	template<class T>
+	bool get(Id id, T& out) const {
+		if (!valid(id))
+			return false;
+		if (storage == Storage::SparseSet) {
+			auto p = findPool<T>();
+			if (p == nullptr || !p->contains(id))
+				return false;
+			out = p->at(id);
+			return true;
+		}
+
+		auto& d = data(id);
+		int col = d.archetype->column(componentId<T>());
+		if (col < 0)
+			return false;
+		if constexpr (isSplit<T>)
+			d.archetype->load(col, d.row, &out);
+		else
+			out = *static_cast<const T*>(d.archetype->at(col, d.row));
+		return true;
+	}
+
+	template<class T>
+	bool hasComponent(Id id) const {
+		return valid(id) && signatures[idIndex(id)].test(componentId<T>());
+	}
+
+	/** Finds the pool for component type T, nullptr if there is none. */
+	template<class T>
+	ComponentPool<std::remove_const_t<T>> *findPool(void) const {
+		return static_cast<ComponentPool<std::remove_const_t<T>>*>(
+			findPool(componentId<T>()));
+	}
+
+	/**
+	 * Calls an each() callback with whichever of the entity and its
+	 * components the callback accepts.
+	 */
+	template<typename F, class... Ts>
+	static void invoke(F& f, Entity e, Ts&... components) {
+		if constexpr (std::is_invocable_v<F&, Entity, Ts&...>)
+			f(e, components...);
+		else if constexpr (std::is_invocable_v<F&, Ts&...>)
+			f(components...);
+		else
+			f(e);
+	}
+
+	/** Marks a column or pool entry changed if T is handed out for writing. */
+	template<class T>
+	static void markWritten(Tick *ticks, std::size_t i, Tick now) {
+		if constexpr (!std::is_const<T>::value)
+			ticks[i] = now;
+	}
+
+	/** Fetches a pooled component, marking it changed if T is not const. */
+	template<class T>
+	static T& fetch(ComponentPool<std::remove_const_t<T>> *p, Id id, Tick now) {
+		if constexpr (std::is_const<T>::value)
+			return p->at(id);
+		else
+			return p->write(id, now);
+	}
+
+	/**
+	 * @struct Cursor
+	 * Hands out the components of one chunk column to eachInChunk(). Split
+	 * components are copied out to a temporary, and back in if written.
+	 */
+	template<class T, bool Split = isSplit<T>>
+	struct Cursor {
+		T *array;
+
+		Cursor(const Archetype& a, const Archetype::Chunk& c, int col)
+			: array(static_cast<T*>(a.array(c, col))) {}
+
+		T& get(std::size_t i) {
+			return array[i];
+		}
+
+		void put(std::size_t) {}
+	};
+
+	template<class T>
+	struct Cursor<T, true> {
+		using U = std::remove_const_t<T>;
+		Column<U> column;
+		alignas(U) unsigned char copy[sizeof(U)];
+
+		Cursor(const Archetype& a, const Archetype::Chunk& c, int col)
+			: column(a.span<U>(c, col)) {}
+
+		U& value(void) {
+			return *std::launder(reinterpret_cast<U*>(copy));
+		}
+
+		T& get(std::size_t i) {
+			column.load(i, value());
+			return value();
+		}
+
+		void put(std::size_t i) {
+			if constexpr (!std::is_const<T>::value)
+				column.store(i, value());
+		}
+	};
+
+	/**
+	 * Runs a function through every row of an archetype chunk, handing it
+	 * the chunk's components of the given types. Columns handed out for
+	 * writing are marked changed.
+	 */
+	template<class... Ts, typename F, std::size_t... Is>
+	void eachInChunk(F& f, const Archetype& arch, const Archetype::Chunk& c,
+		const int *cols, [[maybe_unused]] Tick now, std::index_sequence<Is...>)
+	{
+		[[maybe_unused]] auto changed = arch.changedTicks(c);
+		(markWritten<Ts>(changed, cols[Is], now), ...);
+		auto ids = arch.ids(c);
+		[[maybe_unused]] std::tuple<Cursor<Ts>...> cursors (Cursor<Ts>(arch, c, cols[Is])...);
+		for (std::size_t i = 0, n = c.count; i < n; i++) {
+			invoke(f, Entity(*this, ids[i]), std::get<Is>(cursors).get(i)...);
+			(std::get<Is>(cursors).put(i), ...);
+		}
+	}
+
+	/**
+	 * Runs a function through every chunk of the archetypes whose signature
+	 * includes all the given component types, handing it their columns.
+	 */
+	template<class... Ts, typename F, std::size_t... Is>
+	void eachChunkInArchetypes(F& f, const Filter& filter, std::index_sequence<Is...>) {
+		auto mask = Signature::of<Ts...>();
+		mask |= filter.changedMask;
+		mask |= filter.addedMask;
+		auto now = changeTick();
+		std::uint64_t visited = 0, matched = 0;
+
+		for (std::size_t a = 0; a < archetypes.size(); a++) {
+			auto arch = archetypes[a].get();
+			if (arch->size() == 0 || !arch->signature().includes(mask))
+				continue;
+
+			const int cols[] = {arch->column(componentId<Ts>())..., -1};
+			for (std::size_t c = 0; c < arch->chunkList().size(); c++) {
+				auto& chunk = arch->chunkList()[c];
+				visited += chunk.count;
+				if (!filter.accepts(*arch, chunk))
+					continue;
+
+				matched += chunk.count;
+				[[maybe_unused]] auto changed = arch->changedTicks(chunk);
+				(markWritten<Ts>(changed, cols[Is], now), ...);
+				f(arch->template span<Ts>(chunk, cols[Is])...);
+			}
+		}
+		ProfileCounters::visit(visited, matched);
+	}
+
+	/** The most entities eachChunk() hands out at once from sparse sets. */
+	static constexpr std::size_t BlockRows = 256;
+
+	/**
+	 * @struct ColumnBuffer
+	 * Room for a block of components of one type, laid out as a chunk
+	 * would hold them, for eachChunk() over sparse set storage.
+	 */
+	template<class T>
+	struct ColumnBuffer {
+		using U = std::remove_const_t<T>;
+		static constexpr std::size_t Rows = BlockRows;
+
+		std::vector<unsigned char> bytes;
+		std::array<void*, Column<T>::Arrays> arrays;
+
+		ColumnBuffer(void) {
+			auto& info = ComponentInfo::of<U>();
+			bytes.resize(Column<T>::Arrays * (Rows * info.size + ChunkAllocator::Align));
+			auto p = bytes.data();
+			for (std::size_t f = 0; f < arrays.size(); f++) {
+				auto size = info.fields.empty() ? info.size : info.fields[f].size;
+				auto space = bytes.size() - (p - bytes.data());
+				void *at = p;
+				arrays[f] = std::align(ChunkAllocator::Align, Rows * size, at, space);
+				p = static_cast<unsigned char*>(at) + Rows * size;
+			}
+		}
+
+		/** Copies in the components of the given entities. */
+		void gather(ComponentPool<U>& pool, const std::vector<Id>& ids) {
+			Column<U> column (arrays, ids.size());
+			for (std::size_t i = 0; i < ids.size(); i++)
+				column.store(i, pool.at(ids[i]));
+		}
+
+		/** Copies written components back out, marking them changed. */
+		void scatter(ComponentPool<U>& pool, const std::vector<Id>& ids, Tick now) {
+			if constexpr (!std::is_const<T>::value) {
+				Column<U> column (arrays, ids.size());
+				for (std::size_t i = 0; i < ids.size(); i++)
+					column.load(i, pool.write(ids[i], now));
+			}
+		}
+	};
+
+	/**
+	 * Runs a function through the entities with all the given component
+	 * types in blocks, copied out of their pools and back.
+	 */
+	template<class... Ts, typename F, std::size_t... Is>
+	void eachChunkInPools(F& f, const Filter& filter, std::index_sequence<Is...>) {
+		static_assert((std::is_trivially_copyable<std::remove_const_t<Ts>>::value && ...),
+			"eachChunk() over sparse set storage needs trivially copyable components");
+		std::tuple<ColumnBuffer<Ts>...> buffers;
+		std::vector<Id> ids;
+		ids.reserve(BlockRows);
+
+		auto flush = [&](void) {
+			auto now = changeTick();
+			(std::get<Is>(buffers).gather(*findPool<Ts>(), ids), ...);
+			f(Column<Ts>(std::get<Is>(buffers).arrays, ids.size())...);
+			(std::get<Is>(buffers).scatter(*findPool<Ts>(), ids, now), ...);
+			ids.clear();
+		};
+
+		each<const Ts...>(filter, [&](Entity e) {
+			ids.push_back(e.id);
+			if (ids.size() == BlockRows)
+				flush();
+		});
+		if (!ids.empty())
+			flush();
+	}
+
+	/**
+	 * Runs a function through every entity in archetypes whose signature
+	 * includes all the given component types.
+	 */
+	template<class... Ts, typename F>
+	void eachInArchetypes(F& f, const Filter& filter) {
+		auto mask = Signature::of<Ts...>();
+		mask |= filter.changedMask;
+		mask |= filter.addedMask;
+		auto now = changeTick();
+		std::uint64_t visited = 0, matched = 0;
+
+		// f must not change the archetypes or chunks; structural changes go
+		// through commands() and take effect at flush()
+		for (std::size_t a = 0; a < archetypes.size(); a++) {
+			auto arch = archetypes[a].get();
+			if (arch->size() == 0 || !arch->signature().includes(mask))
+				continue;
+
+			const int cols[] = {arch->column(componentId<Ts>())..., -1};
+			for (std::size_t c = 0; c < arch->chunkList().size(); c++) {
+				auto& chunk = arch->chunkList()[c];
+				visited += chunk.count;
+				if (filter.accepts(*arch, chunk)) {
+					matched += chunk.count;
+					eachInChunk<Ts...>(f, *arch, chunk, cols, now,
+						std::index_sequence_for<Ts...>());
+				}
+			}
+		}
+		ProfileCounters::visit(visited, matched);
+	}
+
+	/**
+	 * Runs a function through every entity having all the given component
+	 * types. Pools are walked backwards, so removing the current entity's
+	 * component does not skip any others.
+	 * With several types, when the smallest pool involved holds a large
+	 * share of all entities the packed signatures are scanned directly;
+	 * otherwise that pool is walked and the others looked up.
+	 */
+	template<class... Ts, typename F, std::size_t... Is>
+	void eachInPools(F& f, std::index_sequence<Is...>) {
+		auto now = changeTick();
+		std::uint64_t matched = 0;
+
+		if constexpr (sizeof...(Ts) == 0) {
+			for (std::size_t i = 0; i < entities.size(); i++) {
+				if (entities[i].alive) {
+					matched++;
+					invoke(f, Entity(*this, entities[i].id));
+				}
+			}
+			ProfileCounters::visit(entities.size(), matched);
+		} else if constexpr (sizeof...(Ts) == 1) {
+			auto p = findPool<Ts...>();
+			if (p == nullptr)
+				return;
+
+			ProfileCounters::visit(p->size(), p->size());
+			for (auto i = p->size(); i-- > 0;) {
+				if (i >= p->size())
+					continue;
+
+				Id id = p->ids()[i];
+				markWritten<Ts...>(p->changedTicks(), i, now);
+				invoke(f, Entity(*this, id), p->data()[i]);
+			}
+		} else {
+			std::tuple<decltype(findPool<Ts>())...> ps (findPool<Ts>()...);
+			Pool *all[] = {std::get<Is>(ps)...};
+			if (std::find(all, all + sizeof...(Ts), nullptr) != all + sizeof...(Ts))
+				return;
+
+			auto mask = Signature::of<Ts...>();
+			auto lead = *std::min_element(all, all + sizeof...(Ts),
+				[](auto a, auto b) { return a->size() < b->size(); });
+			auto visit = [&](Id id) {
+				matched++;
+				invoke(f, Entity(*this, id), fetch<Ts>(std::get<Is>(ps), id, now)...);
+			};
+
+			if (lead->size() * 4 >= entities.size()) {
+				scanSignatures(signatures.data(), signatures.size(), mask,
+					[&](std::size_t i) { visit(entities[i].id); });
+				ProfileCounters::visit(signatures.size(), matched);
+				return;
+			}
+
+			auto visited = lead->size();
+			for (auto i = lead->size(); i-- > 0;) {
+				if (i >= lead->size())
+					continue;
+
+				Id id = lead->ids()[i];
+				if (signatures[idIndex(id)].includes(mask))
+					visit(id);
+			}
+			ProfileCounters::visit(visited, matched);
+		}
+	}
+
+	/**
+	 * Runs a function through the entities with the given components that
+	 * pass a filter. Rather than test every entity, the pool of one filtered
+	 * component is walked and its ticks checked in order.
+	 * @param parallel whether to spread the pool across the thread pool
+	 */
+	template<class... Ts, typename F, std::size_t... Is>
+	void eachFilteredInPools(F& f, const Filter& filter, bool parallel,
+		std::size_t grain, std::index_sequence<Is...>)
+	{
+		bool added = filter.changedMask.none();
+		auto& leadMask = added ? filter.addedMask : filter.changedMask;
+		Pool *lead = nullptr;
+		leadMask.forEach([&](ComponentId id) {
+			if (lead == nullptr)
+				lead = findPool(id);
+		});
+
+		[[maybe_unused]] std::tuple<decltype(findPool<Ts>())...> ps (findPool<Ts>()...);
+		Pool *all[] = {lead, std::get<Is>(ps)...};
+		if (std::find(std::begin(all), std::end(all), nullptr) != std::end(all))
+			return;
+
+		auto mask = Signature::of<Ts...>();
+		mask |= filter.changedMask;
+		mask |= filter.addedMask;
+		auto now = changeTick();
+		auto visited = lead->size();
+		std::atomic<std::uint64_t> matched (0);
+		auto run = [&](std::size_t begin, std::size_t end) {
+			std::uint64_t n = 0;
+			for (auto i = end; i-- > begin;) {
+				if (i >= lead->size())
+					continue;
+
+				auto ticks = added ? lead->addedTicks() : lead->changedTicks();
+				Id id = lead->ids()[i];
+				if (tickAfter(ticks[i], filter.since)
+					&& signatures[idIndex(id)].includes(mask)
+					&& filter.accepts(pools, id)) {
+					n++;
+					invoke(f, Entity(*this, id), fetch<Ts>(std::get<Is>(ps), id, now)...);
+				}
+			}
+			if constexpr (ProfileCounters::Enabled)
+				matched.fetch_add(n, std::memory_order_relaxed);
+		};
+
+		if (parallel)
+			threadPool().parallelFor(lead->size(), grain == 0 ? 1024 : grain, run);
+		else
+			run(0, lead->size());
+		ProfileCounters::visit(visited, matched.load(std::memory_order_relaxed));
+	}
+
+	template<class... Ts, typename F>
+	void parallelEachInArchetypes(F& f, const Filter& filter, std::size_t grain) {
+		struct Slice {
+			Archetype *arch;
+			const Archetype::Chunk *chunk;
+			std::size_t cols;
+		};
+
+		auto mask = Signature::of<Ts...>();
+		mask |= filter.changedMask;
+		mask |= filter.addedMask;
+		auto now = changeTick();
+		std::vector<int> cols;
+		std::vector<Slice> slices;
+		std::uint64_t visited = 0, matched = 0;
+		for (auto& a : archetypes) {
+			if (a->size() == 0 || !a->signature().includes(mask))
+				continue;
+
+			auto first = cols.size();
+			(cols.push_back(a->column(componentId<Ts>())), ...);
+			for (auto& c : a->chunkList()) {
+				visited += c.count;
+				if (filter.accepts(*a, c)) {
+					matched += c.count;
+					slices.push_back({a.get(), &c, first});
+				}
+			}
+		}
+		cols.push_back(-1);
+		ProfileCounters::visit(visited, matched);
+
+		// Group chunks into tasks of at least grain entities
+		std::vector<std::size_t> bounds (1, 0);
+		std::size_t rows = 0;
+		for (std::size_t i = 0; i < slices.size(); i++) {
+			rows += slices[i].chunk->count;
+			if (rows >= grain) {
+				bounds.push_back(i + 1);
+				rows = 0;
+			}
+		}
+		if (bounds.back() != slices.size())
+			bounds.push_back(slices.size());
+
+		threadPool().parallelFor(bounds.size() - 1, 1,
+			[&](std::size_t begin, std::size_t end) {
+				for (auto i = bounds[begin]; i < bounds[end]; i++) {
+					auto& s = slices[i];
+					eachInChunk<Ts...>(f, *s.arch, *s.chunk, &cols[s.cols], now,
+						std::index_sequence_for<Ts...>());
+				}
+			});
+	}
+
+	template<class... Ts, typename F, std::size_t... Is>
+	void parallelEachInPools(F& f, std::size_t grain, std::index_sequence<Is...>) {
+		if (grain == 0)
+			grain = 1024;
+		auto now = changeTick();
+
+		std::atomic<std::uint64_t> matched (0);
+
+		if constexpr (sizeof...(Ts) == 0) {
+			threadPool().parallelFor(entities.size(), grain,
+				[&](std::size_t begin, std::size_t end) {
+					std::uint64_t n = 0;
+					for (auto i = begin; i < end; i++) {
+						if (entities[i].alive) {
+							n++;
+							invoke(f, Entity(*this, entities[i].id));
+						}
+					}
+					if constexpr (ProfileCounters::Enabled)
+						matched.fetch_add(n, std::memory_order_relaxed);
+				});
+			ProfileCounters::visit(entities.size(), matched.load(std::memory_order_relaxed));
+		} else {
+			std::tuple<decltype(findPool<Ts>())...> ps (findPool<Ts>()...);
+			Pool *all[] = {std::get<Is>(ps)...};
+			if (std::find(all, all + sizeof...(Ts), nullptr) != all + sizeof...(Ts))
+				return;
+
+			auto mask = Signature::of<Ts...>();
+			auto lead = *std::min_element(all, all + sizeof...(Ts),
+				[](auto a, auto b) { return a->size() < b->size(); });
+			threadPool().parallelFor(lead->size(), grain,
+				[&](std::size_t begin, std::size_t end) {
+					std::uint64_t n = 0;
+					for (auto i = begin; i < end; i++) {
+						Id id = lead->ids()[i];
+						if (sizeof...(Ts) == 1 || signatures[idIndex(id)].includes(mask)) {
+							n++;
+							invoke(f, Entity(*this, id), fetch<Ts>(std::get<Is>(ps), id, now)...);
+						}
+					}
+					if constexpr (ProfileCounters::Enabled)
+						matched.fetch_add(n, std::memory_order_relaxed);
+				});
+			ProfileCounters::visit(lead->size(), matched.load(std::memory_order_relaxed));
+		}
+	}
+
+	/**
+	 * Stable-sorts the indices below n into order by less(a, b).
+	 * @return true if they were in order already
+	 */
+	template<typename Less>
+	static bool sortOrder(std::vector<std::size_t>& order, std::size_t n, Less&& less) {
+		order.resize(n);
+		std::iota(order.begin(), order.end(), 0);
+		std::stable_sort(order.begin(), order.end(), less);
+		for (std::size_t i = 0; i < n; i++) {
+			if (order[i] != i)
+				return false;
+		}
+		return true;
+	}
+
+	/** Reorders an archetype's rows as Archetype::permute() does. */
+	void permuteRows(Archetype& a, const std::vector<std::size_t>& order) {
+		a.permute(order, changeTick());
+		for (std::size_t r = 0; r < a.size(); r++)
+			data(a.id(r)).row = r;
+	}
+
+	/**
+	 * Sorts the rows of every archetype, or the entries of every pool, by
+	 * key(id), keeping the order of equal keys.
+	 */
+	template<typename Key>
+	void sortBy(Key&& key) {
+		using K = std::decay_t<decltype(key(Id()))>;
+		std::vector<K> keys;
+		std::vector<std::size_t> order;
+		auto sorted = [&](std::size_t n, auto&& idAt) {
+			keys.resize(n);
+			for (std::size_t i = 0; i < n; i++)
+				keys[i] = key(idAt(i));
+			return sortOrder(order, n,
+				[&](auto a, auto b) { return keys[a] < keys[b]; });
+		};
+
+		if (storage == Storage::Archetype) {
+			for (auto& a : archetypes) {
+				if (!sorted(a->size(), [&](std::size_t r) { return a->id(r); }))
+					permuteRows(*a, order);
+			}
+			return;
+		}
+
+		for (auto& p : pools) {
+			if (!p || sorted(p->size(), [&](std::size_t i) { return p->ids()[i]; }))
+				continue;
+
+			permuteBySwaps(order, [&](std::size_t i, std::size_t j) {
+				p->swap(i, j);
+			});
+		}
+	}
+
+	/** Counts an entity's components into its group, for compact(). */
+	void countForCompaction(const Signature& sig) {
+		auto& c = compaction;
+		auto g = c.groups.try_emplace(sig, c.groups.size()).first->second;
+		sig.forEach([&](ComponentId id) {
+			if (id >= c.targets.size())
+				c.targets.resize(id + 1);
+			if (c.targets[id].size() <= g)
+				c.targets[id].resize(g + 1, 0);
+			c.targets[id][g]++;
+		});
+	}
+
+	/**
+	 * Swaps the entity in slot i into the next place of its archetype, or
+	 * of each of its pools, for compact().
+	 */
+	void placeForCompaction(std::size_t i, Tick now) {
+		auto& c = compaction;
+		auto& d = entities[i];
+		if (storage == Storage::Archetype) {
+			auto row = c.rows[d.archetype]++;
+			if (row >= d.archetype->size() || row == d.row)
+				return;
+
+			Id moved = d.archetype->id(row);
+			d.archetype->swapRows(row, d.row, now);
+			data(moved).row = d.row;
+			d.row = row;
+			return;
+		}
+
+		// Entities whose components changed since counting have no group
+		std::size_t g = 0;
+		if (c.group) {
+			auto it = c.groups.find(signatures[i]);
+			if (it == c.groups.end())
+				return;
+			g = it->second;
+		}
+		signatures[i].forEach([&](ComponentId id) {
+			auto p = findPool(id);
+			if (id >= c.targets.size())
+				c.targets.resize(id + 1);
+			auto& t = c.targets[id];
+			if (!c.group && t.empty())
+				t.push_back(0);
+			if (!p || g >= t.size())
+				return;
+
+			auto to = t[g]++;
+			auto from = p->index(d.id);
+			if (to < p->size() && to != from)
+				p->swap(to, from);
+		});
+	}
+
+	/**
+	 * Fetches a component of an entity known to have it, marking it changed
+	 * if T is not const.
+	 */
+	template<class T>
+	T& fetch(Id id, Tick now) {
+		static_assert(!isSplit<T>,
+			"split components have no address; use get(), each() or eachChunk()");
+		if (storage == Storage::SparseSet)
+			return fetch<T>(findPool<T>(), id, now);
+
+		auto& d = data(id);
+		int col = d.archetype->column(componentId<T>());
+		if constexpr (!std::is_const<T>::value)
+			d.archetype->markChanged(d.row, col, now);
+		return *static_cast<T*>(d.archetype->at(col, d.row));
+	}
+
+	/**
+	 * Runs a function through the entities at positions first to last of
+	 * the hierarchy that have all the given component types.
+	 */
+	template<class... Ts, typename F>
+	void eachInHierarchy(std::size_t first, std::size_t last, F& f) {
+		static_assert((std::is_convertible<Ts*, const Component*>::value && ...),
+			"components must inherit Component base class");
+		auto mask = Signature::of<Ts...>();
+		[[maybe_unused]] auto now = changeTick();
+		auto ids = hierarchy.ids();
+		auto parents = hierarchy.parentIds();
+		std::uint64_t matched = 0;
+		for (auto i = first; i < last; i++) {
+			if (!signatures[idIndex(ids[i])].includes(mask))
+				continue;
+
+			matched++;
+			f(Entity(*this, ids[i]), Entity(*this, parents[i]),
+				fetch<Ts>(ids[i], now)...);
+		}
+		ProfileCounters::visit(last - first, matched);
+	}
+
+public:
+	// max is not enforced
+	EntityManager(Storage s = Storage::Archetype)
+		: storage(s), chunkAllocator(stats), entities(stats), signatures(stats),
+		  freeList(stats), slotTicks(stats), hierarchy(stats), tick(1), snapshot(0),
+		  relationsChanged(0) {
+		buffers.emplace_back(new CommandBuffer());
+		archetypes.emplace_back(new Archetype(chunkAllocator, stats, {}));
+		archetypeIndex.emplace(Signature(), emptyArchetype());
+	}
+
+	~EntityManager(void) {
+		views.clear();
+		archetypes.clear();
+		pools.clear();
+	}
+
+	/**
+	 * Gets counts of the heap allocations made for storage. Once the
+	 * numbers of entities and components stop growing, the allocation count
+	 * stays put: freed chunks, pool slots and entity slots are all reused.
+	 */
+	const AllocationStats& allocationStats(void) const {
+		return stats;
+	}
+
+	/** Gives memory kept for reuse back to the heap. */
+	void trim(void) {
+		chunkAllocator.trim();
+	}
+
+	/**
+	 * Measures the memory held by storage, as counted by allocationStats().
+	 * Costs in proportion to the number of archetypes or pools rather than
+	 * of entities, so it may be called every frame; pass the same usage
+	 * each time to reuse its component list.
+	 */
+	void memoryUsage(MemoryUsage& usage) const {
+		auto& components = usage.components;
+		components.clear();
+		int slot[ENTITIES_MAX_COMPONENTS];
+		std::fill(std::begin(slot), std::end(slot), -1);
+		auto entry = [&](ComponentId id) -> ComponentMemory& {
+			if (slot[id] < 0) {
+				slot[id] = static_cast<int>(components.size());
+				components.push_back({id, 0, 0, 0});
+			}
+			return components[slot[id]];
+		};
+
+		usage.entities = entities.size() - freeList.size();
+		usage.slots = entities.size();
+		usage.archetypes = archetypes.size();
+		usage.chunks = stats.chunksInUse;
+		usage.totalBytes = stats.bytes;
+		usage.componentBytes = 0;
+		usage.overheadBytes = entities.size() * sizeof(EntityData)
+			+ signatures.size() * sizeof(Signature)
+			+ freeList.size() * sizeof(Id)
+			+ slotTicks.size() * sizeof(Tick);
+		usage.freeChunkBytes = stats.chunksFree * ENTITIES_CHUNK_SIZE;
+
+		for (auto& a : archetypes) {
+			usage.overheadBytes += a->chunks.size() * a->header
+				+ a->size() * sizeof(Id) + a->scratch.size();
+			for (std::size_t i = 0; i < a->infos.size(); i++) {
+				auto& c = entry(a->type[i]);
+				c.count += a->size();
+				c.bytes += a->size() * a->infos[i]->size;
+				c.reserved += a->chunks.size() * a->capacity * a->infos[i]->size;
+			}
+		}
+
+		for (std::size_t id = 0; id < pools.size(); id++) {
+			if (!pools[id])
+				continue;
+
+			auto& p = *pools[id];
+			auto& c = entry(id);
+			auto size = ComponentInfo::get(id)->size;
+			c.count += p.size();
+			c.bytes += p.size() * size;
+			c.reserved += p.capacity() * size;
+			usage.overheadBytes += p.bookkeepingBytes();
+		}
+		for (auto& v : views)
+			usage.overheadBytes += v->entities.bookkeepingBytes();
+		usage.overheadBytes += hierarchy.bookkeepingBytes();
+
+		std::sort(components.begin(), components.end(),
+			[](auto& a, auto& b) { return a.id < b.id; });
+		for (auto& c : components)
+			usage.componentBytes += c.bytes;
+		auto used = usage.componentBytes + usage.overheadBytes;
+		usage.slackBytes = usage.totalBytes > used ? usage.totalBytes - used : 0;
+	}
+
+	/** Measures the memory held by storage, as above. */
+	MemoryUsage memoryUsage(void) const {
+		MemoryUsage usage;
+		memoryUsage(usage);
+		return usage;
+	}
+
+	/** Gets the storage backend this manager was created with. */
+	Storage storageType(void) const {
+		return storage;
+	}
+
+	EntityManager(const EntityManager&) = delete;
+	EntityManager& operator=(const EntityManager&) = delete;
+
+	/**
+	 * Tests if the given ID refers to a living entity.
+	 */
+	bool valid(Id id) const {
+		auto i = idIndex(id);
+		return i < entities.size() && entities[i].id == id && entities[i].alive;
+	}
+
+	/**
+	 * Gets a handle to the entity with the given ID.
+	 */
+	Entity get(Id id) {
+		return Entity(*this, id);
+	}
+
+	/**
+	 * Creates a new entity, reusing the slot of a killed one if possible.
+	 * @return an Entity object for the new entity
+	 */
+	Entity create(void) {
+		auto& d = newSlot();
+		if (storage == Storage::Archetype) {
+			d.archetype = emptyArchetype();
+			d.row = d.archetype->push(d.id, changeTick());
+		} else {
+			for (auto& v : views) {
+				if (v->mask.none())
+					v->entities.insert(d.id);
+			}
+		}
+		return Entity(*this, d.id);
+	}
+
+	/**
+	 * Creates many entities at once, each given copies of the components
+	 * passed. Much faster than calling create() and assign() for each, as
+	 * storage is reserved once and no entity moves between archetypes.
+	 * The component types must be distinct.
+	 * @param n the number of entities to create
+	 * @param init the components to copy into each entity
+	 */
+	template<class... Ts>
+	void createMany(std::size_t n, const Ts&... init) {
+		spawn<Ts...>(n, [](Id) {}, init...);
+	}
+
+	/**
+	 * Creates many entities at once as above, appending their handles to
+	 * out.
+	 */
+	template<class... Ts>
+	void createMany(std::vector<Entity>& out, std::size_t n,
+		const Ts&... init)
+	{
+		out.reserve(out.size() + n);
+		spawn<Ts...>(n, [&](Id id) { out.emplace_back(*this, id); }, init...);
+	}
+
+	/**
+	 * Creates an entity with components whose types are only known at run
+	 * time, as when loading. Each is built straight into storage by
+	 * construct(i, p), which must construct a component of type infos[i]
+	 * at p. If it throws, the entity is not created.
+	 * @param infos the distinct component types to give the entity
+	 * @param n the number of types
+	 */
+	template<typename F>
+	Entity createWith(const ComponentInfo *const *infos, std::size_t n,
+		F&& construct)
+	{
+		Signature sig;
+		for (std::size_t i = 0; i < n; i++)
+			sig.set(infos[i]->id);
+
+		auto& d = newSlot();
+		auto now = changeTick();
+		std::size_t i = 0;
+		if (storage == Storage::Archetype) {
+			auto it = archetypeIndex.find(sig);
+			auto a = it != archetypeIndex.end() ? it->second
+				: archetypeFor(std::vector<const ComponentInfo*>(infos, infos + n));
+			d.archetype = a;
+			d.row = a->push(d.id, now);
+			try {
+				for (; i < n; i++) {
+					int col = a->column(infos[i]->id);
+					a->construct(col, d.row, [&](void *p) { construct(i, p); });
+					a->markAdded(d.row, col, now);
+				}
+			} catch (...) {
+				while (i-- > 0)
+					a->destroy(a->column(infos[i]->id), d.row);
+				Id moved = a->fill(d.row, now);
+				if (moved != d.id)
+					data(moved).row = d.row;
+				d.alive = false;
+				freeList.push_back(idIndex(d.id));
+				throw;
+			}
+			signatures[idIndex(d.id)] = sig;
+		} else {
+			struct Context {
+				F *f;
+				std::size_t i;
+			} ctx {&construct, 0};
+
+			auto& dsig = signatures[idIndex(d.id)];
+			try {
+				for (; i < n; i++) {
+					auto c = infos[i]->id;
+					if (c >= pools.size())
+						pools.resize(c + 1);
+					if (!pools[c])
+						pools[c].reset(infos[i]->makePool(stats));
+
+					ctx.i = i;
+					pools[c]->emplaceWith(d.id, now, [](void *x, void *p) {
+						auto& cx = *static_cast<Context*>(x);
+						(*cx.f)(cx.i, p);
+					}, &ctx);
+					dsig.set(c);
+				}
+			} catch (...) {
+				dsig.forEach([&](ComponentId c) { pools[c]->remove(d.id); });
+				dsig.clear();
+				d.alive = false;
+				freeList.push_back(idIndex(d.id));
+				throw;
+			}
+
+			for (auto& v : views) {
+				if (sig.includes(v->mask))
+					v->entities.insert(d.id);
+			}
+		}
+
+		for (i = 0; i < n; i++)
+			notify(ComponentEvent::Construct, infos[i]->id, d.id);
+		return Entity(*this, d.id);
+	}
+
+	/**
+	 * Kills (removes) an entity. Stale handles are ignored.
+	 * @param e the entity to remove
+	 */
+	void kill(const Entity& e) {
+		if (!valid(e.id))
+			return;
+
+		auto& d = data(e.id);
+		d.alive = false;
+		touch(d, changeTick());
+		ProfileCounters::change();
+		d.id = makeId(idIndex(e.id), idVersion(e.id) + 1);
+		freeList.push_back(idIndex(e.id));
+
+		if (hierarchy.position(e.id) != Hierarchy::None) {
+			hierarchy.remove(e.id);
+			relationsChanged = changeTick();
+		}
+		auto& sig = signatures[idIndex(e.id)];
+		notifyDestroy(e.id, sig);
+		if (storage == Storage::SparseSet) {
+			for (auto& v : views)
+				v->entities.remove(e.id);
+			sig.forEach([&](ComponentId c) { pools[c]->remove(e.id); });
+			sig.clear();
+			return;
+		}
+		sig.clear();
+
+		auto arch = d.archetype;
+		for (std::size_t i = 0; i < arch->infos.size(); i++)
+			arch->destroy(i, d.row);
+
+		Id moved = arch->fill(d.row, changeTick());
+		if (moved != e.id)
+			data(moved).row = d.row;
+	}
+
+	/**
+	 * Destroys all entities. Handles to them are left invalid, so their
+	 * slots are kept for reuse.
+	 */
+	void reset(void) {
+		for (auto& a : archetypes)
+			a->clear();
+		for (auto& p : pools) {
+			if (p)
+				p->clear();
+		}
+		for (auto& v : views)
+			v->entities.clear();
+		if (hierarchy.size() != 0)
+			relationsChanged = changeTick();
+		hierarchy.clear();
+		compaction = Compaction();
+
+		freeList.clear();
+		for (auto i = entities.size(); i-- > 0;) {
+			auto& d = entities[i];
+			if (d.alive) {
+				notifyDestroy(d.id, signatures[i]);
+				d.alive = false;
+				touch(d, changeTick());
+				d.id = makeId(i, idVersion(d.id) + 1);
+			}
+			signatures[i].clear();
+			freeList.push_back(i);
+		}
+	}
+
+	/**
+	 * Runs a function through all entities with the given components.
+	 * The function may take the Entity, references to the components in the
+	 * order given, or both, e.g.:
+	 *     em.each<Position, Velocity>([](Position& p, Velocity& v) {...});
+	 * Components may be given as const to only read them; non-const ones
+	 * are marked changed. Creating or killing entities, or assigning or
+	 * removing components, from inside f is not supported; record such
+	 * changes in commands() instead.
+	 * @param f the function to run through
+	 */
+	template<class... Ts, typename F>
+	void each(F&& f) {
+		each<Ts...>(Filter(), std::forward<F>(f));
+	}
+
+	/**
+	 * Runs a function through all entities with the given components that
+	 * also pass the filter, e.g. to visit only moved entities:
+	 *     em.each<const Position>(Filter::changed<Position>(since), f);
+	 */
+	template<class... Ts, typename F>
+	void each(const Filter& filter, F&& f) {
+		static_assert((std::is_convertible<Ts*, const Component*>::value && ...),
+			"components must inherit Component base class");
+		if (storage == Storage::Archetype)
+			eachInArchetypes<Ts...>(f, filter);
+		else if (filter.empty())
+			eachInPools<Ts...>(f, std::index_sequence_for<Ts...>());
+		else
+			eachFilteredInPools<Ts...>(f, filter, false, 0, std::index_sequence_for<Ts...>());
+	}
+
+	/**
+	 * Runs a function through all entities with the given components a
+	 * block at a time, handing it a Column of each type, e.g.:
+	 *     em.eachChunk<Position, const Velocity>(
+	 *         [](Column<Position> p, Column<const Velocity> v) {...});
+	 * In archetype storage each block is a chunk and the columns are its
+	 * arrays, with split components as one array per field. Sparse set
+	 * storage copies blocks of trivially copyable components out and back.
+	 * Non-const columns are marked changed, and the same limits as each()
+	 * apply to what f may do.
+	 */
+	template<class... Ts, typename F>
+	void eachChunk(F&& f) {
+		eachChunk<Ts...>(Filter(), std::forward<F>(f));
+	}
+
+	/**
+	 * Runs a function through the blocks of entities with the given
+	 * components that also pass the filter.
+	 */
+	template<class... Ts, typename F>
+	void eachChunk(const Filter& filter, F&& f) {
+		static_assert(sizeof...(Ts) > 0, "eachChunk() needs component types");
+		static_assert((std::is_convertible<Ts*, const Component*>::value && ...),
+			"components must inherit Component base class");
+		if (storage == Storage::Archetype)
+			eachChunkInArchetypes<Ts...>(f, filter, std::index_sequence_for<Ts...>());
+		else
+			eachChunkInPools<Ts...>(f, filter, std::index_sequence_for<Ts...>());
+	}
+
+	/**
+	 * Makes child the last child of parent. Its own children come along,
+	 * and any parent it had before loses it. When an entity is killed its
+	 * children become roots. Does nothing if either entity is dead.
+	 * @throws std::invalid_argument if parent is child or one of its
+	 *         descendants
+	 */
+	void setParent(const Entity& child, const Entity& parent) {
+		if (valid(child.id) && valid(parent.id)) {
+			hierarchy.attach(child.id, parent.id);
+			relationsChanged = changeTick();
+		}
+	}
+
+	/** Detaches an entity from its parent, if it has one. */
+	void removeParent(const Entity& child) {
+		if (valid(child.id)) {
+			hierarchy.detach(child.id);
+			relationsChanged = changeTick();
+		}
+	}
+
+	/**
+	 * Gets the parent of an entity.
+	 * @return the parent, or an invalid entity if it has none
+	 */
+	Entity parentOf(const Entity& e) const {
+		return Entity(const_cast<EntityManager&>(*this),
+			valid(e.id) ? hierarchy.parent(e.id) : NullId);
+	}
+
+	/** Runs a function through the children of an entity, in order. */
+	template<typename F>
+	void eachChild(const Entity& e, F&& f) {
+		auto p = valid(e.id) ? hierarchy.position(e.id) : Hierarchy::None;
+		if (p == Hierarchy::None)
+			return;
+
+		auto ids = hierarchy.ids();
+		auto sizes = hierarchy.subtreeSizes();
+		for (auto c = p + 1, end = p + sizes[p]; c < end; c += sizes[c])
+			f(Entity(*this, ids[c]));
+	}
+
+	/**
+	 * Sorts storage so that entities in parent/child relations come in the
+	 * hierarchy's order, ahead of the rest, within each archetype or pool.
+	 * eachInHierarchy() then walks components in the order they are stored
+	 * in. Sorting costs O(n log n) in the entities stored, so do it after
+	 * building or reshaping the hierarchy rather than every frame.
+	 */
+	void sortByHierarchy(void) {
+		sortBy([this](Id id) { return hierarchy.position(id); });
+	}
+
+	/**
+	 * Sorts the entities that have a T by comp(a, b), a less-than
+	 * comparison of two components, keeping the order of equal ones.
+	 * Archetype storage sorts every archetype holding T, the entities'
+	 * other components moving along; sparse set storage sorts T's pool.
+	 * Systems then run through T in that order.
+	 */
+	template<class T, typename Compare>
+	void sort(Compare&& comp) {
+		static_assert(std::is_convertible<T*, Component*>::value,
+			"components must inherit Component base class");
+		std::vector<std::size_t> order;
+		if (storage == Storage::SparseSet) {
+			auto p = findPool<T>();
+			if (p && !sortOrder(order, p->size(), [&](auto a, auto b) {
+					return comp(p->data()[a], p->data()[b]); })) {
+				permuteBySwaps(order, [&](std::size_t i, std::size_t j) {
+					p->swap(i, j);
+				});
+			}
+			return;
+		}
+
+		// Split components are gathered first, having no address
+		std::vector<T> split;
+		for (auto& a : archetypes) {
+			int col = a->column(componentId<T>());
+			if (col < 0)
+				continue;
+
+			bool sorted;
+			if constexpr (isSplit<T>) {
+				split.resize(a->size());
+				for (std::size_t r = 0; r < a->size(); r++)
+					a->load(col, r, &split[r]);
+				sorted = sortOrder(order, a->size(), [&](auto x, auto y) {
+					return comp(split[x], split[y]);
+				});
+			} else {
+				sorted = sortOrder(order, a->size(), [&](auto x, auto y) {
+					return comp(*static_cast<const T*>(a->at(col, x)),
+						*static_cast<const T*>(a->at(col, y)));
+				});
+			}
+			if (!sorted)
+				permuteRows(*a, order);
+		}
+	}
+
+	/**
+	 * Puts storage back in the order of the entities' slots a little at a
+	 * time, for long-running worlds whose create/kill churn has shuffled
+	 * it. Each call carries on where the last left off and returns after
+	 * about budget, so it can run every frame; a pass over all entities
+	 * takes O(1) per entity. Entities are then reached in the same order
+	 * in every archetype and every pool. Changes made between calls are
+	 * safe, but may leave the result of that pass a little out of order.
+	 * Undoes sort() and sortByHierarchy().
+	 * @param budget how long to spend, checked every 256 entities
+	 * @param group in sparse set storage, also brings entities with the
+	 *        same components together in every pool, as archetype storage
+	 *        keeps them; the pass then visits every entity twice
+	 * @return true if the pass finished in this call, the next call
+	 *         starting another
+	 */
+	bool compact(std::chrono::nanoseconds budget, bool group = false) {
+		using Phase = Compaction::Phase;
+		auto start = std::chrono::steady_clock::now();
+		auto& c = compaction;
+		group = group && storage == Storage::SparseSet;
+		if (c.phase == Phase::Idle || c.group != group) {
+			c = Compaction();
+			c.group = group;
+			c.phase = group ? Phase::Count : Phase::Place;
+		}
+
+		auto now = changeTick();
+		for (std::size_t steps = 1; ; steps++) {
+			if (steps % 256 == 0 && std::chrono::steady_clock::now() - start >= budget)
+				return false;
+
+			if (c.next == entities.size()) {
+				if (c.phase == Phase::Place) {
+					c = Compaction();
+					return true;
+				}
+
+				// Each group starts where the ones before it end
+				for (auto& t : c.targets) {
+					std::size_t at = 0;
+					for (auto& n : t)
+						at += std::exchange(n, at);
+				}
+				c.phase = Phase::Place;
+				c.next = 0;
+				continue;
+			}
+
+			auto i = c.next++;
+			if (!entities[i].alive)
+				continue;
+			if (c.phase == Phase::Count)
+				countForCompaction(signatures[i]);
+			else
+				placeForCompaction(i, now);
+		}
+	}
+
+	/**
+	 * Runs a function through every entity in a parent/child relation that
+	 * has the given components, parents before their children, e.g. to
+	 * propagate transforms:
+	 *     em.eachInHierarchy<Transform>(
+	 *         [](Entity e, Entity parent, Transform& t) {...});
+	 * parent is invalid for roots. The relations are walked in the order
+	 * they are stored in; for the components to be reached in that order
+	 * too, sort storage by it with sortByHierarchy(). The relations must
+	 * not change from inside f.
+	 */
+	template<class... Ts, typename F>
+	void eachInHierarchy(F&& f) {
+		eachInHierarchy<Ts...>(0, hierarchy.size(), f);
+	}
+
+	/**
+	 * Runs a function through an entity and its descendants that have the
+	 * given components, parents before their children, as above.
+	 */
+	template<class... Ts, typename F>
+	void eachInHierarchy(const Entity& root, F&& f) {
+		auto p = valid(root.id) ? hierarchy.position(root.id) : Hierarchy::None;
+		if (p != Hierarchy::None)
+			eachInHierarchy<Ts...>(p, p + hierarchy.subtreeSizes()[p], f);
+	}
+
+	/**
+	 * Gets a persistent view of the entities with the given components.
+	 * The view's matches are kept up to date as entities change, so running
+	 * through it costs in proportion to the matches rather than to every
+	 * entity. Views of the same component types share their cache.
+	 */
+	template<class... Ts>
+	View<Ts...> view(void) {
+		static_assert((std::is_convertible<Ts*, const Component*>::value && ...),
+			"components must inherit Component base class");
+		auto mask = Signature::of<Ts...>();
+		for (auto& v : views) {
+			if (v->mask == mask)
+				return View<Ts...>(*this, *v);
+		}
+
+		views.emplace_back(new ViewCache(mask, stats));
+		auto& v = *views.back();
+		if (storage == Storage::SparseSet) {
+			scanSignatures(signatures.data(), signatures.size(), mask,
+				[&](std::size_t i) {
+					if (entities[i].alive)
+						v.entities.insert(entities[i].id);
+				});
+		} else {
+			for (auto& a : archetypes) {
+				if (a->signature().includes(mask))
+					v.archetypes.push_back(a.get());
+			}
+		}
+		return View<Ts...>(*this, v);
+	}
+
+	/**
+	 * Gets the thread pool that runs parallel work for this manager,
+	 * starting it if needed.
+	 */
+	ThreadPool& threadPool(void) {
+		if (!workers)
+			setWorkerCount(std::max(std::thread::hardware_concurrency(), 1u) - 1);
+		return *workers;
+	}
+
+	/**
+	 * Replaces the thread pool with one of the given number of worker
+	 * threads. Zero runs all parallel work on the calling thread.
+	 */
+	void setWorkerCount(std::size_t count) {
+		workers.reset(new ThreadPool(count));
+		while (buffers.size() < count + 1)
+			buffers.emplace_back(new CommandBuffer());
+	}
+
+	/**
+	 * Gets the command buffer of the calling thread, for recording
+	 * structural changes where they cannot be made at once, e.g. inside
+	 * each() or parallelEach(). Threads of the thread pool each get their
+	 * own buffer, so recording needs no locks; other threads share one.
+	 * The changes are made by flush(), which SystemManager calls after
+	 * running systems.
+	 */
+	CommandBuffer& commands(void) {
+		return *buffers[workers ? workers->threadIndex() : 0];
+	}
+
+	/**
+	 * Plays back every thread's command buffer, then hands the entities
+	 * queued for observers to them. Changes made by observers are handed on
+	 * at the next flush.
+	 */
+	void flush(void) {
+		for (auto& b : buffers) {
+			if (!b->empty())
+				b->playback(*this);
+		}
+		dispatchObservers();
+	}
+
+	/**
+	 * Adds an observer of the given component event. Rather than being
+	 * called for every change, f is called at each flush() with the batch
+	 * of entities the event happened to since the last, in ID order.
+	 * Entities in a destroy batch may have been killed; those in the
+	 * others still have the component. Other writes to components are
+	 * found through change ticks; see Filter.
+	 * @param f called as f(const std::vector<Entity>& entities)
+	 * @return a handle to remove the observer with unobserve()
+	 */
+	template<class T, typename F>
+	ObserverHandle observe(ComponentEvent e, F&& f) {
+		static_assert(std::is_convertible<T*, Component*>::value,
+			"components must inherit Component base class");
+		auto c = componentId<T>();
+		if (c >= observers.size())
+			observers.resize(c + 1);
+		if (!observers[c])
+			observers[c].reset(new ObserverList());
+
+		auto i = static_cast<std::size_t>(e);
+		auto key = observers[c]->nextKey++;
+		observers[c]->callbacks[i].emplace_back(key, std::forward<F>(f));
+		observed[i].set(c);
+		return {c, e, key};
+	}
+
+	/**
+	 * Removes an observer added by observe(). Entities queued for the event
+	 * are dropped once it has no observers left. Must not be called from
+	 * inside an observer.
+	 */
+	void unobserve(const ObserverHandle& h) {
+		if (h.component >= observers.size() || !observers[h.component])
+			return;
+
+		auto i = static_cast<std::size_t>(h.event);
+		auto& list = *observers[h.component];
+		auto& callbacks = list.callbacks[i];
+		callbacks.erase(std::remove_if(callbacks.begin(), callbacks.end(),
+			[&](const auto& f) { return f.first == h.key; }), callbacks.end());
+		if (callbacks.empty()) {
+			observed[i].reset(h.component);
+			list.pending[i].clear();
+		}
+	}
+
+	/**
+	 * Runs a function through all entities with the given components,
+	 * spreading them across the thread pool. Takes the same callbacks as
+	 * each(), and returns once every entity has been visited.
+	 *
+	 * Each call of f may freely read and write the components it is handed,
+	 * as no other call receives the same entity. Components of other
+	 * entities may only be read, and only if no call writes them: list such
+	 * types as const. Structural changes (creating or killing entities,
+	 * assigning or removing components) are not allowed from f, but may be
+	 * recorded in commands().
+	 *
+	 * @param f the function to run through
+	 * @param grain the least number of entities each task handles; with
+	 *        archetype storage tasks are made of whole chunks, and zero makes
+	 *        one task per chunk
+	 */
+	template<class... Ts, typename F>
+	void parallelEach(F&& f, std::size_t grain = 0) {
+		parallelEach<Ts...>(Filter(), std::forward<F>(f), grain);
+	}
+
+	/**
+	 * Runs a function through all entities with the given components that
+	 * also pass the filter, in parallel as above.
+	 */
+	template<class... Ts, typename F>
+	void parallelEach(const Filter& filter, F&& f, std::size_t grain = 0) {
+		static_assert((std::is_convertible<Ts*, const Component*>::value && ...),
+			"components must inherit Component base class");
+		if (storage == Storage::Archetype) {
+			parallelEachInArchetypes<Ts...>(f, filter, grain);
+		} else if (filter.empty()) {
+			parallelEachInPools<Ts...>(f, grain, std::index_sequence_for<Ts...>());
+		} else {
+			eachFilteredInPools<Ts...>(f, filter, true, grain,
+				std::index_sequence_for<Ts...>());
+		}
+	}
+
+	/** Gets the tick that changes are currently marked with. */
+	Tick changeTick(void) const {
+		return tick.load(std::memory_order_relaxed);
+	}
+
+	/**
+	 * Moves on to the next tick, so that later changes can be told apart
+	 * from earlier ones. To see what changed between two points, advance
+	 * at the first and filter on the tick returned, e.g.:
+	 *     auto since = em.advanceTick();
+	 *     ...
+	 *     em.each<Position>(Filter::changed<Position>(since), f);
+	 * SystemManager does this for every system it runs.
+	 * @return the tick before advancing
+	 */
+	Tick advanceTick(void) {
+		return tick.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	/** Identifies snapshot files. */
+	static constexpr char SnapshotMagic[4] = {'E', 'N', 'T', 'S'};
+	/** The version of the snapshot format that is written and read. */
+	static constexpr std::uint32_t SnapshotVersion = 2;
+
+	/**
+	 * Writes every entity and component to a snapshot, which loadSnapshot()
+	 * can restore. Every component type in use must be in types.
+	 *
+	 * A snapshot is laid out for loading with little more than memcpy(),
+	 * and can be loaded straight from a memory-mapped file. All values are
+	 * in the machine's byte order:
+	 *  - a header: the magic "ENTS", u32 version, u32 0x01020304 to check
+	 *    byte order, u16 sizeof(Id), u8 IdIndexBits, u8 Storage, u32 kind
+	 *    (0 for a full snapshot), the snapshot's ID as a Tick, u32 type
+	 *    count, u32 table count, u64 entity slot count and u64 free slot
+	 *    count
+	 *  - the types, each a u32 size, u32 1 if raw (else 0), u32 name length
+	 *    and the name; then padding to 8 bytes
+	 *  - the Id of every entity slot, padded to 8; a u8 for each slot, 1 if
+	 *    alive, padded to 8; the free slot indices in reuse order (last
+	 *    first) as Ids, padded to 64
+	 *  - the tables: with archetype storage one per archetype, else one per
+	 *    component pool. Each is a u32 column count, u32 0, u64 row count and
+	 *    u32 type index for each column, padded to 64; the row count Ids,
+	 *    padded to 64; then each column, padded to 64: for raw types, the
+	 *    components' bytes, else a u64 byte count and the bytes written by
+	 *    the type's write function.
+	 *  - the parent/child relations (see setParent()): u32 1, u32 0 and u64
+	 *    count of entities in a relation; their Ids in depth-first order,
+	 *    padded to 8; then the Id of each one's parent, NullId for roots,
+	 *    padded to 8.
+	 * @return the snapshot's ID, for saveDelta()
+	 */
+	Tick saveSnapshot(std::ostream& out, const SnapshotTypes& types) {
+		SnapshotTypeList list (types);
+		std::uint32_t tables = 0;
+		if (storage == Storage::Archetype) {
+			for (auto& a : archetypes) {
+				if (a->size() != 0) {
+					tables++;
+					for (auto c : a->type)
+						list.use(c);
+				}
+			}
+		} else {
+			for (ComponentId c = 0; c < pools.size(); c++) {
+				if (pools[c] && pools[c]->size() != 0) {
+					tables++;
+					list.use(c);
+				}
+			}
+		}
+
+		auto id = advanceTick();
+		SnapshotWriter w (out);
+		writeSnapshotHeader(w, {0, id, std::uint32_t(list.used.size()), tables,
+			entities.size(), freeList.size()}, list);
+		writeSnapshotTypes(w, list);
+
+		// Slots are gathered into a buffer to write in few calls
+		std::string scratch (entities.size() * sizeof(Id), '\0');
+		for (std::size_t i = 0; i < entities.size(); i++)
+			std::memcpy(&scratch[i * sizeof(Id)], &entities[i].id, sizeof(Id));
+		w.bytes(scratch.data(), scratch.size());
+		w.pad(8);
+		scratch.resize(entities.size());
+		for (std::size_t i = 0; i < entities.size(); i++)
+			scratch[i] = entities[i].alive ? 1 : 0;
+		w.bytes(scratch.data(), scratch.size());
+		w.pad(8);
+		writeSnapshotFreeList(w);
+		w.pad(64);
+
+		if (storage == Storage::Archetype) {
+			std::string gathered;
+			for (auto& a : archetypes) {
+				if (a->size() == 0)
+					continue;
+				writeSnapshotTable(w, list, a->type, a->size(), [&](int j, auto&& run) {
+					for (auto& c : a->chunks)
+						run(j < 0 ? a->ids(c) : a->packed(c, j, gathered), c.count);
+				}, scratch);
+			}
+		} else {
+			for (ComponentId c = 0; c < pools.size(); c++) {
+				auto p = pools[c].get();
+				if (p == nullptr || p->size() == 0)
+					continue;
+				writeSnapshotTable(w, list, {c}, p->size(), [&](int j, auto&& run) {
+					run(j < 0 ? static_cast<const void*>(p->ids()) : p->componentData(),
+						p->size());
+				}, scratch);
+			}
+		}
+		writeSnapshotRelations(w, true);
+
+		w.finish();
+		snapshot = id;
+		return id;
+	}
+
+	/**
+	 * Writes a delta snapshot: only the entities created, killed, or given
+	 * or stripped of a component type, and the components added or
+	 * changed, after the snapshot with the given ID was taken. Applying it
+	 * with applyDelta() to a manager holding that snapshot, or any later
+	 * one up to this, brings it up to date.
+	 * Changes are found through change ticks (see Filter), so archetype
+	 * storage writes whole chunks that hold a change.
+	 *
+	 * A delta is laid out as a full snapshot (see saveSnapshot()) with kind
+	 * 1, except that after the types come the ID of the snapshot it follows
+	 * as a Tick, u32 0, u64 record count and the free slot indices, padded
+	 * to 8. Records then give the new state of each changed slot: their
+	 * Ids padded to 8, a u8 for each, 1 if alive, padded to 8, and a mask
+	 * of the types each living one has, as one u64 per 64 types, padded to
+	 * 64. Then come the tables of added and changed components, and last
+	 * all the relations as in a full snapshot if any changed, else u32 0
+	 * and u32 0.
+	 * @param since the ID of the snapshot the delta follows, e.g.
+	 *        lastSnapshot()
+	 * @return the delta's ID, for the next delta
+	 */
+	Tick saveDelta(std::ostream& out, const SnapshotTypes& types, Tick since) {
+		SnapshotTypeList list (types);
+
+		std::vector<Id> records;
+		for (std::size_t b = 0; b < slotTicks.size(); b++) {
+			if (!tickAfter(slotTicks[b], since))
+				continue;
+			auto end = std::min(entities.size(), (b + 1) * SlotBlock);
+			for (auto i = b * SlotBlock; i < end; i++) {
+				if (tickAfter(entities[i].changed, since)) {
+					records.push_back(i);
+					signatures[i].forEach([&](ComponentId c) { list.use(c); });
+				}
+			}
+		}
+
+		/** Runs of chunks of an archetype with the same changed columns. */
+		struct ChunkRun {
+			Archetype *a;
+			std::size_t first;
+			std::size_t last;
+			std::size_t rows;
+			std::vector<ComponentId> columns;
+		};
+		std::vector<ChunkRun> runs;
+		/** The changed components of each pool, by index into the pool. */
+		std::vector<std::pair<ComponentId, std::vector<std::size_t>>> changes;
+
+		if (storage == Storage::Archetype) {
+			std::vector<ComponentId> columns;
+			for (auto& a : archetypes) {
+				for (std::size_t k = 0; k < a->chunks.size(); k++) {
+					auto ticks = a->changedTicks(a->chunks[k]);
+					columns.clear();
+					for (std::size_t j = 0; j < a->type.size(); j++) {
+						if (tickAfter(ticks[j], since))
+							columns.push_back(a->type[j]);
+					}
+					if (columns.empty())
+						continue;
+
+					if (!runs.empty() && runs.back().a == a.get()
+						&& runs.back().last == k && runs.back().columns == columns) {
+						runs.back().last++;
+						runs.back().rows += a->chunks[k].count;
+					} else {
+						runs.push_back({a.get(), k, k + 1, a->chunks[k].count, columns});
+						for (auto c : columns)
+							list.use(c);
+					}
+				}
+			}
+		} else {
+			for (ComponentId c = 0; c < pools.size(); c++) {
+				auto p = pools[c].get();
+				if (p == nullptr)
+					continue;
+
+				std::vector<std::size_t> changed;
+				auto ticks = p->changedTicks();
+				for (std::size_t i = 0; i < p->size(); i++) {
+					if (tickAfter(ticks[i], since))
+						changed.push_back(i);
+				}
+				if (!changed.empty()) {
+					list.use(c);
+					changes.emplace_back(c, std::move(changed));
+				}
+			}
+		}
+
+		auto id = advanceTick();
+		SnapshotWriter w (out);
+		writeSnapshotHeader(w, {1, id, std::uint32_t(list.used.size()),
+			std::uint32_t(runs.size() + changes.size()), entities.size(),
+			freeList.size()}, list);
+		w.value(since);
+		w.value(std::uint32_t(0));
+		w.value(std::uint64_t(records.size()));
+		writeSnapshotTypes(w, list);
+		writeSnapshotFreeList(w);
+		w.pad(8);
+
+		for (auto i : records)
+			w.value(entities[i].id);
+		w.pad(8);
+		for (auto i : records)
+			w.value(std::uint8_t(entities[i].alive));
+		w.pad(8);
+		std::vector<std::uint64_t> mask ((list.used.size() + 63) / 64);
+		for (auto i : records) {
+			std::fill(mask.begin(), mask.end(), 0);
+			signatures[i].forEach([&](ComponentId c) {
+				auto t = list.index[c];
+				mask[t / 64] |= std::uint64_t(1) << (t % 64);
+			});
+			w.bytes(mask.data(), mask.size() * sizeof(std::uint64_t));
+		}
+		w.pad(64);
+
+		std::string scratch, gathered;
+		for (auto& r : runs) {
+			std::vector<int> cols;
+			for (auto c : r.columns)
+				cols.push_back(r.a->column(c));
+			writeSnapshotTable(w, list, r.columns, r.rows, [&](int j, auto&& run) {
+				for (auto k = r.first; k < r.last; k++) {
+					auto& c = r.a->chunks[k];
+					run(j < 0 ? r.a->ids(c) : r.a->packed(c, cols[j], gathered), c.count);
+				}
+			}, scratch);
+		}
+
+		for (auto& [c, changed] : changes) {
+			auto p = pools[c].get();
+			auto items = static_cast<const unsigned char*>(p->componentData());
+			auto size = ComponentInfo::get(c)->size;
+			writeSnapshotTable(w, list, {c}, changed.size(), [&](int j, auto&& run) {
+				for (auto i : changed)
+					run(j < 0 ? static_cast<const void*>(p->ids() + i) : items + i * size, 1);
+			}, scratch);
+		}
+		writeSnapshotRelations(w, tickAfter(relationsChanged, since));
+
+		w.finish();
+		snapshot = id;
+		return id;
+	}
+
+	/** Gets the ID of the last snapshot or delta saved, loaded or applied. */
+	Tick lastSnapshot(void) const {
+		return snapshot;
+	}
+
+	/**
+	 * Replaces every entity with those of a snapshot made by saveSnapshot(),
+	 * for a manager with the same storage type. Entities keep their IDs.
+	 * The manager's tick is set to just after the snapshot's ID, with every
+	 * component marked added at that ID, so that deltas can be saved and
+	 * applied as if this were the manager that saved it. Observers are not
+	 * told of the change. If the snapshot is bad, throws
+	 * std::runtime_error, leaving the manager empty if it had started
+	 * loading.
+	 * @param data the snapshot, e.g. a memory-mapped snapshot file
+	 * @param size the size of the snapshot in bytes
+	 * @param types the component types the snapshot may hold, by name
+	 */
+	void loadSnapshot(const void *data, std::size_t size, const SnapshotTypes& types) {
+		SnapshotReader r (data, size);
+		auto h = readSnapshotHeader(r, 0);
+		auto used = readSnapshotTypes(r, h.types, types);
+		auto ids = r.bytes(h.slots, sizeof(Id));
+		r.pad(8);
+		auto alive = r.bytes(h.slots);
+		r.pad(8);
+		auto freed = r.bytes(h.frees, sizeof(Id));
+		r.pad(64);
+
+		clearStorage();
+		try {
+			tick = h.tick;
+			entities.reserve(h.slots);
+			signatures.resize(h.slots);
+			for (std::size_t i = 0; i < h.slots; i++) {
+				Id id;
+				std::memcpy(&id, ids + i * sizeof(Id), sizeof(Id));
+				if (idIndex(id) != i)
+					SnapshotReader::fail("bad entity ID");
+				entities.emplace_back(id);
+				entities.back().alive = alive[i] != 0;
+				entities.back().changed = h.tick;
+			}
+			slotTicks.assign((h.slots + SlotBlock - 1) / SlotBlock, h.tick);
+			readSnapshotFreeList(freed, h.frees);
+
+			for (std::uint32_t i = 0; i < h.tables; i++) {
+				auto t = readSnapshotTable(r, used);
+				if (storage == Storage::Archetype)
+					loadArchetypeTable(t, h.tick);
+				else
+					loadPoolTable(t, h.tick);
+				checkSnapshotTable(t);
+			}
+
+			for (auto& d : entities) {
+				if (!d.alive)
+					continue;
+				if (storage == Storage::Archetype) {
+					if (d.archetype == nullptr) {
+						d.archetype = emptyArchetype();
+						d.row = d.archetype->push(d.id, h.tick);
+					}
+				} else {
+					for (auto& v : views) {
+						if (signatures[idIndex(d.id)].includes(v->mask))
+							v->entities.insert(d.id);
+					}
+				}
+			}
+
+			readSnapshotRelations(r, h.tick);
+			if (!r.done())
+				SnapshotReader::fail("data after the relations");
+		} catch (...) {
+			clearStorage();
+			throw;
+		}
+
+		tick = h.tick + 1;
+		snapshot = h.tick;
+	}
+
+	/**
+	 * Loads a snapshot as above, reading it whole from a stream first.
+	 */
+	void loadSnapshot(std::istream& in, const SnapshotTypes& types) {
+		std::string buffer ((std::istreambuf_iterator<char>(in)),
+			std::istreambuf_iterator<char>());
+		loadSnapshot(buffer.data(), buffer.size(), types);
+	}
+
+	/**
+	 * Applies a delta made by saveDelta() on top of the snapshot this
+	 * manager holds, which must be the one the delta follows or a later
+	 * one. Apply a chain of deltas in the order they were saved. The
+	 * changes are made as ordinary ones, queuing observer events, with the
+	 * manager's tick set as by loadSnapshot(). If the delta does not fit,
+	 * throws std::runtime_error with the manager untouched; if it is
+	 * found bad part way, the manager is left empty.
+	 */
+	void applyDelta(const void *data, std::size_t size, const SnapshotTypes& types) {
+		SnapshotReader r (data, size);
+		auto h = readSnapshotHeader(r, 1);
+		auto since = r.value<Tick>();
+		r.value<std::uint32_t>();
+		auto count = r.value<std::uint64_t>();
+		if (tickAfter(since, snapshot) || !tickAfter(h.tick, snapshot))
+			throw std::runtime_error("delta does not follow the last snapshot");
+		if (h.slots < entities.size() || count > h.slots)
+			SnapshotReader::fail("too few entities");
+
+		auto used = readSnapshotTypes(r, h.types, types);
+		auto freed = r.bytes(h.frees, sizeof(Id));
+		r.pad(8);
+		auto ids = r.bytes(count, sizeof(Id));
+		r.pad(8);
+		auto alive = r.bytes(count);
+		r.pad(8);
+		std::size_t words = (used.size() + 63) / 64;
+		auto masks = r.bytes(count, words * sizeof(std::uint64_t));
+		r.pad(64);
+
+		try {
+			tick = h.tick;
+			while (entities.size() < h.slots) {
+				entities.emplace_back(makeId(entities.size(), 0));
+				signatures.emplace_back();
+			}
+
+			// Bring each changed slot to its entity, empty for now
+			for (std::size_t i = 0; i < count; i++) {
+				Id id;
+				std::memcpy(&id, ids + i * sizeof(Id), sizeof(Id));
+				if (idIndex(id) >= entities.size())
+					SnapshotReader::fail("bad entity ID");
+
+				auto& d = entities[idIndex(id)];
+				if (d.alive && (d.id != id || !alive[i]))
+					kill(Entity(*this, d.id));
+				if (alive[i] && !d.alive) {
+					d.id = id;
+					d.alive = true;
+					touch(d, h.tick);
+					if (storage == Storage::Archetype) {
+						d.archetype = emptyArchetype();
+						d.row = d.archetype->push(id, h.tick);
+					} else {
+						for (auto& v : views) {
+							if (v->mask.none())
+								v->entities.insert(id);
+						}
+					}
+				}
+			}
+
+			for (std::uint32_t i = 0; i < h.tables; i++) {
+				auto t = readSnapshotTable(r, used);
+				applySnapshotTable(t, h);
+			}
+
+			// Strip the components the records' entities no longer have
+			for (std::size_t i = 0; i < count; i++) {
+				if (!alive[i])
+					continue;
+
+				Id id;
+				std::memcpy(&id, ids + i * sizeof(Id), sizeof(Id));
+				Signature sig;
+				for (std::size_t t = 0; t < used.size(); t++) {
+					std::uint64_t word;
+					std::memcpy(&word, masks + (i * words + t / 64) * sizeof(word),
+						sizeof(word));
+					if (word & (std::uint64_t(1) << (t % 64)))
+						sig.set(used[t]->info->id);
+				}
+
+				auto has = signatures[idIndex(id)];
+				if (!has.includes(sig))
+					SnapshotReader::fail("entity lacks components");
+				has.forEach([&](ComponentId c) {
+					if (!sig.test(c))
+						removeComponent(id, *ComponentInfo::get(c));
+				});
+			}
+
+			readSnapshotRelations(r, h.tick);
+			if (!r.done())
+				SnapshotReader::fail("data after the relations");
+			readSnapshotFreeList(freed, h.frees);
+		} catch (...) {
+			clearStorage();
+			throw;
+		}
+
+		tick = h.tick + 1;
+		snapshot = h.tick;
+	}
+
+	/**
+	 * Applies a delta as above, reading it whole from a stream first.
+	 */
+	void applyDelta(std::istream& in, const SnapshotTypes& types) {
+		std::string buffer ((std::istreambuf_iterator<char>(in)),
+			std::istreambuf_iterator<char>());
+		applyDelta(buffer.data(), buffer.size(), types);
+	}
+};
+
+/**
+ * @class View
+ * A cached query over the entities with the given components, made through
+ * EntityManager::view().
+ */
+template<class... Ts>
+class View {
+private:
+	EntityManager *manager;
+	ViewCache *cache;
+
+	/**
+	 * Walks the cached entity set backwards, so removing the current
+	 * entity's component does not skip any others.
+	 */
+	template<typename F, std::size_t... Is>
+	void eachInSet(F& f, std::index_sequence<Is...>) {
+		[[maybe_unused]] auto now = manager->changeTick();
+		[[maybe_unused]] std::tuple<decltype(manager->findPool<Ts>())...> ps (
+			manager->findPool<Ts>()...);
+		auto& set = cache->entities;
+		for (auto i = set.size(); i-- > 0;) {
+			if (i >= set.size())
+				continue;
+
+			Id id = set.ids()[i];
+			EntityManager::invoke(f, Entity(*manager, id),
+				EntityManager::fetch<Ts>(std::get<Is>(ps), id, now)...);
+		}
+	}
+
+public:
+	View(EntityManager& em, ViewCache& c)
+		: manager(&em), cache(&c) {}
+
+	/**
+	 * Runs a function through every matching entity, taking the same kinds
+	 * of callback as EntityManager::each().
+	 */
+	template<typename F>
+	void each(F&& f) {
+		if constexpr (ProfileCounters::Enabled)
+			ProfileCounters::visit(size(), size());
+		if (manager->storage == Storage::SparseSet) {
+			eachInSet(f, std::index_sequence_for<Ts...>());
+			return;
+		}
+
+		for (std::size_t a = 0; a < cache->archetypes.size(); a++) {
+			auto arch = cache->archetypes[a];
+			const int cols[] = {arch->column(componentId<Ts>())..., -1};
+			for (std::size_t c = 0; c < arch->chunkList().size(); c++) {
+				manager->eachInChunk<Ts...>(f, *arch, arch->chunkList()[c],
+					cols, manager->changeTick(), std::index_sequence_for<Ts...>());
+			}
+		}
+	}
+
+	/** Gets the number of matching entities. */
+	std::size_t size(void) const {
+		if (manager->storage == Storage::SparseSet)
+			return cache->entities.size();
+
+		std::size_t n = 0;
+		for (auto a : cache->archetypes)
+			n += a->size();
+		return n;
+	}
+
+	/** Tests if the given entity matches the view. */
+	bool contains(const Entity& e) const {
+		return manager->valid(e.id)
+			&& manager->signatures[idIndex(e.id)].includes(cache->mask);
+	}
+};
+
+/**
+ * @class SpatialGrid
+ * An index of the entities with a component of type T by the position in
+ * its fields X and Y, e.g. SpatialGrid<Position>. The plane is cut into
+ * square cells, each listing the entities in it along with their position,
+ * so queries only touch the cells they overlap.
+ *
+ * update() brings the grid up to date from the components changed since
+ * the last update, found through change ticks as with Filter::changed(),
+ * so its cost follows the number of moved entities rather than all of
+ * them. Entities killed or losing T are dropped as the manager's flush()
+ * hands them on, and killed entities are never returned before then.
+ * Positions are those at the latest update().
+ *
+ * Queries return a span of entities which stays valid until the next
+ * query or update. A grid must not outlive its manager.
+ */
+template<class T, auto X = &T::x, auto Y = &T::y>
+class SpatialGrid {
+private:
+	static constexpr std::uint32_t None = static_cast<std::uint32_t>(-1);
+
+	struct Entry {
+		Id id;
+		float x;
+		float y;
+	};
+
+	/** Where an entity is; map nodes stay put, so entries can be kept. */
+	struct Slot {
+		Id id = NullId;
+		std::uint64_t cell = 0;
+		std::vector<Entry> *entries = nullptr;
+		std::uint32_t index = None;
+	};
+
+	EntityManager *manager;
+	float size;
+	float inverse;
+	Tick since;
+	bool built = false;
+	std::unordered_map<std::uint64_t, std::vector<Entry>> cells;
+	std::vector<Slot> slots;
+	std::size_t count = 0;
+	std::int32_t minCell[2];
+	std::int32_t maxCell[2];
+	std::vector<Id> destroyed;
+	ObserverHandle observer;
+	std::vector<Entity> result;
+	std::vector<std::pair<float, Id>> heap;
+
+	std::int32_t cellOf(float v) const {
+		return static_cast<std::int32_t>(std::floor(v * inverse));
+	}
+
+	static std::uint64_t key(std::int32_t cx, std::int32_t cy) {
+		return static_cast<std::uint64_t>(static_cast<std::uint32_t>(cx)) << 32
+			| static_cast<std::uint32_t>(cy);
+	}
+
+	void erase(Slot& s) {
+		auto& entries = *s.entries;
+		entries[s.index] = entries.back();
+		slots[idIndex(entries[s.index].id)].index = s.index;
+		entries.pop_back();
+		if (entries.empty())
+			cells.erase(s.cell);
+		s.index = None;
+		count--;
+	}
+
+	void insert(Id id, float x, float y) {
+		auto i = idIndex(id);
+		if (i >= slots.size())
+			slots.resize(i + 1);
+
+		auto& s = slots[i];
+		std::int32_t cx = cellOf(x), cy = cellOf(y);
+		auto k = key(cx, cy);
+		if (s.index != None && s.id == id && s.cell == k) {
+			(*s.entries)[s.index] = {id, x, y};
+			return;
+		}
+		if (s.index != None)
+			erase(s);
+
+		auto& entries = cells[k];
+		s = {id, k, &entries, static_cast<std::uint32_t>(entries.size())};
+		entries.push_back({id, x, y});
+		if (count++ == 0) {
+			minCell[0] = maxCell[0] = cx;
+			minCell[1] = maxCell[1] = cy;
+		}
+		minCell[0] = std::min(minCell[0], cx);
+		minCell[1] = std::min(minCell[1], cy);
+		maxCell[0] = std::max(maxCell[0], cx);
+		maxCell[1] = std::max(maxCell[1], cy);
+	}
+
+	/** Runs a function through the entries of the cells in a rectangle. */
+	template<typename F>
+	void eachCell(std::int32_t x0, std::int32_t y0, std::int32_t x1, std::int32_t y1, F&& f) const {
+		if (count == 0)
+			return;
+		x0 = std::max(x0, minCell[0]);
+		y0 = std::max(y0, minCell[1]);
+		x1 = std::min(x1, maxCell[0]);
+		y1 = std::min(y1, maxCell[1]);
+		for (auto cx = x0; cx <= x1; cx++) {
+			for (auto cy = y0; cy <= y1; cy++) {
+				auto it = cells.find(key(cx, cy));
+				if (it == cells.end())
+					continue;
+				for (auto& e : it->second)
+					f(e);
+			}
+		}
+	}
+
+	bool alive(Id id) const {
+		return manager->valid(id);
+	}
+
+public:
+	/**
+	 * Makes a grid over the given manager's entities, which are all indexed
+	 * at the first update().
+	 * @param cellSize the side of a cell; about the usual query radius
+	 *        works well
+	 */
+	SpatialGrid(EntityManager& em, float cellSize)
+		: manager(&em), size(cellSize), inverse(1.0f / cellSize), since(0) {
+		if (!(cellSize > 0.0f))
+			throw std::invalid_argument("cell size must be positive");
+
+		observer = em.observe<T>(ComponentEvent::Destroy, [this](const std::vector<Entity>& es) {
+			for (auto& e : es)
+				destroyed.push_back(e.id);
+		});
+	}
+
+	~SpatialGrid(void) {
+		manager->unobserve(observer);
+	}
+
+	SpatialGrid(const SpatialGrid&) = delete;
+	SpatialGrid& operator=(const SpatialGrid&) = delete;
+
+	/**
+	 * Indexes the entities whose T was assigned or written since the last
+	 * update, and drops those handed on as destroyed since then. Call it
+	 * once the frame's movement is done.
+	 */
+	void update(void) {
+		for (Id id : destroyed) {
+			auto i = idIndex(id);
+			if (i < slots.size() && slots[i].id == id && slots[i].index != None
+				&& !Entity(*manager, id).template hasComponent<T>())
+				erase(slots[i]);
+		}
+		destroyed.clear();
+
+		// The first update indexes every entity
+		auto last = since;
+		since = manager->advanceTick();
+		auto index = [this](Entity e, const T& c) {
+			insert(e.id, static_cast<float>(c.*X), static_cast<float>(c.*Y));
+		};
+		if (built)
+			manager->template each<const T>(Filter::changed<T>(last), index);
+		else
+			manager->template each<const T>(index);
+		built = true;
+	}
+
+	/** Gets the number of entities in the grid. */
+	std::size_t entityCount(void) const {
+		return count;
+	}
+
+	/** Gets the side of a cell. */
+	float cellSize(void) const {
+		return size;
+	}
+
+	/** Finds the entities in the box from (x0, y0) to (x1, y1), inclusive. */
+	const std::vector<Entity>& inBox(float x0, float y0, float x1, float y1) {
+		result.clear();
+		eachCell(cellOf(x0), cellOf(y0), cellOf(x1), cellOf(y1), [&](const Entry& e) {
+			if (e.x >= x0 && e.x <= x1 && e.y >= y0 && e.y <= y1 && alive(e.id))
+				result.emplace_back(*manager, e.id);
+		});
+		return result;
+	}
+
+	/** Finds the entities within radius of (x, y). */
+	const std::vector<Entity>& inRadius(float x, float y, float radius) {
+		result.clear();
+		float r2 = radius * radius;
+		eachCell(cellOf(x - radius), cellOf(y - radius), cellOf(x + radius), cellOf(y + radius),
+			[&](const Entry& e) {
+				float dx = e.x - x, dy = e.y - y;
+				if (dx * dx + dy * dy <= r2 && alive(e.id))
+					result.emplace_back(*manager, e.id);
+			});
+		return result;
+	}
+
+	/**
+	 * Finds the k entities nearest to (x, y), nearest first. Searches rings
+	 * of cells outwards until no closer entity can remain.
+	 */
+	const std::vector<Entity>& nearest(float x, float y, std::size_t k) {
+		result.clear();
+		heap.clear();
+		if (k == 0 || count == 0)
+			return result;
+
+		auto consider = [&](const Entry& e) {
+			float dx = e.x - x, dy = e.y - y;
+			float d = dx * dx + dy * dy;
+			if (heap.size() == k && d >= heap.front().first)
+				return;
+			if (!alive(e.id))
+				return;
+			if (heap.size() == k) {
+				std::pop_heap(heap.begin(), heap.end());
+				heap.pop_back();
+			}
+			heap.emplace_back(d, e.id);
+			std::push_heap(heap.begin(), heap.end());
+		};
+
+		std::int32_t cx = cellOf(x), cy = cellOf(y);
+		std::int32_t reach = std::max({cx - minCell[0], maxCell[0] - cx,
+			cy - minCell[1], maxCell[1] - cy});
+		for (std::int32_t r = 0; r <= reach; r++) {
+			if (heap.size() == k) {
+				// Cells in ring r lie at least r - 1 cells away
+				float bound = static_cast<float>(r - 1) * size;
+				if (bound > 0.0f && bound * bound >= heap.front().first)
+					break;
+			}
+			if (r == 0) {
+				eachCell(cx, cy, cx, cy, consider);
+				continue;
+			}
+			eachCell(cx - r, cy - r, cx + r, cy - r, consider);
+			eachCell(cx - r, cy + r, cx + r, cy + r, consider);
+			eachCell(cx - r, cy - r + 1, cx - r, cy + r - 1, consider);
+			eachCell(cx + r, cy - r + 1, cx + r, cy + r - 1, consider);
+		}
+
+		std::sort_heap(heap.begin(), heap.end());
+		for (auto& h : heap)
+			result.emplace_back(*manager, h.second);
+		return result;
+	}
+};
+
+template<class T, typename... Args>
+std::conditional_t<isSplit<T>, void, T*> Entity::assign(Args&&... args) {
+	static_assert(std::is_convertible<T*, Component*>::value,
+		"components must inherit Component base class");
+	if constexpr (isSplit<T>)
+		manager->assign<T>(id, std::forward<Args>(args)...);
+	else
+		return manager->assign<T>(id, std::forward<Args>(args)...);
+}
+
+template<class T>
+void Entity::remove(void) {
+	static_assert(std::is_convertible<T*, Component*>::value,
+		"components must inherit Component base class");
+	manager->remove<T>(id);
+}
+
+template<class T>
+bool Entity::hasComponent(void) const {
+	static_assert(std::is_convertible<T*, Component*>::value,
+		"components must inherit Component base class");
+	return manager->hasComponent<T>(id);
+}
+
+template<class T>
+T* Entity::component(void) {
+	static_assert(std::is_convertible<T*, Component*>::value,
+		"components must inherit Component base class");
+	return manager->component<T>(id);
+}
+
+template<class T>
+bool Entity::get(T& out) const {
+	static_assert(std::is_convertible<T*, Component*>::value,
+		"components must inherit Component base class");
+	return manager->get<T>(id, out);
+}
+
+inline bool Entity::valid(void) const {
+	return manager->valid(id);
+}
+
+template<class T, typename... Args>
+void CommandBuffer::record(Id id, bool pending, Args&&... args) {
+	static_assert(std::is_convertible<T*, Component*>::value,
+		"components must inherit Component base class");
+	static_assert(std::is_move_constructible<T>::value,
+		"components assigned through a CommandBuffer must be movable");
+	auto p = new (allocate(sizeof(T), alignof(T)))
+		T(std::forward<Args>(args)...);
+	ProfileCounters::change();
+	commands.push_back({id, pending, false,
+		[](EntityManager& em, Id id, void *payload) {
+			auto c = static_cast<T*>(payload);
+			Entity(em, id).assign<T>(std::move(*c));
+			c->~T();
+		},
+		p,
+		[](void *payload) {
+			static_cast<T*>(payload)->~T();
+		}});
+}
+
+inline void CommandBuffer::kill(const Entity& e) {
+	ProfileCounters::change();
+	commands.push_back({e.id, false, true,
+		[](EntityManager& em, Id id, void *) {
+			em.kill(Entity(em, id));
+		},
+		nullptr, nullptr});
+}
+
+template<class T, typename... Args>
+void CommandBuffer::assign(const Entity& e, Args&&... args) {
+	record<T>(e.id, false, std::forward<Args>(args)...);
+}
+
+template<class T, typename... Args>
+void CommandBuffer::assign(Pending e, Args&&... args) {
+	record<T>(static_cast<Id>(e.index), true, std::forward<Args>(args)...);
+}
+
+template<class T>
+void CommandBuffer::remove(const Entity& e) {
+	static_assert(std::is_convertible<T*, Component*>::value,
+		"components must inherit Component base class");
+	ProfileCounters::change();
+	commands.push_back({e.id, false, false,
+		[](EntityManager& em, Id id, void *) {
+			Entity(em, id).remove<T>();
+		},
+		nullptr, nullptr});
+}
+
+inline void CommandBuffer::playback(EntityManager& em) {
+	created.clear();
+	em.createMany(created, creates);
+	for (auto& c : commands) {
+		if (c.pending) {
+			c.id = created[c.id].id;
+			c.pending = false;
+		}
+	}
+
+	std::stable_sort(commands.begin(), commands.end(),
+		[](const Command& a, const Command& b) {
+			if (a.kill != b.kill)
+				return b.kill;
+			return idIndex(a.id) < idIndex(b.id);
+		});
+
+	std::size_t i = 0;
+	try {
+		for (; i < commands.size(); i++)
+			commands[i].apply(em, commands[i].id, commands[i].payload);
+	} catch (...) {
+		for (; i < commands.size(); i++) {
+			if (commands[i].discard != nullptr)
+				commands[i].discard(commands[i].payload);
+		}
+		reset();
+		throw;
+	}
+	reset();
+}
+
+/**
+ * @class XmlElement
+ * An XML element as read by XmlParser: its name, attributes and text.
+ */
+class XmlElement {
+private:
+	std::string tag;
+	/** Attributes are kept past attrCount so their strings can be reused. */
+	std::vector<std::pair<std::string, std::string>> attrs;
+	std::size_t attrCount = 0;
+	std::string body;
+
+	friend class XmlParser;
+	friend class XmlLoader;
+
+public:
+	const std::string& name(void) const {
+		return tag;
+	}
+
+	/** Gets the text the element directly contains. */
+	const std::string& text(void) const {
+		return body;
+	}
+
+	/** Finds an attribute's value, nullptr if the element lacks it. */
+	const std::string *attribute(std::string_view key) const {
+		for (std::size_t i = 0; i < attrCount; i++) {
+			if (attrs[i].first == key)
+				return &attrs[i].second;
+		}
+		return nullptr;
+	}
+
 	/**
-	 * Constructs the class using the given XML element(s).
+	 * Reads an attribute into value as a number, bool ("true" or "1") or
+	 * string, leaving value alone if the attribute is missing or invalid.
+	 * @return true if value was read
 	 */
-	virtual void fromXML(/*TODO*/) {}
-};
+	template<typename T>
+	bool get(std::string_view key, T& value) const {
+		auto a = attribute(key);
+		if (a == nullptr)
+			return false;
 
-/** An ID number for entities. */
-using Id = unsigned int;
+		if constexpr (std::is_same<T, std::string>::value) {
+			value = *a;
+		} else if constexpr (std::is_same<T, bool>::value) {
+			value = *a == "true" || *a == "1";
+		} else {
+			auto r = std::from_chars(a->data(), a->data() + a->size(), value);
+			return r.ec == std::errc();
+		}
+		return true;
+	}
+};
 
 /**
- * @struct EntityData
- * Contains all components and an ID, to form an entity.
+ * @class XmlParser
+ * A streaming (SAX style) XML parser. Input is read through a fixed buffer
+ * and elements are handed to the handler as they are read, so memory use
+ * does not grow with the document. The handler is called as:
+ *     h.startElement(const XmlElement& e); // name and attributes
+ *     h.text(std::string_view text);       // may come in several pieces
+ *     h.endElement(const std::string& name);
+ * Handles comments, CDATA, the predefined and numeric character
+ * references, and skips declarations, processing instructions and DOCTYPE
+ * (without an internal subset). Errors throw std::runtime_error.
  */
-struct EntityData {
-	/** The entity's ID. */
-	Id id;
+class XmlParser {
+private:
+	static constexpr std::size_t BufferSize = 64 * 1024;
 
-	/** A vector of all components. */
-	std::forward_list<size_t> componentHash;
-	std::forward_list<Component*> components;
+	std::istream& in;
+	std::unique_ptr<char[]> buffer;
+	std::size_t pos;
+	std::size_t end;
+	std::size_t line;
+	std::size_t bytes;
 
-	/** Constructs an entity with the given ID. */
-	EntityData(Id _id = -1)
-		: id (_id) {}
+	XmlElement element;
+	std::vector<std::string> open;
+	std::string text;
+	std::string scratch;
 
-	/** Compares two entities through their IDs. */
-	bool operator==(const EntityData& e) {
-		return id == e.id;
+	[[noreturn]] void fail(const char *what) const {
+		throw std::runtime_error("XML error on line " + std::to_string(line)
+			+ ": " + what);
 	}
-};
 
-/**
- * @struct Entity
- * Allows access to an entity and it's components.
- * Note that this is not the actual entity's data, that is stored in the
- * EntityManager's EntityData array.
- */
-struct Entity {
-	std::vector<EntityData>::iterator pos;
+	/** Gets the next character, -1 at the end of the input. */
+	int get(void) {
+		if (pos == end) {
+			in.read(buffer.get(), BufferSize);
+			end = static_cast<std::size_t>(in.gcount());
+			pos = 0;
+			bytes += end;
+			if (end == 0)
+				return -1;
+		}
 
-	/** Constructs an entity object to handle the given entity data. */
-	Entity(std::vector<EntityData>::iterator p)
-		:  pos(p) {}
-	Entity(EntityData& d)
-		: pos(&d) {}
+		char c = buffer[pos++];
+		if (c == '\n')
+			line++;
+		return static_cast<unsigned char>(c);
+	}
 
-	/**
-	 * Assigns a component to the entity.
-	 * @param args arguments to pass to the component's constructor.
-	 * @return a pointer to the new component
-	 */
-	template<class T, typename... Args>
-	T* assign(Args... args) {
-		static_assert(std::is_convertible<T*, Component*>::value,
-			"components must inherit Component base class");
-		auto comp = new T(args...);
-		(*pos).components.push_front(comp);
-		(*pos).componentHash.emplace_front(typeid(T).hash_code());
-		return comp;
+	int require(void) {
+		int c = get();
+		if (c < 0)
+			fail("unexpected end of input");
+		return c;
 	}
 
-	/**
-	 * Removes a component of the given type from the entity.
-	 */
-	template<class T>
-	void remove(void) {
-		static_assert(std::is_convertible<T*, Component*>::value,
-			"components must inherit Component base class");
-		auto it = (*pos).componentHash.begin();
-		auto ic = (*pos).components.before_begin();
-		for (; it != (*pos).componentHash.end(); ic++, it++) {
-			if (*it == typeid(T).hash_code()) {
-				(*pos).components.erase_after(ic);
+	static bool isSpace(int c) {
+		return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+	}
+
+	static bool isNameChar(int c) {
+		return c > ' ' && c != '<' && c != '>' && c != '/' && c != '='
+			&& c != '"' && c != '\'' && c != '?' && c != '!' && c != '&';
+	}
+
+	int skipSpace(int c) {
+		while (isSpace(c))
+			c = require();
+		return c;
+	}
+
+	/** Reads a name starting with c, returning the character after it. */
+	int readName(int c, std::string& out) {
+		out.clear();
+		if (!isNameChar(c))
+			fail("expected a name");
+		while (isNameChar(c)) {
+			out.push_back(static_cast<char>(c));
+			c = require();
+		}
+		return c;
+	}
+
+	/** Skips input until the given terminator has been read. */
+	void skipPast(std::string_view term) {
+		std::size_t matched = 0;
+		while (matched < term.size()) {
+			char c = static_cast<char>(require());
+			if (c == term[matched])
+				matched++;
+			else
+				matched = c == term[0] ? 1 : 0;
+		}
+	}
+
+	/** Appends a UTF-8 encoded code point. */
+	static void appendUtf8(std::string& out, unsigned long cp) {
+		if (cp < 0x80) {
+			out.push_back(static_cast<char>(cp));
+		} else if (cp < 0x800) {
+			out.push_back(static_cast<char>(0xC0 | (cp >> 6)));
+			out.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+		} else if (cp < 0x10000) {
+			out.push_back(static_cast<char>(0xE0 | (cp >> 12)));
+			out.push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3F)));
+			out.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+		} else {
+			out.push_back(static_cast<char>(0xF0 | (cp >> 18)));
+			out.push_back(static_cast<char>(0x80 | ((cp >> 12) & 0x3F)));
+			out.push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3F)));
+			out.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+		}
+	}
+
+	/** Reads a reference after its '&', appending what it stands for. */
+	void readReference(std::string& out) {
+		scratch.clear();
+		for (int c = require(); c != ';'; c = require()) {
+			if (scratch.size() > 8)
+				fail("bad character reference");
+			scratch.push_back(static_cast<char>(c));
+		}
+
+		if (scratch == "lt") {
+			out.push_back('<');
+		} else if (scratch == "gt") {
+			out.push_back('>');
+		} else if (scratch == "amp") {
+			out.push_back('&');
+		} else if (scratch == "quot") {
+			out.push_back('"');
+		} else if (scratch == "apos") {
+			out.push_back('\'');
+		} else if (scratch.size() > 1 && scratch[0] == '#') {
+			bool hex = scratch[1] == 'x';
+			auto first = scratch.data() + (hex ? 2 : 1);
+			unsigned long cp = 0;
+			auto r = std::from_chars(first, scratch.data() + scratch.size(), cp,
+				hex ? 16 : 10);
+			if (r.ec != std::errc() || r.ptr != scratch.data() + scratch.size()
+				|| cp > 0x10FFFF)
+				fail("bad character reference");
+			appendUtf8(out, cp);
+		} else {
+			fail("unknown entity");
+		}
+	}
+
+	/** Reads a start tag after its '<', given the first character of its name. */
+	template<class Handler>
+	void readStartTag(int c, Handler& h) {
+		c = readName(c, element.tag);
+		element.attrCount = 0;
+
+		while (true) {
+			c = skipSpace(c);
+			if (c == '>' || c == '/')
 				break;
+
+			if (element.attrCount == element.attrs.size())
+				element.attrs.emplace_back();
+			auto& attr = element.attrs[element.attrCount++];
+			c = skipSpace(readName(c, attr.first));
+			if (c != '=')
+				fail("expected '=' after attribute name");
+
+			int quote = skipSpace(require());
+			if (quote != '"' && quote != '\'')
+				fail("expected a quoted attribute value");
+			attr.second.clear();
+			for (c = require(); c != quote; c = require()) {
+				if (c == '&')
+					readReference(attr.second);
+				else if (c == '<')
+					fail("'<' in attribute value");
+				else
+					attr.second.push_back(static_cast<char>(c));
+			}
+			c = require();
+		}
+
+		h.startElement(element);
+		if (c == '/') {
+			if (require() != '>')
+				fail("expected '>' after '/'");
+			h.endElement(element.tag);
+		} else {
+			open.push_back(element.tag);
+		}
+	}
+
+	template<class Handler>
+	void readEndTag(Handler& h) {
+		int c = skipSpace(readName(require(), scratch));
+		if (c != '>')
+			fail("expected '>' in end tag");
+		if (open.empty() || open.back() != scratch)
+			fail("mismatched end tag");
+
+		h.endElement(scratch);
+		open.pop_back();
+	}
+
+	/** Hands any text read so far to the handler. */
+	template<class Handler>
+	void flushText(Handler& h) {
+		if (!text.empty()) {
+			if (open.empty()) {
+				for (auto c : text) {
+					if (!isSpace(static_cast<unsigned char>(c)))
+						fail("text outside the root element");
+				}
+			} else {
+				h.text(text);
+			}
+			text.clear();
+		}
+	}
+
+public:
+	XmlParser(std::istream& input)
+		: in(input), buffer(new char[BufferSize]), pos(0), end(0), line(1),
+		  bytes(0) {}
+
+	/** Parses the whole input, calling the handler along the way. */
+	template<class Handler>
+	void parse(Handler& h) {
+		bool root = false;
+		for (int c = get(); c >= 0; c = get()) {
+			if (c == '&') {
+				readReference(text);
+				continue;
+			} else if (c != '<') {
+				text.push_back(static_cast<char>(c));
+				continue;
+			}
+
+			c = require();
+			if (c == '!') {
+				c = require();
+				if (c == '-') {
+					if (require() != '-')
+						fail("bad comment");
+					skipPast("-->");
+				} else if (c == '[') {
+					skipPast("CDATA[");
+					auto start = text.size();
+					do {
+						text.push_back(static_cast<char>(require()));
+					} while (text.size() < start + 3
+						|| text.compare(text.size() - 3, 3, "]]>") != 0);
+					text.resize(text.size() - 3);
+				} else {
+					skipPast(">");
+				}
+				continue;
+			} else if (c == '?') {
+				skipPast("?>");
+				continue;
+			}
+
+			flushText(h);
+			if (c == '/') {
+				readEndTag(h);
+			} else {
+				if (open.empty() && root)
+					fail("more than one root element");
+				root = true;
+				readStartTag(c, h);
 			}
 		}
-		(*pos).componentHash.remove(typeid(T).hash_code());
+
+		flushText(h);
+		if (!open.empty())
+			fail("unclosed element");
+		if (!root)
+			fail("no root element");
+	}
+
+	/** Gets the number of bytes read so far. */
+	std::size_t bytesRead(void) const {
+		return bytes;
+	}
+};
+
+/**
+ * @class XmlLoader
+ * Loads entities from XML, streaming so that documents of millions of
+ * entities need no more memory than their largest entity. Each element
+ * named "entity" (at any depth) becomes an entity, and each of its child
+ * elements a component, matched by element name to the types added with
+ * add(). For example:
+ *     <level>
+ *       <entity>
+ *         <Position x="1" y="2"/>
+ *         <Name>Bob</Name>
+ *       </entity>
+ *     </level>
+ * Each component is default constructed straight into storage, then read
+ * by calling its fromXML() with its element. Elements nested inside a
+ * component are ignored; its text is given with the element.
+ * Entities are created one at a time, as each closes, through
+ * EntityManager::createWith(): each lands straight in its final archetype
+ * or pools, but unlike createMany() storage is not reserved for a batch,
+ * as a stream does not say how many entities of each kind are coming and
+ * buffering them would give up constant memory.
+ */
+class XmlLoader {
+private:
+	struct Type {
+		const ComponentInfo *info;
+		void (*construct)(void *p, const XmlElement& e);
+	};
+
+	EntityManager& manager;
+	std::unordered_map<std::string, Type> types;
+	std::string entityTag;
+
+	/** The components of the entity being read; kept to reuse their strings. */
+	std::vector<XmlElement> parts;
+	std::vector<const ComponentInfo*> partInfos;
+	std::vector<void (*)(void*, const XmlElement&)> partConstructs;
+	std::size_t partCount;
+	/** The part of the component element open at depth 2, for its text. */
+	std::size_t current;
+
+	/** How deep the parser is within the current entity, or 0 if none. */
+	std::size_t depth;
+	std::size_t loaded;
+
+	void createEntity(void) {
+		manager.createWith(partInfos.data(), partCount,
+			[this](std::size_t i, void *p) { partConstructs[i](p, parts[i]); });
+		loaded++;
 	}
 
+public:
+	XmlLoader(EntityManager& em, std::string entityElement = "entity")
+		: manager(em), entityTag(std::move(entityElement)), partCount(0),
+		  current(0), depth(0), loaded(0) {}
+
 	/**
-	 * Tests if the entity has a component of the given type.
-	 * @return true if the entity has the component
+	 * Adds a component type, to be made from elements of the given name.
+	 * T must be default constructible.
 	 */
 	template<class T>
-	bool hasComponent(void) const {
+	void add(const std::string& element) {
 		static_assert(std::is_convertible<T*, Component*>::value,
 			"components must inherit Component base class");
-		return std::binary_search((*pos).componentHash.begin(), (*pos).componentHash.end(), typeid(T).hash_code());
+		types[element] = Type {&ComponentInfo::of<T>(),
+			[](void *p, const XmlElement& e) {
+				auto c = new (p) T();
+				c->fromXML(e);
+			}};
 	}
 
 	/**
-	 * Fetches a component from the entity.
-	 * @return the component, nullptr if the entity does not have it
+	 * Loads every entity from the stream.
+	 * @return the number of entities created
 	 */
-	template<class T>
-	T* component(void) {
-		static_assert(std::is_convertible<T*, Component*>::value,
-			"components must inherit Component base class");
-		auto it = (*pos).componentHash.begin();
-		auto ic = (*pos).components.begin();
-		for (; it != (*pos).componentHash.end(); ic++, it++) {
-			if (*it == typeid(T).hash_code())
-				return dynamic_cast<T*>(*ic);
+	std::size_t load(std::istream& in) {
+		XmlParser parser (in);
+		loaded = 0;
+		depth = 0;
+		parser.parse(*this);
+		return loaded;
+	}
+
+	/** Called by XmlParser. */
+	void startElement(const XmlElement& e) {
+		if (depth == 0) {
+			if (e.tag == entityTag) {
+				depth = 1;
+				partCount = 0;
+			}
+			return;
 		}
-		return nullptr;
+
+		if (depth++ != 1)
+			return;
+
+		auto it = types.find(e.tag);
+		if (it == types.end())
+			throw std::runtime_error("no component type for element <" + e.tag + ">");
+
+		// A repeated component replaces the earlier one
+		auto i = std::find(partInfos.begin(), partInfos.begin() + partCount,
+			it->second.info) - partInfos.begin();
+		if (static_cast<std::size_t>(i) == partCount) {
+			if (partCount == parts.size()) {
+				parts.emplace_back();
+				partInfos.push_back(nullptr);
+				partConstructs.push_back(nullptr);
+			}
+			partCount++;
+		}
+
+		auto& part = parts[i];
+		part.tag = e.tag;
+		part.attrCount = e.attrCount;
+		if (part.attrs.size() < e.attrCount)
+			part.attrs.resize(e.attrCount);
+		for (std::size_t j = 0; j < e.attrCount; j++)
+			part.attrs[j] = e.attrs[j];
+		part.body.clear();
+		partInfos[i] = it->second.info;
+		partConstructs[i] = it->second.construct;
+		current = i;
+	}
+
+	/** Called by XmlParser. */
+	void text(std::string_view t) {
+		if (depth == 2)
+			parts[current].body.append(t);
+	}
+
+	/** Called by XmlParser. */
+	void endElement(const std::string&) {
+		if (depth == 0)
+			return;
+		if (--depth == 0)
+			createEntity();
 	}
 };
 
+
+
+using DeltaTime = int;
+
 /**
- * @class EntityManager
- * Manages a group of entities.
+ * @struct Access
+ * The component types a system reads and writes, which decide the systems
+ * it may run alongside.
  */
-class EntityManager {
-private:
-	/** The array of all entities. */
-	std::vector<EntityData> entities;
+struct Access {
+	Signature reads;
+	Signature writes;
+	/** Set for systems that have not declared their access. */
+	bool exclusive = true;
 
-public:
-	// max is not enforced
-	EntityManager()
-		/*: entities()*/ {}
-
-	~EntityManager(void) {
-		entities.clear();
+	/** Tests if two systems must not run at the same time. */
+	bool conflicts(const Access& a) const {
+		return exclusive || a.exclusive
+			|| writes.intersects(a.reads) || writes.intersects(a.writes)
+			|| a.writes.intersects(reads);
 	}
+};
+
+class System {
+private:
+	Access componentAccess;
+	/** The ticks at which the system's previous and current runs began. */
+	Tick previousRun = 0;
+	Tick currentRun = 0;
+	/** The system's place in the order systems were added. */
+	std::size_t position = 0;
 
 	/**
-	 * Creates a new entity.
-	 * @return an Entity object for the new entity
+	 * Set by EachSystem: the components its kernel needs, and the access
+	 * the kernel alone makes.
 	 */
-	Entity create(void) {
-		static Id newId = 0;
+	bool hasKernel = false;
+	Signature kernelMask;
+	Access kernelAccess;
 
-		entities.emplace_back(newId);
-		return Entity(entities.begin() + entities.size() - 1);
-	}
+	friend class SystemManager;
+	template<class Derived, class... Ts>
+	friend class EachSystem;
 
 	/**
-	 * Kills (removes) an entity.
-	 * @param e the entity to remove
+	 * Runs the system's kernel over one archetype chunk, marking written
+	 * columns with the given tick. Only EachSystem has a kernel.
 	 */
-	void kill(const Entity& e) {
-		if (e.pos > entities.begin() && e.pos < entities.end())
-			entities.erase(e.pos);
-	}
+	virtual void runChunk(EntityManager&, const Archetype&,
+		const Archetype::Chunk&, Tick, DeltaTime) {}
 
 	/**
-	 * Destroys all entities.
+	 * Tests if the system can share a fused pass: it must have a kernel,
+	 * and have declared no access beyond the kernel's, since anything else
+	 * it touches may belong to entities the pass has not reached yet.
 	 */
-	void reset(void) {
-		entities.clear();
+	bool fusible(void) const {
+		return hasKernel && !componentAccess.exclusive
+			&& componentAccess.reads == kernelAccess.reads
+			&& componentAccess.writes == kernelAccess.writes;
+	}
+
+protected:
+	/** Declares component types the system reads. */
+	template<class... Ts>
+	void reads(void) {
+		(componentAccess.reads.set(componentId<Ts>()), ...);
+		componentAccess.exclusive = false;
+	}
+
+	/** Declares component types the system writes. */
+	template<class... Ts>
+	void writes(void) {
+		(componentAccess.writes.set(componentId<Ts>()), ...);
+		componentAccess.exclusive = false;
 	}
 
 	/**
-	 * Runs a function through all entities.
-	 * @param f the function to run through
+	 * Gets the tick at which the system's previous update began, zero
+	 * before the first. Filtering on it visits what changed since then,
+	 * including the system's own changes:
+	 *     em.each<Position>(Filter::changed<Velocity>(lastRun()), f);
 	 */
-	void each(std::function<void(Entity e)> f) {
-		for (auto i = entities.begin(); i < entities.end(); ++i)
-			f(Entity(i));
+	Tick lastRun(void) const {
+		return previousRun;
 	}
 
+public:
+	virtual ~System(void) {}
+
+	virtual void update(EntityManager& em, DeltaTime dt) = 0;
+
 	/**
-	 * Runs a function through all entities with the given components.
-	 * @param f the function to run through
+	 * Gets the components the system declared it uses. Systems that
+	 * declared nothing are assumed to use everything.
 	 */
-	template<class T1>
-	void each(std::function<void(Entity e)> f) {
-		for (auto i = entities.begin(); i < entities.end(); ++i) {
-			Entity en (i);
-			if (en.hasComponent<T1>())
-				f(en);
-		}
+	const Access& access(void) const {
+		return componentAccess;
+	}
+};
+
+/**
+ * @class EachSystem
+ * A system that runs the same code, its kernel, on every entity with the
+ * components Ts. Derived defines the kernel as
+ *     void process(Ts&... components, DeltaTime dt);
+ * Components given as const are read and the rest written, and that access
+ * is declared for it. The kernel may only touch the components it is
+ * handed, so SystemManager can fuse EachSystems into one pass over storage;
+ * see SystemManager::addStage().
+ */
+template<class Derived, class... Ts>
+class EachSystem : public System {
+private:
+	void runChunk(EntityManager& em, const Archetype& arch,
+		const Archetype::Chunk& c, Tick now, DeltaTime dt) final
+	{
+		const int cols[] = {arch.column(componentId<Ts>())..., -1};
+		auto kernel = [this, dt](Ts&... components) {
+			static_cast<Derived*>(this)->process(components..., dt);
+		};
+		em.eachInChunk<Ts...>(kernel, arch, c, cols, now,
+			std::index_sequence_for<Ts...>());
 	}
 
-	template<class T1, class T2>
-	void each(std::function<void(Entity e)> f) {
-		for (auto i = entities.begin(); i < entities.end(); ++i) {
-			Entity en (i);
-			if (en.hasComponent<T1>() && en.hasComponent<T2>())
-				f(en);
+	template<class T>
+	void declare(void) {
+		if constexpr (std::is_const<T>::value) {
+			reads<T>();
+			kernelAccess.reads.set(componentId<T>());
+		} else {
+			writes<T>();
+			kernelAccess.writes.set(componentId<T>());
 		}
 	}
-};
 
+protected:
+	EachSystem(void) {
+		static_assert((std::is_convertible<Ts*, const Component*>::value && ...),
+			"components must inherit Component base class");
+		(declare<Ts>(), ...);
+		kernelAccess.exclusive = false;
+		kernelMask = Signature::of<Ts...>();
+		hasKernel = true;
+	}
 
+public:
+	/**
+	 * Runs the kernel through every matching entity on its own. Final, as
+	 * fused stages run only the kernel; put the work in process().
+	 */
+	void update(EntityManager& em, DeltaTime dt) final {
+		em.each<Ts...>([this, dt](Ts&... components) {
+			static_cast<Derived*>(this)->process(components..., dt);
+		});
+	}
+};
 
-using DeltaTime = int;
+/**
+ * @struct SystemProfile
+ * Timings and counts of one system's updates, from SystemManager::profile().
+ * Times are in microseconds, over the latest Window updates.
+ */
+struct SystemProfile {
+	static constexpr std::size_t Window = 256;
 
-class System {
-public:
-	virtual void update(EntityManager& em, DeltaTime dt) = 0;
+	std::string name;
+	std::uint64_t updates = 0;
+	/** The counts of the latest update. */
+	ProfileCounters last;
+	/** The counts summed over every update. */
+	ProfileCounters total;
+	double lastTime = 0;
+	double minTime = 0;
+	double avgTime = 0;
+	double p99Time = 0;
 };
 
 class SystemManager {
 private:
-	std::map<size_t, System*> systems;
+	using Clock = std::chrono::steady_clock;
+
+	/** One update of one system, as recorded for the trace. */
+	struct TraceEvent {
+		std::size_t system;
+		std::size_t thread;
+		double start;
+		double duration;
+		ProfileCounters counts;
+	};
+
+	/** The times of a system's latest updates, and its running counts. */
+	struct Timings {
+		SystemProfile profile;
+		std::vector<double> times;
+		std::size_t next = 0;
+	};
+
+	/** Every system, indexed by system type index. */
+	std::vector<std::unique_ptr<System>> systems;
+	/** Every system, in the order added. */
+	std::vector<System*> order;
+	/** The systems that must wait for each system, rebuilt when empty. */
+	std::vector<std::vector<std::size_t>> successors;
+	/**
+	 * Every stage from addStage(), as groups of systems run in one pass
+	 * each; a group of one is updated on its own.
+	 */
+	std::vector<std::vector<std::vector<System*>>> stages;
+	/** The systems of a fused group matching the current archetype. */
+	std::vector<std::size_t> matching;
+	/** The most systems fused into one pass. */
+	static constexpr std::size_t MaxFused = 64;
 	EntityManager& entities;
 
+	/** Profiling state, indexed like order; only kept with ENTITIES_PROFILE. */
+	std::vector<Timings> timings;
+	std::vector<TraceEvent> trace;
+	std::size_t traceLimit = 1 << 20;
+	std::mutex traceLock;
+	Clock::time_point epoch = Clock::now();
+
+	/**
+	 * Gets a readable name for a system type, or without RTTI one made
+	 * from its type index.
+	 */
+	template<class T>
+	static std::string systemName(void) {
+#if defined(ENTITIES_PROFILE) && (defined(__GXX_RTTI) || defined(_CPPRTTI))
+		std::string name = typeid(T).name();
+#if __has_include(<cxxabi.h>)
+		int status = 0;
+		if (char *readable = abi::__cxa_demangle(name.c_str(), nullptr, nullptr, &status)) {
+			name = readable;
+			std::free(readable);
+		}
+#endif
+		return name;
+#else
+		return "system " + std::to_string(TypeIndex<System>::of<T>());
+#endif
+	}
+
+	void run(System& s, DeltaTime dt, std::size_t thread = 0) {
+		s.previousRun = s.currentRun;
+		s.currentRun = entities.advanceTick();
+		if constexpr (ProfileCounters::Enabled)
+			profiledRun(s, dt, thread);
+		else
+			s.update(entities, dt);
+	}
+
+	/** Updates a system with its counters current, then records the update. */
+	void profiledRun(System& s, DeltaTime dt, std::size_t thread) {
+		ProfileCounters counts;
+		auto& current = ProfileCounters::current();
+		auto outer = current;
+		current = &counts;
+		auto start = Clock::now();
+		try {
+			s.update(entities, dt);
+		} catch (...) {
+			current = outer;
+			throw;
+		}
+		auto end = Clock::now();
+		current = outer;
+		record(s, start, end - start, counts, thread);
+	}
+
+	/** Adds one update of a system to its timings and the trace. */
+	void record(System& s, Clock::time_point start, Clock::duration time,
+		const ProfileCounters& counts, std::size_t thread)
+	{
+		using Micros = std::chrono::duration<double, std::micro>;
+		auto duration = Micros(time).count();
+		auto& t = timings[s.position];
+		auto& p = t.profile;
+		p.updates++;
+		p.last = counts;
+		p.total.visited += counts.visited;
+		p.total.matched += counts.matched;
+		p.total.structural += counts.structural;
+		p.lastTime = duration;
+		if (t.times.size() < SystemProfile::Window)
+			t.times.push_back(duration);
+		else
+			t.times[t.next] = duration;
+		t.next = (t.next + 1) % SystemProfile::Window;
+
+		std::lock_guard<std::mutex> lock (traceLock);
+		if (trace.size() < traceLimit) {
+			trace.push_back({s.position, thread,
+				Micros(start - epoch).count(), duration, counts});
+		}
+	}
+
+	/**
+	 * Runs a group of fusible systems in one pass over archetype storage:
+	 * each chunk has every matching system's kernel run over it in turn
+	 * while it is in cache. As kernels only touch their own entity's
+	 * components, each entity sees the systems in order just as if they
+	 * were updated one after another. Written columns are marked with the
+	 * tick each system would have used on its own.
+	 */
+	void runFused(const std::vector<System*>& group, DeltaTime dt) {
+		for (auto s : group) {
+			s->previousRun = s->currentRun;
+			s->currentRun = entities.advanceTick();
+		}
+
+		[[maybe_unused]] ProfileCounters counts[MaxFused];
+		[[maybe_unused]] Clock::duration times[MaxFused] = {};
+		[[maybe_unused]] auto start = Clock::now();
+		auto& archetypes = entities.archetypes;
+		for (std::size_t a = 0; a < archetypes.size(); a++) {
+			auto arch = archetypes[a].get();
+			if (arch->size() == 0)
+				continue;
+
+			matching.clear();
+			for (std::size_t i = 0; i < group.size(); i++) {
+				if (arch->signature().includes(group[i]->kernelMask))
+					matching.push_back(i);
+			}
+
+			auto& chunks = arch->chunkList();
+			for (std::size_t c = 0; c < chunks.size(); c++) {
+				for (auto i : matching) {
+					auto s = group[i];
+					if constexpr (ProfileCounters::Enabled) {
+						auto& current = ProfileCounters::current();
+						auto outer = current;
+						current = &counts[i];
+						auto begin = Clock::now();
+						s->runChunk(entities, *arch, chunks[c], s->currentRun + 1, dt);
+						times[i] += Clock::now() - begin;
+						current = outer;
+						counts[i].visited += chunks[c].count;
+						counts[i].matched += chunks[c].count;
+					} else {
+						s->runChunk(entities, *arch, chunks[c], s->currentRun + 1, dt);
+					}
+				}
+			}
+		}
+
+		// The pass is recorded as each system's share of it, end to end
+		if constexpr (ProfileCounters::Enabled) {
+			for (std::size_t i = 0; i < group.size(); i++) {
+				record(*group[i], start, times[i], counts[i], 0);
+				start += times[i];
+			}
+		}
+	}
+
+	/**
+	 * Orders every pair of conflicting systems by when they were added,
+	 * leaving the rest free to run in parallel.
+	 */
+	void buildGraph(void) {
+		successors.assign(order.size(), {});
+		for (std::size_t i = 0; i < order.size(); i++) {
+			for (std::size_t j = i + 1; j < order.size(); j++) {
+				if (order[i]->access().conflicts(order[j]->access()))
+					successors[i].push_back(j);
+			}
+		}
+	}
+
 public:
 	SystemManager(EntityManager& em)
 		: entities(em) {}
 
+	/**
+	 * Adds a system. Systems should declare the components they read and
+	 * write from their constructor, so updateAll() can run them in parallel.
+	 */
 	template<class T, typename... Args>
 	void add(Args... args) {
 		static_assert(std::is_convertible<T*, System*>::value,
 			"systems must inherit System base class");
-		systems.try_emplace(typeid(T).hash_code(), new T(args...));
+		auto index = TypeIndex<System>::of<T>();
+		if (index >= systems.size())
+			systems.resize(index + 1);
+		if (!systems[index]) {
+			systems[index].reset(new T(args...));
+			systems[index]->position = order.size();
+			order.push_back(systems[index].get());
+			successors.clear();
+			if constexpr (ProfileCounters::Enabled) {
+				timings.emplace_back();
+				timings.back().profile.name = systemName<T>();
+			}
+		}
 	}
 
 	template<class T>
 	void update(DeltaTime dt) {
 		static_assert(std::is_convertible<T*, System*>::value,
 			"systems must inherit System base class");
-		systems.at(typeid(T).hash_code())->update(entities, dt);
+		auto index = TypeIndex<System>::of<T>();
+		if (index >= systems.size() || !systems[index])
+			throw std::out_of_range("system has not been added");
+		run(*systems[index], dt);
+		entities.flush();
+	}
+
+	/**
+	 * Updates every system, running systems whose component access does
+	 * not conflict in parallel on the EntityManager's thread pool.
+	 * Conflicting systems run in the order they were added. Changes the
+	 * systems recorded in EntityManager::commands() are made once all have
+	 * run.
+	 */
+	void updateAll(DeltaTime dt) {
+		if (successors.size() != order.size())
+			buildGraph();
+
+		auto& pool = entities.threadPool();
+		pool.runGraph(successors, [this, dt, &pool](std::size_t i) {
+			run(*order[i], dt, pool.threadIndex());
+		});
+		entities.flush();
+	}
+
+	/**
+	 * Adds a stage of systems to update together with updateStage(), adding
+	 * the systems themselves if need be. Runs of systems that can be fused
+	 * (EachSystems that declared no other access) are updated in a single
+	 * pass over storage, so each chunk is brought into cache once for all
+	 * of them; other systems are updated on their own, in the order given.
+	 * Only archetype storage is fused; with sparse set storage every system
+	 * is updated on its own.
+	 * @return the stage's index
+	 */
+	template<class... Ts>
+	std::size_t addStage(void) {
+		(add<Ts>(), ...);
+		System *list[] = {systems[TypeIndex<System>::of<Ts>()].get()...};
+
+		std::vector<std::vector<System*>> groups;
+		for (auto s : list) {
+			bool fuse = s->fusible() && !groups.empty()
+				&& groups.back().front()->fusible() && groups.back().size() < MaxFused;
+			if (fuse)
+				groups.back().push_back(s);
+			else
+				groups.push_back({s});
+		}
+		stages.push_back(std::move(groups));
+		return stages.size() - 1;
+	}
+
+	/**
+	 * Updates every system of a stage from addStage(). Changes the systems
+	 * recorded in EntityManager::commands() are made once all have run.
+	 */
+	void updateStage(std::size_t stage, DeltaTime dt) {
+		for (auto& group : stages.at(stage)) {
+			if (group.size() > 1 && entities.storage == Storage::Archetype) {
+				runFused(group, dt);
+			} else {
+				for (auto s : group)
+					run(*s, dt);
+			}
+		}
+		entities.flush();
+	}
+
+	/**
+	 * Gets the timings and counts of every system, in the order added.
+	 * They are only gathered when ENTITIES_PROFILE is defined; otherwise
+	 * the result is empty.
+	 */
+	std::vector<SystemProfile> profile(void) const {
+		std::vector<SystemProfile> profiles;
+		for (auto& t : timings) {
+			auto p = t.profile;
+			if (!t.times.empty()) {
+				auto times = t.times;
+				std::sort(times.begin(), times.end());
+				p.minTime = times.front();
+				p.avgTime = std::accumulate(times.begin(), times.end(), 0.0)
+					/ times.size();
+				p.p99Time = times[(times.size() - 1) * 99 / 100];
+			}
+			profiles.push_back(std::move(p));
+		}
+		return profiles;
+	}
+
+	/**
+	 * Sets how many updates are kept for writeTrace(); later ones are
+	 * dropped until clearProfile().
+	 */
+	void setTraceLimit(std::size_t limit) {
+		traceLimit = limit;
+	}
+
+	/** Forgets every recorded timing and count. */
+	void clearProfile(void) {
+		for (auto& t : timings) {
+			auto name = std::move(t.profile.name);
+			t = Timings();
+			t.profile.name = std::move(name);
+		}
+		trace.clear();
+		epoch = Clock::now();
+	}
+
+	/**
+	 * Writes the recorded updates as Chrome trace-event JSON, which
+	 * chrome://tracing and Perfetto can open. Each update is a complete
+	 * event on the thread that ran it, with its counts as arguments.
+	 */
+	void writeTrace(std::ostream& out) const {
+		auto writeString = [&out](const std::string& str) {
+			out << '"';
+			for (char c : str) {
+				if (c == '"' || c == '\\')
+					out << '\\' << c;
+				else if (static_cast<unsigned char>(c) >= 0x20)
+					out << c;
+			}
+			out << '"';
+		};
+
+		out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [";
+		for (std::size_t i = 0; i < trace.size(); i++) {
+			auto& e = trace[i];
+			out << (i == 0 ? "\n" : ",\n") << "{\"name\": ";
+			writeString(timings[e.system].profile.name);
+			out << ", \"cat\": \"system\", \"ph\": \"X\", \"pid\": 0"
+				<< ", \"tid\": " << e.thread
+				<< ", \"ts\": " << e.start
+				<< ", \"dur\": " << e.duration
+				<< ", \"args\": {\"visited\": " << e.counts.visited
+				<< ", \"matched\": " << e.counts.matched
+				<< ", \"structural\": " << e.counts.structural << "}}";
+		}
+		out << "\n]}\n";
 	}
 };
 
@@ -78,7 +78,6 @@ class EntityXBenchmark {
         }
     };
 
-    #ifdef USE_MORECOMPLEX_SYSTEM
     class MoreComplexSystem : public System<MoreComplexSystem> {
         private:
         int random(int min, int max){
@@ -101,15 +100,18 @@ class EntityXBenchmark {
             Component<DirectionComponent> direction;
             Component<ComflabulationComponent> comflab;
 
-            for (auto entity : es.entities_with_components(comflab, direction, comflab)) {
+            for (auto entity : es.entities_with_components(position, direction, comflab)) {
+                (void)entity;
                 if(comflab) {
                     std::vector<double> vec;
-                    for(size_t i = 0;i < comflab->dingy && i < 100;i++){
+                    for(int i = 0;i < comflab->dingy && i < 100;i++){
                         vec.push_back(i * comflab->thingy);
                     }
 
-                    int sum = std::accumulate(std::begin(vec), std::end(vec), 0.0);
-                    int product = std::accumulate(std::begin(vec), std::end(vec), 1, std::multiplies<double>());
+                    double sum = std::accumulate(std::begin(vec), std::end(vec), 0.0);
+                    double product = std::accumulate(std::begin(vec), std::end(vec), 1.0, std::multiplies<double>());
+                    (void)sum;
+                    (void)product;
 
                     comflab->stringy = std::to_string(comflab->dingy);
 
@@ -126,7 +128,6 @@ class EntityXBenchmark {
             }
         }
     };
-    #endif
 
     class Application : public entityx::EntityX {
         public:
@@ -149,6 +150,23 @@ class EntityXBenchmark {
         }
     };
 
+    class ComplexApplication : public entityx::EntityX {
+        public:
+        ComplexApplication() {
+            this->systems.add<MovementSystem>();
+            this->systems.add<ComflabSystem>();
+            this->systems.add<MoreComplexSystem>();
+
+            this->systems.configure();
+        }
+
+        void update(TimeDelta dt) {
+            this->systems.update<MovementSystem>(dt);
+            this->systems.update<ComflabSystem>(dt);
+            this->systems.update<MoreComplexSystem>(dt);
+        }
+    };
+
     static constexpr double fakeDeltaTime = 1.0 / 60;
 };
 
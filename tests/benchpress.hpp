@@ -32,6 +32,7 @@
 #include <sstream>     // stringstream
 #include <string>      // string
 #include <thread>      // thread
+#include <utility>     // pair
 #include <vector>      // vector
 
 namespace benchpress {
@@ -47,17 +48,20 @@ namespace benchpress {
  * opts
  *     .bench(".*")
  *     .benchtime(1)
- *     .cpu(4);
+ *     .cpu(4)
+ *     .format("json");
  */
 class options {
     std::string d_bench;
     size_t      d_benchtime;
     size_t      d_cpu;
+    std::string d_format;
 public:
     options()
         : d_bench(".*")
         , d_benchtime(1)
         , d_cpu(std::thread::hardware_concurrency())
+        , d_format("text")
     {}
     options& bench(const std::string& bench) {
         d_bench = bench;
@@ -80,6 +84,13 @@ public:
     size_t get_cpu() const {
         return d_cpu;
     }
+    options& format(const std::string& format) {
+        d_format = format;
+        return *this;
+    }
+    std::string get_format() const {
+        return d_format;
+    }
 };
 
 class context;
@@ -196,17 +207,28 @@ void clobber() {
  * The result class is responsible for producing a printable string representation of a benchmark run.
  */
 class result {
+public:
+    using metrics = std::vector<std::pair<std::string, double>>;
+
+private:
     size_t                   d_num_iterations;
     std::chrono::nanoseconds d_duration;
     size_t                   d_num_bytes;
+    metrics                  d_metrics;
 
 public:
-    result(size_t num_iterations, std::chrono::nanoseconds duration, size_t num_bytes)
+    result(size_t num_iterations, std::chrono::nanoseconds duration, size_t num_bytes,
+           const metrics& extra = metrics())
         : d_num_iterations(num_iterations)
         , d_duration(duration)
         , d_num_bytes(num_bytes)
+        , d_metrics(extra)
     {}
 
+    size_t get_num_iterations() const {
+        return d_num_iterations;
+    }
+
     size_t get_ns_per_op() const {
         if (d_num_iterations <= 0) {
             return 0;
@@ -219,7 +241,7 @@ public:
             return 0;
         }
         return ((double(d_num_bytes) * double(d_num_iterations) / double(1e6)) /
-                double(std::chrono::duration_cast<std::chrono::seconds>(d_duration).count()));
+                std::chrono::duration<double>(d_duration).count());
     }
 
     std::string to_string() const {
@@ -231,6 +253,48 @@ public:
         if (mbs > 0.0) {
             tmp << std::setw(12) << std::right << mbs << std::setw(0) << " MB/s";
         }
+        for (auto& m : d_metrics) {
+            tmp << std::setw(12) << std::right << m.second << std::setw(0) << ' ' << m.first;
+        }
+        return std::string(tmp.str());
+    }
+
+    std::string to_csv(const std::string& name) const {
+        std::stringstream tmp;
+        tmp << '"';
+        for (char c : name) {
+            tmp << c;
+            if (c == '"') {
+                tmp << c;
+            }
+        }
+        tmp << "\"," << d_num_iterations << ',' << get_ns_per_op() << ',' << get_mb_per_s() << ',';
+        for (size_t i = 0; i < d_metrics.size(); ++i) {
+            tmp << (i ? ";" : "") << d_metrics[i].first << '=' << d_metrics[i].second;
+        }
+        return std::string(tmp.str());
+    }
+
+    std::string to_json(const std::string& name) const {
+        std::stringstream tmp;
+        tmp << "{\"name\": \"";
+        for (char c : name) {
+            if (c == '"' || c == '\\') {
+                tmp << '\\';
+            }
+            tmp << c;
+        }
+        tmp << "\", \"iterations\": " << d_num_iterations
+            << ", \"ns_per_op\": " << get_ns_per_op()
+            << ", \"mb_per_s\": " << get_mb_per_s();
+        if (!d_metrics.empty()) {
+            tmp << ", \"metrics\": {";
+            for (size_t i = 0; i < d_metrics.size(); ++i) {
+                tmp << (i ? ", \"" : "\"") << d_metrics[i].first << "\": " << d_metrics[i].second;
+            }
+            tmp << '}';
+        }
+        tmp << '}';
         return std::string(tmp.str());
     }
 };
@@ -261,6 +325,7 @@ class context {
     size_t                                         d_num_iterations;
     size_t                                         d_num_threads;
     size_t                                         d_num_bytes;
+    result::metrics                                d_metrics;
     benchmark_info                                 d_benchmark;
 
 public:
@@ -301,6 +366,17 @@ public:
 
     void set_bytes(int64_t bytes) { d_num_bytes = bytes; }
 
+    // Reports a figure of the benchmark other than its speed, such as the memory it used.
+    void set_metric(const std::string& name, double value) {
+        for (auto& m : d_metrics) {
+            if (m.first == name) {
+                m.second = value;
+                return;
+            }
+        }
+        d_metrics.emplace_back(name, value);
+    }
+
     size_t get_ns_per_op() {
         if (d_num_iterations <= 0) {
             return 0;
@@ -343,7 +419,7 @@ public:
             n = round_up(n);
             run_n(n);
         }
-        return result(n, d_duration, d_num_bytes);
+        return result(n, d_duration, d_num_bytes, d_metrics);
     }
 
 private:
@@ -376,17 +452,37 @@ private:
 
 /*
  * The run_benchmarks function will run the registered benchmarks.
+ *
+ * Results are printed as a table by default; the "csv" and "json" formats print one record per benchmark for
+ * scripts to compare runs with.
  */
 void run_benchmarks(const options& opts) {
     std::regex match_r(opts.get_bench());
     auto benchmarks = registration::get_ptr()->get_benchmarks();
+    const std::string format = opts.get_format();
+    bool first = true;
+    if (format == "csv") {
+        std::cout << "name,iterations,ns_per_op,mb_per_s,metrics" << std::endl;
+    } else if (format == "json") {
+        std::cout << "[";
+    }
     for (auto& info : benchmarks) {
         if (std::regex_match(info.get_name(), match_r)) {
             context c(info, opts);
             auto r = c.run();
-            std::cout << std::setw(35) << std::left << info.get_name() << r.to_string() << std::endl;
+            if (format == "csv") {
+                std::cout << r.to_csv(info.get_name()) << std::endl;
+            } else if (format == "json") {
+                std::cout << (first ? "\n  " : ",\n  ") << r.to_json(info.get_name()) << std::flush;
+            } else {
+                std::cout << std::setw(35) << std::left << info.get_name() << r.to_string() << std::endl;
+            }
+            first = false;
         }
     }
+    if (format == "json") {
+        std::cout << "\n]" << std::endl;
+    }
 }
 
 } // namespace benchpress
@@ -410,6 +506,8 @@ int main(int argc, char** argv) {
                 ->default_value("1"))
             ("cpu", "specify the number of threads to use for parallel benchmarks", cxxopts::value<size_t>()
                 ->default_value(std::to_string(std::thread::hardware_concurrency())))
+            ("format", "print results as text, csv or json", cxxopts::value<std::string>()
+                ->default_value("text"))
             ("list", "list all available benchmarks")
             ("help", "print help")
         ;
@@ -427,6 +525,14 @@ int main(int argc, char** argv) {
         if (cmd_opts.count("cpu")) {
             bench_opts.cpu(cmd_opts["cpu"].as<size_t>());
         }
+        if (cmd_opts.count("format")) {
+            auto format = cmd_opts["format"].as<std::string>();
+            if (format != "text" && format != "csv" && format != "json") {
+                std::cout << "unknown format: " << format << std::endl;
+                exit(1);
+            }
+            bench_opts.format(format);
+        }
         if (cmd_opts.count("list")) {
             auto benchmarks = benchpress::registration::get_ptr()->get_benchmarks();
             for (auto& info : benchmarks) {
@@ -442,7 +548,11 @@ int main(int argc, char** argv) {
     float duration = std::chrono::duration_cast<std::chrono::milliseconds>(
             std::chrono::high_resolution_clock::now() - bp_start
     ).count() / 1000.f;
-    std::cout << argv[0] << " " << duration << "s" << std::endl;
+    if (bench_opts.get_format() == "text") {
+        std::cout << argv[0] << " " << duration << "s" << std::endl;
+    } else {
+        std::cerr << argv[0] << " " << duration << "s" << std::endl;
+    }
     return 0;
 }
 #endif
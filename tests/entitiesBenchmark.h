@@ -16,11 +16,21 @@ class EntitiesBenchmark {
     struct PositionComponent : public Component {
         float x = 0.0f;
         float y = 0.0f;
+
+        void fromXML(const XmlElement& e) {
+            e.get("x", x);
+            e.get("y", y);
+        }
     };
 
     struct VelocityComponent : public Component {
         float x = 0.0f;
         float y = 0.0f;
+
+        void fromXML(const XmlElement& e) {
+            e.get("x", x);
+            e.get("y", y);
+        }
     };
 
     struct ComflabulationComponent : public Component {
@@ -28,17 +38,105 @@ class EntitiesBenchmark {
         int dingy = 0;
         bool mingy = false;
         std::string stringy;
+
+        void fromXML(const XmlElement& e) {
+            e.get("thingy", thingy);
+            e.get("dingy", dingy);
+            e.get("mingy", mingy);
+            stringy = e.text();
+        }
+    };
+
+    /*
+     * The same components split into one array per field, so that a
+     * system can run through their columns with vector instructions.
+     */
+    struct SplitPositionComponent : public Component {
+        float x = 0.0f;
+        float y = 0.0f;
+        ENTITIES_FIELDS(&SplitPositionComponent::x, &SplitPositionComponent::y)
+    };
+
+    struct SplitVelocityComponent : public Component {
+        float x = 0.0f;
+        float y = 0.0f;
+        ENTITIES_FIELDS(&SplitVelocityComponent::x, &SplitVelocityComponent::y)
+    };
+
+    /*
+     * A transform relative to the parent, and the world transform worked
+     * out from it, for propagating down a hierarchy.
+     */
+    struct TransformComponent : public Component {
+        float localX = 0.0f;
+        float localY = 0.0f;
+        float worldX = 0.0f;
+        float worldY = 0.0f;
+    };
+
+    /*
+     * A parent handle kept in a component, to compare the built-in
+     * hierarchy with walking up parents one lookup at a time.
+     */
+    struct ParentComponent : public Component {
+        Entity parent;
+
+        ParentComponent(Entity parent) : parent(parent) {}
     };
 
-    class MovementSystem : public System {
+    class MovementSystem
+        : public EachSystem<MovementSystem, PositionComponent, const VelocityComponent> {
         public:
-        MovementSystem() = default;
+        void process(PositionComponent& pos, const VelocityComponent& vel, DeltaTime dt) {
+            pos.x = vel.x * dt;
+            pos.y = vel.y * dt;
+        }
+    };
+
+    class SplitMovementSystem : public System {
+        public:
+        SplitMovementSystem() {
+            reads<SplitVelocityComponent>();
+            writes<SplitPositionComponent>();
+        }
 
         void update(EntityManager &es, DeltaTime dt) {
-			es.each<PositionComponent, VelocityComponent>(
-				[dt](Entity e) {
-					auto& pos = *e.component<PositionComponent>();
-					auto& vel = *e.component<VelocityComponent>();
+            es.eachChunk<SplitPositionComponent, const SplitVelocityComponent>(
+                [dt](Column<SplitPositionComponent> pos, Column<const SplitVelocityComponent> vel) {
+                    auto px = pos.field<&SplitPositionComponent::x>();
+                    auto py = pos.field<&SplitPositionComponent::y>();
+                    auto vx = vel.field<&SplitVelocityComponent::x>();
+                    auto vy = vel.field<&SplitVelocityComponent::y>();
+                    for (size_t i = 0; i < pos.size(); i++) {
+                        px[i] = vx[i] * dt;
+                        py[i] = vy[i] * dt;
+                    }
+                }
+            );
+        }
+    };
+
+    class ComflabSystem
+        : public EachSystem<ComflabSystem, ComflabulationComponent> {
+        public:
+        void process(ComflabulationComponent& comflab, DeltaTime) {
+            comflab.thingy *= 1.000001f;
+            comflab.mingy = !comflab.mingy;
+            comflab.dingy++;
+            //comflab.stringy = std::to_string(comflab.dingy);
+        }
+    };
+
+    class ParallelMovementSystem : public System {
+        public:
+        ParallelMovementSystem() {
+            reads<VelocityComponent>();
+            writes<PositionComponent>();
+        }
+
+        void update(EntityManager &es, DeltaTime dt) {
+			es.parallelEach<PositionComponent, const VelocityComponent>(
+				[dt](PositionComponent& pos, const VelocityComponent& vel) {
 					pos.x = vel.x * dt;
 					pos.y = vel.y * dt;
 				}
@@ -46,24 +144,23 @@ class EntitiesBenchmark {
         }
     };
 
-    class ComflabSystem : public System {
+    class ParallelComflabSystem : public System {
         public:
-        ComflabSystem() = default;
+        ParallelComflabSystem() {
+            writes<ComflabulationComponent>();
+        }
 
-        void update(EntityManager &es, DeltaTime dt) {
-   			es.each<ComflabulationComponent>(
-				[dt](Entity e) {
-					auto comflab = e.component<ComflabulationComponent>();
-	                comflab->thingy *= 1.000001f;
-	                comflab->mingy = !comflab->mingy;
-	                comflab->dingy++;
-	                //comflab.stringy = std::to_string(comflab.dingy);
-	            }
+        void update(EntityManager &es, DeltaTime) {
+			es.parallelEach<ComflabulationComponent>(
+				[](ComflabulationComponent& comflab) {
+					comflab.thingy *= 1.000001f;
+					comflab.mingy = !comflab.mingy;
+					comflab.dingy++;
+				}
 			);
         }
     };
 
-    #ifdef USE_MORECOMPLEX_SYSTEM
     class MoreComplexSystem : public System {
         private:
         int random(int min, int max){
@@ -79,45 +176,47 @@ class EntitiesBenchmark {
         }
 
         public:
-        MoreComplexSystem() = default;
+        MoreComplexSystem() {
+            writes<PositionComponent>();
+            writes<VelocityComponent>();
+            writes<ComflabulationComponent>();
+        }
 
         void update(EntityManager &es, DeltaTime dt) {
-			es.each<PositionComponent, DirectionComponent, ComflabulationComponent>(
-				[dt](Entity e) {
-					auto comflab = e.component<ComflabulationComponent>();
-					if(comflab) {
-						std::vector<double> vec;
-						for(size_t i = 0; i < comflab->dingy && i < 100; i++)
-							vec.push_back(i * comflab0>thingy);
-						int sum = std::accumulate(vec.begin(), vec.end(), 0);
-						int product = std::accumulate(vec.begin(), vec.end(),
-							1, std::multiplies<double>());
-						comflab->stringy = std::to_string(comflab->dingy);
-						
-						auto pos = e.component<PositionComponent>();
-						auto vel = e.component<VelocityComponent>();
-						if (pos && vel && comflab->dingy % 10000 == 0) {
-							if (pos->x > pos->y) {
-								vel->x = random(0, 5);
-								vel->y = random(0, 10);
-							} else {
-								vel->x = random(0, 10);
-								vel->y = random(0, 5);
-							}
+			(void)dt;
+			es.each<PositionComponent, VelocityComponent, ComflabulationComponent>(
+				[this](PositionComponent& pos, VelocityComponent& vel, ComflabulationComponent& comflab) {
+					std::vector<double> vec;
+					for(int i = 0; i < comflab.dingy && i < 100; i++)
+						vec.push_back(i * comflab.thingy);
+					double sum = std::accumulate(vec.begin(), vec.end(), 0.0);
+					double product = std::accumulate(vec.begin(), vec.end(),
+						1.0, std::multiplies<double>());
+					(void)sum;
+					(void)product;
+					comflab.stringy = std::to_string(comflab.dingy);
+
+					if (comflab.dingy % 10000 == 0) {
+						if (pos.x > pos.y) {
+							vel.x = random(0, 5);
+							vel.y = random(0, 10);
+						} else {
+							vel.x = random(0, 10);
+							vel.y = random(0, 5);
 						}
 					}
 				}
 			);
         }
     };
-    #endif
 
     class Application {
         public:
 		EntityManager em;
 		SystemManager sm;
 
-        Application() : sm(em) {
+        Application(Storage storage = Storage::Archetype)
+            : em(storage), sm(em) {
             sm.add<MovementSystem>();
             sm.add<ComflabSystem>();
             #ifdef USE_MORECOMPLEX_SYSTEM
@@ -134,6 +233,58 @@ class EntitiesBenchmark {
         }
     };
 
+    class FusedApplication {
+        public:
+		EntityManager em;
+		SystemManager sm;
+        std::size_t stage;
+
+        FusedApplication(Storage storage = Storage::Archetype)
+            : em(storage), sm(em) {
+            stage = sm.addStage<MovementSystem, ComflabSystem>();
+        }
+
+        void update(DeltaTime dt) {
+            sm.updateStage(stage, dt);
+        }
+    };
+
+    class ComplexApplication {
+        public:
+		EntityManager em;
+		SystemManager sm;
+
+        ComplexApplication(Storage storage = Storage::Archetype)
+            : em(storage), sm(em) {
+            sm.add<MovementSystem>();
+            sm.add<ComflabSystem>();
+            sm.add<MoreComplexSystem>();
+        }
+
+        void update(DeltaTime dt) {
+            sm.update<MovementSystem>(dt);
+            sm.update<ComflabSystem>(dt);
+            sm.update<MoreComplexSystem>(dt);
+        }
+    };
+
+    class ParallelApplication {
+        public:
+		EntityManager em;
+		SystemManager sm;
+
+        ParallelApplication(size_t threads)
+            : sm(em) {
+            em.setWorkerCount(threads - 1);
+            sm.add<ParallelMovementSystem>();
+            sm.add<ParallelComflabSystem>();
+        }
+
+        void update(DeltaTime dt) {
+            sm.updateAll(dt);
+        }
+    };
+
     static constexpr double fakeDeltaTime = 1.0 / 60;
 };
 
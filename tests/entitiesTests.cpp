@@ -2,6 +2,7 @@
 #include <vector>
 #include <thread>
 #include <memory>
+#include <sstream>
 
 #define BENCHPRESS_CONFIG_MAIN
 #include "benchpress.hpp"
@@ -9,6 +10,7 @@
 #include "../entities.hpp"
 
 #include "entitiesBenchmark.h"
+#include "scenarioBenchmark.h"
 
 inline void init_entities(EntityManager& entities, size_t nentities){
     for (size_t i = 0; i < nentities; i++) {
@@ -23,8 +25,8 @@ inline void init_entities(EntityManager& entities, size_t nentities){
 	}
 }
 
-inline void runEntitiesSystemsEntitiesBenchmark(benchpress::context* ctx, size_t nentities) {
-    EntitiesBenchmark::Application app;
+inline void runEntitiesSystemsEntitiesBenchmark(benchpress::context* ctx, size_t nentities, Storage storage) {
+    EntitiesBenchmark::Application app (storage);
     auto& entities = app.em;
 
     init_entities(entities, nentities);
@@ -35,11 +37,39 @@ inline void runEntitiesSystemsEntitiesBenchmark(benchpress::context* ctx, size_t
     }
 }
 
+inline void runMemoryUsageBenchmark(benchpress::context* ctx, size_t nentities, Storage storage) {
+    EntityManager entities (storage);
+    init_entities(entities, nentities);
+
+    MemoryUsage usage;
+    ctx->reset_timer();
+    for (size_t i = 0; i < ctx->num_iterations(); ++i) {
+        entities.memoryUsage(usage);
+    }
+    ctx->stop_timer();
 
+    ctx->set_metric("bytes/entity", usage.bytesPerEntity());
+    ctx->set_metric("overhead/entity", usage.overheadPerEntity());
+    ctx->set_metric("slack", usage.fragmentation());
+}
 
 
-BENCHMARK("entities create destroy entity with components", [](benchpress::context* ctx) {
-    EntityManager entities;
+
+
+inline void runParallelSystemsEntitiesBenchmark(benchpress::context* ctx, size_t nentities, size_t threads) {
+    EntitiesBenchmark::ParallelApplication app (threads);
+    auto& entities = app.em;
+
+    init_entities(entities, nentities);
+
+    ctx->reset_timer();
+    for (size_t i = 0; i < ctx->num_iterations(); ++i) {
+        app.update(EntitiesBenchmark::fakeDeltaTime);
+    }
+}
+
+inline void runCreateDestroyBenchmark(benchpress::context* ctx, Storage storage) {
+    EntityManager entities (storage);
 
     ctx->reset_timer();
     for (size_t i = 0; i < ctx->num_iterations(); ++i) {
@@ -51,9 +81,149 @@ BENCHMARK("entities create destroy entity with components", [](benchpress::conte
 
         entities.kill(entity);
     }
+}
+
+BENCHMARK("entities create destroy entity with components", [](benchpress::context* ctx) {
+    runCreateDestroyBenchmark(ctx, Storage::Archetype);
+})
+
+BENCHMARK("sparse   create destroy entity with components", [](benchpress::context* ctx) {
+    runCreateDestroyBenchmark(ctx, Storage::SparseSet);
+})
+
+inline void init_entities_bulk(EntityManager& entities, size_t nentities){
+    using Position = EntitiesBenchmark::PositionComponent;
+    using Velocity = EntitiesBenchmark::VelocityComponent;
+    using Comflab = EntitiesBenchmark::ComflabulationComponent;
+
+    entities.createMany(nentities / 2, Position(), Velocity());
+    entities.createMany(nentities - nentities / 2, Position(), Velocity(), Comflab());
+}
+
+inline void runCreateManyBenchmark(benchpress::context* ctx, size_t nentities, Storage storage, bool bulk) {
+    EntityManager entities (storage);
+
+    ctx->reset_timer();
+    for (size_t i = 0; i < ctx->num_iterations(); ++i) {
+        if (bulk)
+            init_entities_bulk(entities, nentities);
+        else
+            init_entities(entities, nentities);
+        entities.reset();
+    }
+}
+
+BENCHMARK("[100000]   entities create    100000 entities one at a time", [](benchpress::context* ctx) {
+    runCreateManyBenchmark(ctx, 100'000, Storage::Archetype, false);
+})
+
+BENCHMARK("[100000]   entities create    100000 entities with createMany", [](benchpress::context* ctx) {
+    runCreateManyBenchmark(ctx, 100'000, Storage::Archetype, true);
+})
+
+BENCHMARK("[100000]   sparse   create    100000 entities one at a time", [](benchpress::context* ctx) {
+    runCreateManyBenchmark(ctx, 100'000, Storage::SparseSet, false);
+})
+
+BENCHMARK("[100000]   sparse   create    100000 entities with createMany", [](benchpress::context* ctx) {
+    runCreateManyBenchmark(ctx, 100'000, Storage::SparseSet, true);
+})
+
+
+
+inline void runChangedFilterBenchmark(benchpress::context* ctx, size_t nentities, Storage storage, bool filtered) {
+    using Position = EntitiesBenchmark::PositionComponent;
+    using Velocity = EntitiesBenchmark::VelocityComponent;
+
+    EntityManager entities (storage);
+    std::vector<Entity> handles;
+    entities.createMany(handles, nentities, Position(), Velocity());
+
+    // Only one entity in a thousand starts moving each frame
+    size_t next = 0;
+    Tick since = entities.advanceTick();
+
+    ctx->reset_timer();
+    for (size_t i = 0; i < ctx->num_iterations(); ++i) {
+        for (size_t j = 0; j < nentities / 1000; j++) {
+            handles[next].component<Velocity>()->x = 1.0f;
+            next = (next + 7919) % nentities;
+        }
+
+        auto move = [](Position& pos, const Velocity& vel) {
+            pos.x += vel.x;
+            pos.y += vel.y;
+        };
+        if (filtered)
+            entities.each<Position, const Velocity>(Filter::changed<Velocity>(since), move);
+        else
+            entities.each<Position, const Velocity>(move);
+        since = entities.advanceTick();
+    }
+}
+
+BENCHMARK("[1000000]  entities update    1000000 entities, 0.1% changed, no filter", [](benchpress::context* ctx) {
+    runChangedFilterBenchmark(ctx, 1'000'000, Storage::Archetype, false);
+})
+
+BENCHMARK("[1000000]  entities update    1000000 entities, 0.1% changed, changed filter", [](benchpress::context* ctx) {
+    runChangedFilterBenchmark(ctx, 1'000'000, Storage::Archetype, true);
+})
+
+BENCHMARK("[1000000]  sparse   update    1000000 entities, 0.1% changed, no filter", [](benchpress::context* ctx) {
+    runChangedFilterBenchmark(ctx, 1'000'000, Storage::SparseSet, false);
+})
+
+BENCHMARK("[1000000]  sparse   update    1000000 entities, 0.1% changed, changed filter", [](benchpress::context* ctx) {
+    runChangedFilterBenchmark(ctx, 1'000'000, Storage::SparseSet, true);
 })
 
 
+inline void runXmlLoadBenchmark(benchpress::context* ctx, Storage storage) {
+    using Position = EntitiesBenchmark::PositionComponent;
+    using Velocity = EntitiesBenchmark::VelocityComponent;
+    using Comflab = EntitiesBenchmark::ComflabulationComponent;
+
+    std::string doc = "<?xml version=\"1.0\"?>\n<level>\n";
+    for (size_t i = 0; i < ctx->num_iterations(); ++i) {
+        // Every fourth entity repeats Comflab around another component,
+        // the later one replacing the earlier
+        doc += "  <entity>\n";
+        if (i % 4 == 0)
+            doc += "    <Comflab dingy=\"1\">replaced</Comflab>\n";
+        doc += "    <Position x=\"" + std::to_string(i) + "\" y=\"2.5\"/>\n";
+        if (i % 2 == 0)
+            doc += "    <Comflab thingy=\"0.5\" dingy=\"7\" mingy=\"true\">comflab</Comflab>\n";
+        doc += "    <Velocity x=\"1\" y=\"-1\"/>\n";
+        doc += "  </entity>\n";
+    }
+    doc += "</level>\n";
+    ctx->set_bytes(doc.size() / std::max<size_t>(ctx->num_iterations(), 1));
+
+    EntityManager entities (storage);
+    XmlLoader loader (entities);
+    loader.add<Position>("Position");
+    loader.add<Velocity>("Velocity");
+    loader.add<Comflab>("Comflab");
+    std::istringstream in (doc);
+
+    ctx->reset_timer();
+    loader.load(in);
+    ctx->stop_timer();
+
+    entities.each<const Comflab>([](const Comflab& c) {
+        if (c.stringy != "comflab" || c.dingy != 7)
+            throw std::runtime_error("XML component text went to the wrong component");
+    });
+}
+
+BENCHMARK("entities load entities from XML", [](benchpress::context* ctx) {
+    runXmlLoadBenchmark(ctx, Storage::Archetype);
+})
+
+BENCHMARK("sparse   load entities from XML", [](benchpress::context* ctx) {
+    runXmlLoadBenchmark(ctx, Storage::SparseSet);
+})
 
 
 
@@ -61,11 +231,11 @@ class BenchmarksEntities {
     public:
     static const std::vector<int> ENTITIES;
 
-    static inline void makeBenchmarks(std::string name) {
-        makeBenchmarks(name, ENTITIES);
+    static inline void makeBenchmarks(std::string name, Storage storage) {
+        makeBenchmarks(name, storage, ENTITIES);
     }
     
-    static void makeBenchmarks(std::string name, const std::vector<int>& entities) {
+    static void makeBenchmarks(std::string name, Storage storage, const std::vector<int>& entities) {
         for(int nentities : entities) {
             std::string tag = "[" + std::to_string(nentities) + "]";
 
@@ -76,14 +246,26 @@ class BenchmarksEntities {
             ss << " entities component systems update";
 
             std::string benchmark_name = ss.str();
-            BENCHMARK(benchmark_name, [nentities](benchpress::context* ctx) {
-                runEntitiesSystemsEntitiesBenchmark(ctx, nentities);
-            })
+            auto run = [nentities, storage](benchpress::context* ctx) {
+                runEntitiesSystemsEntitiesBenchmark(ctx, nentities, storage);
+            };
+            BENCHMARK(benchmark_name, run)
+
+            std::stringstream memory;
+            memory << std::right << std::setw(10) << tag << ' ';
+            memory << name << ' ';
+            memory << std::right << std::setw(8) << nentities;
+            memory << " entities memory usage";
+
+            auto measure = [nentities, storage](benchpress::context* ctx) {
+                runMemoryUsageBenchmark(ctx, nentities, storage);
+            };
+            BENCHMARK(memory.str(), measure)
         }
     }
 
-    BenchmarksEntities(std::string name){
-        makeBenchmarks(name);
+    BenchmarksEntities(std::string name, Storage storage){
+        makeBenchmarks(name, storage);
     }
 };
 const std::vector<int> BenchmarksEntities::ENTITIES = {
@@ -95,7 +277,680 @@ const std::vector<int> BenchmarksEntities::ENTITIES = {
     1'000'000, 2'000'000
 };
 
-BenchmarksEntities entitiesBenchmarks ("entities");
+BenchmarksEntities entitiesBenchmarks ("entities", Storage::Archetype);
+BenchmarksEntities sparseBenchmarks   ("sparse  ", Storage::SparseSet);
+
+
+
+class BenchmarksParallel {
+    public:
+    static const std::vector<int> ENTITIES;
+
+    /** Runs on 1, 2, 4... threads up to the hardware's count. */
+    static void makeBenchmarks(const std::vector<int>& entities) {
+        size_t maxThreads = std::max(std::thread::hardware_concurrency(), 1u);
+        for(int nentities : entities) {
+            for (size_t threads = 1; ; threads = std::min(threads * 2, maxThreads)) {
+                std::string tag = "[" + std::to_string(nentities) + "]";
+
+                std::stringstream ss;
+                ss << std::right << std::setw(10) << tag << ' ';
+                ss << "parallel " << std::left << std::setw(3) << threads << "threads ";
+                ss << std::right << std::setw(8) << nentities;
+                ss << " entities component systems update";
+
+                std::string benchmark_name = ss.str();
+                auto run = [nentities, threads](benchpress::context* ctx) {
+                    runParallelSystemsEntitiesBenchmark(ctx, nentities, threads);
+                };
+                BENCHMARK(benchmark_name, run)
+
+                if (threads == maxThreads)
+                    break;
+            }
+        }
+    }
+
+    BenchmarksParallel(){
+        makeBenchmarks(ENTITIES);
+    }
+};
+const std::vector<int> BenchmarksParallel::ENTITIES = {
+    10'000, 100'000, 1'000'000, 2'000'000
+};
+
+BenchmarksParallel parallelBenchmarks;
+
+template<class App>
+inline void runStageBenchmark(benchpress::context* ctx, size_t nentities) {
+    App app;
+    init_entities(app.em, nentities);
+
+    ctx->reset_timer();
+    for (size_t i = 0; i < ctx->num_iterations(); ++i) {
+        app.update(EntitiesBenchmark::fakeDeltaTime);
+    }
+}
+
+class BenchmarksFused {
+    public:
+    static const std::vector<int> ENTITIES;
+
+    static void makeBenchmarks(const std::vector<int>& entities) {
+        for (int nentities : entities) {
+            std::string tag = "[" + std::to_string(nentities) + "]";
+
+            std::stringstream separate;
+            separate << std::right << std::setw(10) << tag << ' ';
+            separate << "entities " << std::right << std::setw(8) << nentities;
+            separate << " entities systems in separate passes";
+            BENCHMARK(separate.str(), [nentities](benchpress::context* ctx) {
+                runStageBenchmark<EntitiesBenchmark::Application>(ctx, nentities);
+            })
+
+            std::stringstream fused;
+            fused << std::right << std::setw(10) << tag << ' ';
+            fused << "entities " << std::right << std::setw(8) << nentities;
+            fused << " entities systems in a fused stage";
+            BENCHMARK(fused.str(), [nentities](benchpress::context* ctx) {
+                runStageBenchmark<EntitiesBenchmark::FusedApplication>(ctx, nentities);
+            })
+        }
+    }
+
+    BenchmarksFused(){
+        makeBenchmarks(ENTITIES);
+    }
+};
+const std::vector<int> BenchmarksFused::ENTITIES = {
+    10'000, 100'000, 1'000'000
+};
+
+BenchmarksFused fusedBenchmarks;
+
+template<class Movement, class Position, class Velocity>
+inline void runMovementBenchmark(benchpress::context* ctx, size_t nentities) {
+    using Comflab = EntitiesBenchmark::ComflabulationComponent;
+    EntityManager entities;
+    SystemManager systems (entities);
+    systems.add<Movement>();
+
+    entities.createMany(nentities / 2, Position(), Velocity());
+    entities.createMany(nentities - nentities / 2, Position(), Velocity(), Comflab());
+
+    ctx->reset_timer();
+    for (size_t i = 0; i < ctx->num_iterations(); ++i) {
+        systems.update<Movement>(EntitiesBenchmark::fakeDeltaTime);
+    }
+}
+
+inline void runWholeMovementBenchmark(benchpress::context* ctx, size_t nentities) {
+    runMovementBenchmark<EntitiesBenchmark::MovementSystem,
+        EntitiesBenchmark::PositionComponent,
+        EntitiesBenchmark::VelocityComponent>(ctx, nentities);
+}
+
+inline void runSplitMovementBenchmark(benchpress::context* ctx, size_t nentities) {
+    runMovementBenchmark<EntitiesBenchmark::SplitMovementSystem,
+        EntitiesBenchmark::SplitPositionComponent,
+        EntitiesBenchmark::SplitVelocityComponent>(ctx, nentities);
+}
+
+class BenchmarksSplit {
+    public:
+    static const std::vector<int> ENTITIES;
+
+    static void makeBenchmarks(const std::vector<int>& entities) {
+        for (int nentities : entities) {
+            std::string tag = "[" + std::to_string(nentities) + "]";
+
+            std::stringstream whole;
+            whole << std::right << std::setw(10) << tag << ' ';
+            whole << "entities " << std::right << std::setw(8) << nentities;
+            whole << " entities movement over whole components";
+            BENCHMARK(whole.str(), [nentities](benchpress::context* ctx) {
+                runWholeMovementBenchmark(ctx, nentities);
+            })
+
+            std::stringstream split;
+            split << std::right << std::setw(10) << tag << ' ';
+            split << "entities " << std::right << std::setw(8) << nentities;
+            split << " entities movement over split columns";
+            BENCHMARK(split.str(), [nentities](benchpress::context* ctx) {
+                runSplitMovementBenchmark(ctx, nentities);
+            })
+        }
+    }
+
+    BenchmarksSplit(){
+        makeBenchmarks(ENTITIES);
+    }
+};
+const std::vector<int> BenchmarksSplit::ENTITIES = {
+    10'000, 100'000, 1'000'000
+};
+
+BenchmarksSplit splitBenchmarks;
+
+/*
+ * Builds a forest of nentities transforms, eight children to a parent, with
+ * the entities created in random order so that parents are scattered
+ * through storage.
+ */
+inline std::vector<Entity> init_transform_forest(EntityManager& entities, size_t nentities, bool hierarchy) {
+    using Transform = EntitiesBenchmark::TransformComponent;
+    using Parent = EntitiesBenchmark::ParentComponent;
+
+    std::vector<Entity> handles;
+    entities.createMany(handles, nentities, Transform());
+    std::shuffle(handles.begin(), handles.end(), std::mt19937(1337));
+    for (size_t i = 0; i < nentities; i++) {
+        auto t = handles[i].component<Transform>();
+        t->localX = static_cast<float>(i % 7);
+        t->localY = static_cast<float>(i % 11);
+        // A tree of a thousand entities each, rooted at every thousandth
+        if (i % 1000 == 0)
+            continue;
+        auto parent = handles[i / 1000 * 1000 + (i % 1000 - 1) / 8];
+        if (hierarchy)
+            entities.setParent(handles[i], parent);
+        else
+            handles[i].assign<Parent>(parent);
+    }
+    return handles;
+}
+
+inline void runHierarchyBenchmark(benchpress::context* ctx, size_t nentities, bool hierarchy) {
+    using Transform = EntitiesBenchmark::TransformComponent;
+    using Parent = EntitiesBenchmark::ParentComponent;
+
+    EntityManager entities;
+    init_transform_forest(entities, nentities, hierarchy);
+    if (hierarchy)
+        entities.sortByHierarchy();
+
+    ctx->reset_timer();
+    for (size_t i = 0; i < ctx->num_iterations(); ++i) {
+        if (hierarchy) {
+            entities.eachInHierarchy<Transform>(
+                [](Entity, Entity parent, Transform& t) {
+                    t.worldX = t.localX;
+                    t.worldY = t.localY;
+                    if (parent.valid()) {
+                        auto p = parent.component<Transform>();
+                        t.worldX += p->worldX;
+                        t.worldY += p->worldY;
+                    }
+                });
+        } else {
+            entities.each<Transform>([](Entity e, Transform& t) {
+                t.worldX = t.localX;
+                t.worldY = t.localY;
+                for (auto p = e.component<Parent>(); p; p = p->parent.component<Parent>()) {
+                    auto pt = p->parent.component<Transform>();
+                    t.worldX += pt->localX;
+                    t.worldY += pt->localY;
+                }
+            });
+        }
+    }
+}
+
+class BenchmarksHierarchy {
+    public:
+    static const std::vector<int> ENTITIES;
+
+    static void makeBenchmarks(const std::vector<int>& entities) {
+        for (int nentities : entities) {
+            for (bool hierarchy : {false, true}) {
+                std::string tag = "[" + std::to_string(nentities) + "]";
+
+                std::stringstream ss;
+                ss << std::right << std::setw(10) << tag << ' ';
+                ss << "entities " << std::right << std::setw(8) << nentities;
+                ss << " entities transform propagation, ";
+                ss << (hierarchy ? "sorted hierarchy" : "parent walking");
+
+                std::string benchmark_name = ss.str();
+                auto run = [nentities, hierarchy](benchpress::context* ctx) {
+                    runHierarchyBenchmark(ctx, nentities, hierarchy);
+                };
+                BENCHMARK(benchmark_name, run)
+            }
+        }
+    }
+
+    BenchmarksHierarchy(){
+        makeBenchmarks(ENTITIES);
+    }
+};
+const std::vector<int> BenchmarksHierarchy::ENTITIES = {
+    10'000, 100'000, 1'000'000
+};
+
+BenchmarksHierarchy hierarchyBenchmarks;
+
+enum class SpatialQuery { Update, Radius, Nearest, Scan };
+
+/*
+ * Spreads nentities moving entities over a square with about one to every
+ * hundred square units, and times a grid update after all of them moved or
+ * one neighbour query around a random point per op. Scan answers the radius
+ * query by running through every entity, as a grid-less system would.
+ */
+inline void runSpatialBenchmark(benchpress::context* ctx, size_t nentities, SpatialQuery query) {
+    using Position = EntitiesBenchmark::PositionComponent;
+    using Velocity = EntitiesBenchmark::VelocityComponent;
+
+    EntityManager entities;
+    float side = std::sqrt(static_cast<float>(nentities)) * 10.0f;
+    std::mt19937 gen(1337);
+    std::uniform_real_distribution<float> place(0.0f, side), speed(-1.0f, 1.0f);
+    for (size_t i = 0; i < nentities; i++) {
+        auto e = entities.create();
+        auto p = e.assign<Position>();
+        p->x = place(gen);
+        p->y = place(gen);
+        auto v = e.assign<Velocity>();
+        v->x = speed(gen);
+        v->y = speed(gen);
+    }
+    std::vector<std::pair<float, float>> points(4096);
+    for (auto& p : points)
+        p = {place(gen), place(gen)};
+
+    SpatialGrid<Position> grid(entities, 10.0f);
+    grid.update();
+    const float radius = 10.0f;
+    size_t found = 0;
+
+    ctx->reset_timer();
+    for (size_t i = 0; i < ctx->num_iterations(); ++i) {
+        auto [x, y] = points[i % points.size()];
+        switch (query) {
+        case SpatialQuery::Update:
+            ctx->stop_timer();
+            entities.each<Position, const Velocity>([](Position& p, const Velocity& v) {
+                p.x += v.x;
+                p.y += v.y;
+            });
+            ctx->start_timer();
+            grid.update();
+            break;
+        case SpatialQuery::Radius:
+            found += grid.inRadius(x, y, radius).size();
+            break;
+        case SpatialQuery::Nearest:
+            found += grid.nearest(x, y, 8).size();
+            break;
+        case SpatialQuery::Scan:
+            entities.each<const Position>([&](const Position& p) {
+                float dx = p.x - x, dy = p.y - y;
+                found += dx * dx + dy * dy <= radius * radius;
+            });
+            break;
+        }
+    }
+    benchpress::escape(&found);
+}
+
+class BenchmarksSpatial {
+    public:
+    static const std::vector<int> ENTITIES;
+
+    static void makeBenchmarks(const std::vector<int>& entities) {
+        const std::pair<SpatialQuery, const char*> queries[] = {
+            {SpatialQuery::Update, "grid update, all moved"},
+            {SpatialQuery::Radius, "grid radius query"},
+            {SpatialQuery::Nearest, "grid 8 nearest query"},
+            {SpatialQuery::Scan, "scanning radius query"},
+        };
+        for (int nentities : entities) {
+            for (auto [query, what] : queries) {
+                std::string tag = "[" + std::to_string(nentities) + "]";
+
+                std::stringstream ss;
+                ss << std::right << std::setw(10) << tag << ' ';
+                ss << "entities " << std::right << std::setw(8) << nentities;
+                ss << " entities spatial " << what;
+
+                std::string benchmark_name = ss.str();
+                auto run = [nentities, query = query](benchpress::context* ctx) {
+                    runSpatialBenchmark(ctx, nentities, query);
+                };
+                BENCHMARK(benchmark_name, run)
+            }
+        }
+    }
+
+    BenchmarksSpatial(){
+        makeBenchmarks(ENTITIES);
+    }
+};
+const std::vector<int> BenchmarksSpatial::ENTITIES = {
+    100'000, 1'000'000
+};
+
+BenchmarksSpatial spatialBenchmarks;
+
+enum class Compacted { Fresh, Churned, Compacted, Grouped };
+
+/*
+ * Runs movement over a world that is fresh, or that has replaced every
+ * entity twice over in random order, optionally compacted afterwards.
+ */
+inline void runCompactionBenchmark(benchpress::context* ctx, size_t nentities, Storage storage, Compacted state) {
+    using Position = EntitiesBenchmark::PositionComponent;
+    using Velocity = EntitiesBenchmark::VelocityComponent;
+    using Comflab = EntitiesBenchmark::ComflabulationComponent;
+
+    EntityManager entities (storage);
+    std::vector<Entity> handles;
+    auto make = [&](size_t i) {
+        auto e = entities.create();
+        e.assign<Position>();
+        if (i % 2 == 0)
+            e.assign<Comflab>();
+        e.assign<Velocity>();
+        return e;
+    };
+    for (size_t i = 0; i < nentities; i++)
+        handles.push_back(make(i));
+
+    if (state != Compacted::Fresh) {
+        std::mt19937 gen(1337);
+        for (size_t i = 0; i < 2 * nentities; i++) {
+            auto& e = handles[gen() % nentities];
+            entities.kill(e);
+            e = make(gen());
+        }
+    }
+    if (state == Compacted::Compacted || state == Compacted::Grouped) {
+        while (!entities.compact(std::chrono::milliseconds(1), state == Compacted::Grouped)) {}
+    }
+
+    ctx->reset_timer();
+    for (size_t i = 0; i < ctx->num_iterations(); ++i) {
+        entities.each<Position, const Velocity>([](Position& pos, const Velocity& vel) {
+            pos.x += vel.x;
+            pos.y += vel.y;
+        });
+    }
+}
+
+class BenchmarksCompaction {
+    public:
+    static const std::vector<int> ENTITIES;
+
+    static void makeBenchmarks(std::string name, Storage storage) {
+        const std::pair<Compacted, const char*> states[] = {
+            {Compacted::Fresh, "fresh"},
+            {Compacted::Churned, "churned"},
+            {Compacted::Compacted, "churned, compacted"},
+            {Compacted::Grouped, "churned, compacted and grouped"},
+        };
+        for (int nentities : ENTITIES) {
+            for (auto [state, what] : states) {
+                if (state == Compacted::Grouped && storage != Storage::SparseSet)
+                    continue;
+
+                std::string tag = "[" + std::to_string(nentities) + "]";
+
+                std::stringstream ss;
+                ss << std::left << std::setw(10) << tag << ' ';
+                ss << name << ' ' << std::right << std::setw(8) << nentities;
+                ss << " entities movement over " << what << " storage";
+
+                std::string benchmark_name = ss.str();
+                auto run = [nentities, storage, state = state](benchpress::context* ctx) {
+                    runCompactionBenchmark(ctx, nentities, storage, state);
+                };
+                BENCHMARK(benchmark_name, run)
+            }
+        }
+    }
+
+    BenchmarksCompaction(){
+        makeBenchmarks("entities", Storage::Archetype);
+        makeBenchmarks("sparse  ", Storage::SparseSet);
+    }
+};
+const std::vector<int> BenchmarksCompaction::ENTITIES = {
+    100'000, 1'000'000
+};
+
+BenchmarksCompaction compactionBenchmarks;
+
+
+inline SnapshotTypes snapshot_types() {
+    using Comflab = EntitiesBenchmark::ComflabulationComponent;
+
+    SnapshotTypes types;
+    types.add<EntitiesBenchmark::PositionComponent>("Position");
+    types.add<EntitiesBenchmark::VelocityComponent>("Velocity");
+    types.add<Comflab>("Comflab",
+        [](const Comflab& c, std::string& out) {
+            SnapshotTypes::pack(out, c.thingy);
+            SnapshotTypes::pack(out, c.dingy);
+            SnapshotTypes::pack(out, c.mingy);
+            SnapshotTypes::pack(out, c.stringy);
+        },
+        [](Comflab& c, std::string_view& in) {
+            SnapshotTypes::unpack(in, c.thingy);
+            SnapshotTypes::unpack(in, c.dingy);
+            SnapshotTypes::unpack(in, c.mingy);
+            SnapshotTypes::unpack(in, c.stringy);
+        });
+    return types;
+}
+
+inline void runSnapshotBenchmark(benchpress::context* ctx, size_t nentities, Storage storage, bool load) {
+    auto types = snapshot_types();
+    EntityManager entities (storage);
+    init_entities_bulk(entities, nentities);
+
+    std::ostringstream out;
+    entities.saveSnapshot(out, types);
+    std::string snapshot = out.str();
+    ctx->set_bytes(snapshot.size());
+
+    ctx->reset_timer();
+    for (size_t i = 0; i < ctx->num_iterations(); ++i) {
+        if (load) {
+            entities.loadSnapshot(snapshot.data(), snapshot.size(), types);
+        } else {
+            out.str(std::string());
+            entities.saveSnapshot(out, types);
+        }
+    }
+}
+
+class BenchmarksSnapshot {
+    public:
+    static const std::vector<int> ENTITIES;
+
+    static void makeBenchmarks(std::string name, Storage storage) {
+        for(int nentities : ENTITIES) {
+            for (bool load : {false, true}) {
+                std::string tag = "[" + std::to_string(nentities) + "]";
+
+                std::stringstream ss;
+                ss << std::left << std::setw(10) << tag << ' ';
+                ss << name << ' ' << (load ? "load    " : "save    ");
+                ss << std::right << std::setw(8) << nentities;
+                ss << " entities snapshot";
+
+                std::string benchmark_name = ss.str();
+                auto run = [nentities, storage, load](benchpress::context* ctx) {
+                    runSnapshotBenchmark(ctx, nentities, storage, load);
+                };
+                BENCHMARK(benchmark_name, run)
+            }
+        }
+    }
+
+    BenchmarksSnapshot(){
+        makeBenchmarks("entities", Storage::Archetype);
+        makeBenchmarks("sparse  ", Storage::SparseSet);
+    }
+};
+const std::vector<int> BenchmarksSnapshot::ENTITIES = {
+    100'000, 500'000, 1'000'000, 2'000'000
+};
+
+BenchmarksSnapshot snapshotBenchmarks;
+
+inline void runDeltaBenchmark(benchpress::context* ctx, size_t nentities, Storage storage, double churn, bool apply) {
+    using Position = EntitiesBenchmark::PositionComponent;
+    using Velocity = EntitiesBenchmark::VelocityComponent;
+    using Comflab = EntitiesBenchmark::ComflabulationComponent;
+
+    auto types = snapshot_types();
+    EntityManager entities (storage);
+    std::vector<Entity> handles;
+    entities.createMany(handles, nentities / 2, Position(), Velocity());
+    entities.createMany(handles, nentities - nentities / 2, Position(), Velocity(), Comflab());
+    for (size_t j = 1; j < nentities; j += 64)
+        entities.setParent(handles[j], handles[j - 1]);
+
+    std::ostringstream out;
+    Tick last = entities.saveSnapshot(out, types);
+    std::string delta = out.str();
+    EntityManager replica (storage);
+    replica.loadSnapshot(delta.data(), delta.size(), types);
+
+    // Each frame changes churn of the entities, and replaces a tenth as many
+    size_t changes = static_cast<size_t>(nentities * churn);
+    size_t next = 0;
+
+    ctx->reset_timer();
+    for (size_t i = 0; i < ctx->num_iterations(); ++i) {
+        ctx->stop_timer();
+        for (size_t j = 0; j < changes; j++) {
+            handles[next].component<Velocity>()->x += 1.0f;
+            if (j % 10 == 0) {
+                entities.kill(handles[next]);
+                handles[next] = entities.create();
+                handles[next].assign<Position>();
+                handles[next].assign<Velocity>();
+                entities.setParent(handles[next], handles[(next + 1) % nentities]);
+            }
+            next = (next + 7919) % nentities;
+        }
+
+        out.str(std::string());
+        if (!apply)
+            ctx->start_timer();
+        last = entities.saveDelta(out, types, last);
+        ctx->stop_timer();
+
+        if (apply) {
+            delta = out.str();
+            ctx->start_timer();
+            replica.applyDelta(delta.data(), delta.size(), types);
+            ctx->stop_timer();
+        }
+        ctx->set_bytes(out.tellp());
+    }
+
+    if (apply) {
+        for (auto& h : handles) {
+            if (replica.parentOf(Entity(replica, h.id)).id != entities.parentOf(h).id)
+                throw std::runtime_error("delta lost a parent/child relation");
+        }
+    }
+    ctx->start_timer();
+}
+
+class BenchmarksDelta {
+    public:
+    static const std::vector<double> CHURN;
+
+    static void makeBenchmarks(std::string name, Storage storage, size_t nentities) {
+        for (double churn : CHURN) {
+            for (bool apply : {false, true}) {
+                std::string tag = "[" + std::to_string(nentities) + "]";
+
+                std::stringstream ss;
+                ss << std::left << std::setw(10) << tag << ' ';
+                ss << name << ' ' << (apply ? "apply   " : "save    ");
+                ss << std::right << std::setw(8) << nentities;
+                ss << " entities delta, " << churn * 100 << "% churn";
+
+                std::string benchmark_name = ss.str();
+                auto run = [nentities, storage, churn, apply](benchpress::context* ctx) {
+                    runDeltaBenchmark(ctx, nentities, storage, churn, apply);
+                };
+                BENCHMARK(benchmark_name, run)
+            }
+        }
+    }
+
+    BenchmarksDelta(){
+        makeBenchmarks("entities", Storage::Archetype, 1'000'000);
+        makeBenchmarks("sparse  ", Storage::SparseSet, 1'000'000);
+    }
+};
+const std::vector<double> BenchmarksDelta::CHURN = {
+    0.0001, 0.001, 0.01
+};
+
+BenchmarksDelta deltaBenchmarks;
+
+template<Storage S>
+class EntitiesScenarioWorld {
+    EntityManager em;
+
+    public:
+    using Handle = Entity;
+
+    template<int N>
+    using C = ScenarioComponent<N, Component>;
+
+    EntitiesScenarioWorld(void)
+        : em(S) {}
+
+    Handle create(void) {
+        return em.create();
+    }
+
+    void kill(Handle e) {
+        em.kill(e);
+    }
+
+    template<class T>
+    void add(Handle e) {
+        e.assign<T>();
+    }
+
+    template<class T>
+    void remove(Handle e) {
+        e.remove<T>();
+    }
+
+    template<class T>
+    T* get(Handle e) {
+        return e.component<T>();
+    }
+
+    template<class... Ts, class F>
+    void each(F f) {
+        em.each<Ts...>(f);
+    }
+
+    static void runComplex(benchpress::context* ctx, size_t nentities) {
+        EntitiesBenchmark::ComplexApplication app (S);
+        init_entities(app.em, nentities);
+
+        ctx->reset_timer();
+        for (size_t i = 0; i < ctx->num_iterations(); ++i) {
+            app.update(EntitiesBenchmark::fakeDeltaTime);
+        }
+    }
+};
+
+ScenarioBenchmarks<EntitiesScenarioWorld<Storage::Archetype>> entitiesScenarios ("entities");
+ScenarioBenchmarks<EntitiesScenarioWorld<Storage::SparseSet>> sparseScenarios ("sparse");
 
 
 
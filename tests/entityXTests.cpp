@@ -9,6 +9,7 @@
 #include <entityx/entityx.h>
 
 #include "EntityXBenchmark.h"
+#include "scenarioBenchmark.h"
 
 inline void init_entities(entityx::EntityManager& entities, size_t nentities){
     for (size_t i = 0; i < nentities; i++) {
@@ -98,6 +99,64 @@ const std::vector<int> BenchmarksEntityX::ENTITIES = {
 
 BenchmarksEntityX entityxbenchmarks ("entityx");
 
+class EntityXScenarioWorld {
+    entityx::EventManager events;
+    entityx::EntityManager entities;
+
+    public:
+    struct Base {};
+
+    using Handle = entityx::Entity;
+
+    template<int N>
+    using C = ScenarioComponent<N, Base>;
+
+    EntityXScenarioWorld()
+        : entities(events) {}
+
+    Handle create() {
+        return entities.create();
+    }
+
+    void kill(Handle e) {
+        e.destroy();
+    }
+
+    template<class T>
+    void add(Handle e) {
+        e.assign<T>();
+    }
+
+    template<class T>
+    void remove(Handle e) {
+        e.remove<T>();
+    }
+
+    template<class T>
+    T* get(Handle e) {
+        return e.component<T>().get();
+    }
+
+    template<class... Ts, class F>
+    void each(F f) {
+        entities.each<Ts...>([&f](entityx::Entity, Ts&... components) {
+            f(components...);
+        });
+    }
+
+    static void runComplex(benchpress::context* ctx, size_t nentities) {
+        EntityXBenchmark::ComplexApplication app;
+        init_entities(app.entities, nentities);
+
+        ctx->reset_timer();
+        for (size_t i = 0; i < ctx->num_iterations(); ++i) {
+            app.update(EntityXBenchmark::fakeDeltaTime);
+        }
+    }
+};
+
+ScenarioBenchmarks<EntityXScenarioWorld> entityxScenarios ("entityx");
+
 
 
 
@@ -0,0 +1,253 @@
+#ifndef SCENARIOBENCHMARK_H_
+#define SCENARIOBENCHMARK_H_
+
+#include <algorithm>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "benchpress.hpp"
+
+/*
+ * Scenario benchmarks shared by every harness, so that each library runs the
+ * same workloads in the same order with the same random numbers.
+ *
+ * A harness supplies a World type, which must be default constructible and
+ * provide:
+ *
+ *     using Handle = ...;                        // an entity handle
+ *     template<int N> using C = ScenarioComponent<N, Base>;
+ *     Handle create();
+ *     void kill(Handle e);
+ *     template<class T> void add(Handle e);
+ *     template<class T> void remove(Handle e);
+ *     template<class T> T* get(Handle e);
+ *     template<class... Ts, class F> void each(F f);   // calls f(Ts&...)
+ *     static void runComplex(benchpress::context* ctx, size_t nentities);
+ *
+ * and registers the suite with:
+ *
+ *     ScenarioBenchmarks<World> scenarios("entities");
+ */
+
+/*
+ * The component used by the scenarios. Base is whatever the library needs
+ * components to derive from; N tells the eight component types apart.
+ */
+template<int N, class Base>
+struct ScenarioComponent : public Base {
+    float value = 1.0f;
+    float weight = 0.5f;
+};
+
+namespace scenario {
+
+constexpr unsigned int seed = 1337;
+
+/*
+ * A fixed sequence of random indices below n, cycled through by the timed
+ * loops so the random numbers cost nothing and match between harnesses.
+ */
+inline std::vector<size_t> randomIndices(size_t n, size_t count = 4096) {
+    std::mt19937 gen(seed);
+    std::uniform_int_distribution<size_t> dist(0, n - 1);
+    std::vector<size_t> indices(count);
+    for (auto& i : indices)
+        i = dist(gen);
+    return indices;
+}
+
+template<class... Ts>
+struct Sum {
+    float& total;
+
+    void operator()(Ts&... components) const {
+        total += (components.value + ...);
+    }
+};
+
+template<class World, int... Ns>
+void addAll(World& world, typename World::Handle e, std::integer_sequence<int, Ns...>) {
+    (world.template add<typename World::template C<Ns>>(e), ...);
+}
+
+template<class World, int... Ns>
+void addMasked(World& world, typename World::Handle e, size_t mask, std::integer_sequence<int, Ns...>) {
+    ((mask & (size_t(1) << Ns) ? world.template add<typename World::template C<Ns + 2>>(e) : void()), ...);
+}
+
+template<class World, int... Ns>
+float query(World& world, std::integer_sequence<int, Ns...>) {
+    float total = 0;
+    world.template each<typename World::template C<Ns>...>(
+        Sum<typename World::template C<Ns>...>{total});
+    return total;
+}
+
+/*
+ * Creates nentities entities that each have the first K components.
+ */
+template<class World, int K>
+std::vector<typename World::Handle> populate(World& world, size_t nentities) {
+    std::vector<typename World::Handle> handles;
+    handles.reserve(nentities);
+    for (size_t i = 0; i < nentities; i++) {
+        auto e = world.create();
+        addAll(world, e, std::make_integer_sequence<int, K>());
+        handles.push_back(e);
+    }
+    return handles;
+}
+
+} // namespace scenario
+
+/*
+ * Adds and then removes a component on a random entity, moving it to another
+ * archetype and back. One op is one add/remove pair.
+ */
+template<class World>
+void runComponentChurnScenario(benchpress::context* ctx, size_t nentities) {
+    using C7 = typename World::template C<7>;
+    World world;
+    auto handles = scenario::populate<World, 2>(world, nentities);
+    auto indices = scenario::randomIndices(nentities);
+
+    ctx->reset_timer();
+    for (size_t i = 0; i < ctx->num_iterations(); ++i) {
+        auto e = handles[indices[i % indices.size()]];
+        world.template add<C7>(e);
+        world.template remove<C7>(e);
+    }
+}
+
+/*
+ * Kills a random entity and creates a replacement with the same components.
+ */
+template<class World>
+void runEntityChurnScenario(benchpress::context* ctx, size_t nentities) {
+    World world;
+    auto handles = scenario::populate<World, 2>(world, nentities);
+    auto indices = scenario::randomIndices(nentities);
+
+    ctx->reset_timer();
+    for (size_t i = 0; i < ctx->num_iterations(); ++i) {
+        auto& e = handles[indices[i % indices.size()]];
+        world.kill(e);
+        e = world.create();
+        scenario::addAll(world, e, std::make_integer_sequence<int, 2>());
+    }
+}
+
+/*
+ * Fetches a component through a random entity handle.
+ */
+template<class World>
+void runRandomAccessScenario(benchpress::context* ctx, size_t nentities) {
+    using C0 = typename World::template C<0>;
+    World world;
+    auto handles = scenario::populate<World, 2>(world, nentities);
+    auto indices = scenario::randomIndices(nentities, 1 << 16);
+    float total = 0;
+
+    ctx->reset_timer();
+    for (size_t i = 0; i < ctx->num_iterations(); ++i) {
+        auto* c = world.template get<C0>(handles[indices[i % indices.size()]]);
+        total += c->value;
+    }
+    benchpress::escape(&total);
+}
+
+/*
+ * Runs through every entity with the first K of eight components. One op is
+ * one pass over all the entities.
+ */
+template<class World, int K>
+void runQueryScenario(benchpress::context* ctx, size_t nentities) {
+    World world;
+    scenario::populate<World, 8>(world, nentities);
+    float total = 0;
+
+    ctx->reset_timer();
+    for (size_t i = 0; i < ctx->num_iterations(); ++i)
+        total += scenario::query(world, std::make_integer_sequence<int, K>());
+    benchpress::escape(&total);
+}
+
+/*
+ * Runs through two components shared by entities spread over 64 different
+ * component sets.
+ */
+template<class World>
+void runFragmentedScenario(benchpress::context* ctx, size_t nentities) {
+    World world;
+    for (size_t i = 0; i < nentities; i++) {
+        auto e = world.create();
+        scenario::addAll(world, e, std::make_integer_sequence<int, 2>());
+        scenario::addMasked(world, e, i % 64, std::make_integer_sequence<int, 6>());
+    }
+    float total = 0;
+
+    ctx->reset_timer();
+    for (size_t i = 0; i < ctx->num_iterations(); ++i)
+        total += scenario::query(world, std::make_integer_sequence<int, 2>());
+    benchpress::escape(&total);
+}
+
+/*
+ * Runs through the survivors after killing nine in ten entities in random
+ * order and creating a quarter as many again in the freed slots.
+ */
+template<class World>
+void runKillChurnScenario(benchpress::context* ctx, size_t nentities) {
+    World world;
+    auto handles = scenario::populate<World, 2>(world, nentities);
+    std::shuffle(handles.begin(), handles.end(), std::mt19937(scenario::seed));
+    for (size_t i = 0; i < nentities - nentities / 10; i++)
+        world.kill(handles[i]);
+    scenario::populate<World, 2>(world, nentities / 4);
+    float total = 0;
+
+    ctx->reset_timer();
+    for (size_t i = 0; i < ctx->num_iterations(); ++i)
+        total += scenario::query(world, std::make_integer_sequence<int, 2>());
+    benchpress::escape(&total);
+}
+
+template<class World>
+class ScenarioBenchmarks {
+    public:
+    static constexpr size_t ENTITIES[] = {
+        10'000, 100'000
+    };
+
+    ScenarioBenchmarks(const std::string& lib) {
+        for (size_t nentities : ENTITIES) {
+            std::string prefix = "[" + std::to_string(nentities) + "]";
+            prefix.resize(11, ' ');
+            prefix += lib;
+            prefix.resize(prefix.size() < 20 ? 20 : prefix.size() + 1, ' ');
+            prefix += "scenario ";
+
+            add(prefix + "component churn", nentities, runComponentChurnScenario<World>);
+            add(prefix + "entity churn", nentities, runEntityChurnScenario<World>);
+            add(prefix + "random access", nentities, runRandomAccessScenario<World>);
+            add(prefix + "query 1 type", nentities, runQueryScenario<World, 1>);
+            add(prefix + "query 2 types", nentities, runQueryScenario<World, 2>);
+            add(prefix + "query 4 types", nentities, runQueryScenario<World, 4>);
+            add(prefix + "query 8 types", nentities, runQueryScenario<World, 8>);
+            add(prefix + "fragmented query", nentities, runFragmentedScenario<World>);
+            add(prefix + "query after kill churn", nentities, runKillChurnScenario<World>);
+            add(prefix + "complex systems update", nentities, World::runComplex);
+        }
+    }
+
+    private:
+    static void add(const std::string& name, size_t nentities, void (*run)(benchpress::context*, size_t)) {
+        benchpress::auto_register(name, [nentities, run](benchpress::context* ctx) {
+            run(ctx, nentities);
+        });
+    }
+};
+
+#endif // SCENARIOBENCHMARK_H_